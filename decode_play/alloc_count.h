@@ -0,0 +1,86 @@
+/* Heap allocation counter for checking that a player's steady state is
+ * allocation-free.
+ *
+ * When built with -DALLOC_COUNT, this header replaces malloc(), calloc(),
+ * realloc(), memalign(), aligned_alloc() and posix_memalign() for the whole
+ * program, so that allocations made by libraries (e.g. av_malloc(), which
+ * uses posix_memalign()) are counted as well. Replacements forward to
+ * glibc's internal allocator entry points, so this only works with glibc.
+ * Include it from exactly one translation unit. Replacements are declared
+ * with __THROW to match glibc declarations.
+ *
+ * Without ALLOC_COUNT, nothing is replaced and alloc_count() returns -1.
+ */
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <errno.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef ALLOC_COUNT
+
+static unsigned long alloc_count_n;
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) __THROW {
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) __THROW {
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) __THROW {
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) __THROW {
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) __THROW {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    __atomic_fetch_add(&alloc_count_n, 1, __ATOMIC_RELAXED);
+    void* p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+} // extern "C"
+
+// number of allocations since program start
+static inline long alloc_count() {
+    return (long)__atomic_load_n(&alloc_count_n, __ATOMIC_RELAXED);
+}
+
+#else // ALLOC_COUNT
+
+static inline long alloc_count() {
+    return -1;
+}
+
+#endif // ALLOC_COUNT
+
+#endif // ALLOC_COUNT_H
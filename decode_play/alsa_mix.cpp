@@ -0,0 +1,646 @@
+/* Read decoded audio samples from several files or FIFOs at once, mix them
+ * and send the result to ALSA using libasound.
+ *
+ * Input format:
+ *  - two channels (front left, front right)
+ *  - samples in interleaved format (L R L R ...)
+ *  - samples are little-endian 32-bit floats
+ *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
+ * Inputs may have different sample formats, but all of them must have the
+ * same number of channels and sample rate.
+ *
+ * Every input is read by its own thread into its own lock-free ring. Every
+ * period, the output thread takes one period from every ring, adds it to a
+ * float accumulator with input gain, clips the result and writes it to the
+ * device (see pcm_mix.h for vectorized kernels). If an input doesn't have a
+ * full period, it is mixed as silence until its ring is refilled to pre-roll
+ * depth; other inputs keep playing.
+ *
+ * Usage:
+ *   ./alsa_mix [options] input[:gain]...
+ *
+ * Gain is linear, 1 by default. Inputs are opened in order, so FIFOs block
+ * until their writers appear.
+ *
+ * Options:
+ *   -f, --format
+ *       device sample format: f32 (default), s16 or s24; integer formats
+ *       are dithered (see pcm_dither.h)
+ *   -r, --ring
+ *       ring size per input in milliseconds (default: 500)
+ *   -p, --preroll
+ *       how much of every ring is filled before input is mixed, and before
+ *       it's mixed again after underflow, milliseconds (default: 200)
+ *   -P, --period
+ *       period size in frames (default: about 11 ms)
+ *   -B, --buffer
+ *       buffer size in frames (default: 8 periods)
+ *   --fifo
+ *       run output thread with SCHED_FIFO policy and given priority
+ *   --mlock
+ *       lock all current and future memory pages, so that output thread
+ *       never waits for a page fault
+ *   --cpu
+ *       pin output thread to given CPU
+ *
+ * On exit, reports CPU time and mixing time per second of audio, clipped
+ * samples, device xruns, and underflows and dropped frames of every input.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+
+#include <alsa/asoundlib.h>
+
+#include "pcm_dither.h"
+#include "pcm_format.h"
+#include "pcm_mix.h"
+#include "spsc_queue.h"
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+// number of bytes read from input at once by reader thread
+static const size_t reader_block_size = 1 << 16;
+
+struct source {
+    const char* path;
+    float gain;
+    int fd;
+
+    // format from stream header, and samples read together with header if
+    // there was none
+    pcm_format format;
+    size_t frame_sz;
+    unsigned char head[PCM_HEADER_SIZE];
+    size_t head_sz;
+
+    spsc_queue<unsigned char>* ring;
+    std::atomic<bool> finished; // reader thread reached end of input
+    size_t preroll_sz;          // ring fill level to start or resume mixing
+    bool rebuffering;           // ring underflowed, waiting for pre-roll
+    bool done;                  // finished and ring is empty
+    unsigned char* period;      // samples taken from ring for current period
+
+    uint64_t n_underflows;
+    uint64_t n_dropped;         // frames mixed as silence
+
+    std::thread reader;
+};
+
+static snd_pcm_format_t alsa_format(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return SND_PCM_FORMAT_S16_LE;
+    case PCM_FORMAT_S24:
+        return SND_PCM_FORMAT_S24_LE;
+    default:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    }
+}
+
+// 'period_size' and 'buffer_size' are requested sizes, or zero for defaults;
+// they're replaced with actual sizes
+static void set_hw_params(snd_pcm_t* pcm, const pcm_format* format,
+                          snd_pcm_uframes_t* period_size, snd_pcm_uframes_t* buffer_size) {
+    //
+    snd_pcm_hw_params_t* hw_params = NULL;
+    snd_pcm_hw_params_alloca(&hw_params);
+
+    // initialize hw_params
+    if (snd_pcm_hw_params_any(pcm, hw_params) < 0) {
+        oops("snd_pcm_hw_params_any");
+    }
+
+    // enable software resampling
+    if (snd_pcm_hw_params_set_rate_resample(pcm, hw_params, 1) < 0) {
+        oops("snd_pcm_hw_params_set_rate_resample");
+    }
+
+    // set number of channels
+    if (snd_pcm_hw_params_set_channels(pcm, hw_params, format->channels) < 0) {
+        oops("snd_pcm_hw_params_set_channels");
+    }
+
+    // set interleaved format (L R L R ...)
+    if (snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
+        oops("snd_pcm_hw_params_set_access");
+    }
+
+    // set output sample format
+    if (snd_pcm_hw_params_set_format(
+            pcm, hw_params, alsa_format(format->sample_format)) < 0) {
+        oops("snd_pcm_hw_params_set_format");
+    }
+
+    // set sample rate
+    const unsigned int sample_rate = format->sample_rate;
+    unsigned int rate = sample_rate;
+    if (snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, 0) < 0) {
+        oops("snd_pcm_hw_params_set_rate_near");
+    }
+    if (rate != sample_rate) {
+        oops("can't set sample rate (exact value is not supported)");
+    }
+
+    // ALSA reads 'period_size' samples from circular buffer every period
+    if (*period_size != 0) {
+        if (snd_pcm_hw_params_set_period_size_near(pcm, hw_params, period_size, NULL) < 0) {
+            oops("snd_pcm_hw_params_set_period_size_near");
+        }
+    } else {
+        unsigned int period_time = sample_rate / 4;
+        if (snd_pcm_hw_params_set_period_time_near(pcm, hw_params, &period_time, NULL) < 0) {
+            oops("snd_pcm_hw_params_set_period_time_near");
+        }
+    }
+
+    *period_size = 0;
+    if (snd_pcm_hw_params_get_period_size(hw_params, period_size, NULL) < 0) {
+        oops("snd_pcm_hw_params_get_period_size");
+    }
+
+    // set buffer size, i.e. number of samples in circular buffer
+    if (*buffer_size == 0) {
+        *buffer_size = *period_size * 8;
+    }
+    if (snd_pcm_hw_params_set_buffer_size_near(pcm, hw_params, buffer_size) < 0) {
+        oops("snd_pcm_hw_params_set_buffer_size_near");
+    }
+
+    printf("period_size = %ld\n", (long)*period_size);
+    printf("buffer_size = %ld\n", (long)*buffer_size);
+
+    // send hw_params to ALSA
+    if (snd_pcm_hw_params(pcm, hw_params) < 0) {
+        oops("snd_pcm_hw_params");
+    }
+}
+
+static void set_sw_params(snd_pcm_t* pcm,
+                          snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size) {
+    //
+    snd_pcm_sw_params_t* sw_params = NULL;
+    snd_pcm_sw_params_alloca(&sw_params);
+
+    // initialize sw_params
+    if (snd_pcm_sw_params_current(pcm, sw_params) < 0) {
+        oops("snd_pcm_sw_params_current");
+    }
+
+    // start playback only after circular buffer becomes full first time
+    if (snd_pcm_sw_params_set_start_threshold(pcm, sw_params, buffer_size) < 0) {
+        oops("snd_pcm_sw_params_set_start_threshold");
+    }
+
+    // wake us up when there is room for a whole period
+    if (snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_size) < 0) {
+        oops("snd_pcm_sw_params_set_avail_min");
+    }
+
+    // send sw_params to ALSA
+    if (snd_pcm_sw_params(pcm, sw_params) < 0) {
+        oops("snd_pcm_sw_params");
+    }
+}
+
+// input path may be followed by ":gain"
+static void parse_source(source* s, const char* arg) {
+    s->gain = 1;
+
+    char* path = strdup(arg);
+    char* sep = strrchr(path, ':');
+    if (sep) {
+        char* end = NULL;
+        const double gain = strtod(sep + 1, &end);
+        if (end != sep + 1 && *end == '\0') {
+            *sep = '\0';
+            s->gain = (float)gain;
+        }
+    }
+
+    s->path = path;
+}
+
+static void open_source(source* s) {
+    if ((s->fd = open(s->path, O_RDONLY)) < 0) {
+        fprintf(stderr, "can't open %s: %s\n", s->path, strerror(errno));
+        exit(1);
+    }
+
+    const ssize_t head_sz = pcm_header_read(s->fd, &s->format, s->head);
+    if (head_sz < 0) {
+        fprintf(stderr, "invalid stream header in %s\n", s->path);
+        exit(1);
+    }
+    s->head_sz = (size_t)head_sz;
+
+    s->frame_sz = s->format.channels * pcm_format_sample_size(s->format.sample_format);
+}
+
+// reader thread: copy input to ring, blocking while it's full
+// only whole frames are written
+static void reader_thread(source* s) {
+    unsigned char* block = (unsigned char*)malloc(reader_block_size);
+    if (!block) {
+        oops("malloc()");
+    }
+
+    size_t size = s->head_sz;
+    memcpy(block, s->head, size);
+
+    for (;;) {
+        const ssize_t ret = read(s->fd, block + size, reader_block_size - size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oops("read()");
+        }
+        if (ret == 0) {
+            break;
+        }
+        size += (size_t)ret;
+
+        const size_t frames_sz = size / s->frame_sz * s->frame_sz;
+        for (size_t pos = 0; pos < frames_sz; ) {
+            s->ring->wait_write(1);
+            pos += s->ring->write(block + pos, frames_sz - pos);
+        }
+
+        memmove(block, block + frames_sz, size - frames_sz);
+        size -= frames_sz;
+    }
+
+    close(s->fd);
+    free(block);
+
+    s->finished.store(true, std::memory_order_release);
+}
+
+// block until every ring holds pre-roll or its reader is done
+static void wait_preroll(source* sources, int n_sources) {
+    for (int n = 0; n < n_sources; n++) {
+        source* s = &sources[n];
+        for (unsigned idle = 0;; idle++) {
+            if (s->finished.load(std::memory_order_acquire)
+                || s->ring->read_available() >= s->preroll_sz) {
+                break;
+            }
+            if (idle < 64) {
+                sched_yield();
+            } else {
+                struct timespec ts = { 0, 100000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+}
+
+// take up to 'n_frames' frames from ring into 'period'; never blocks:
+// missing frames are counted as dropped, and until ring is refilled to
+// pre-roll depth, nothing is taken
+// returns number of frames taken
+static size_t take_frames(source* s, size_t n_frames) {
+    // check flag before ring, so that nothing written before it was set
+    // can be missed
+    const bool finished = s->finished.load(std::memory_order_acquire);
+
+    const size_t avail_sz = s->ring->read_available();
+
+    if (s->rebuffering) {
+        if (!finished && avail_sz < s->preroll_sz) {
+            s->n_dropped += n_frames;
+            return 0;
+        }
+        s->rebuffering = false;
+    }
+
+    const size_t avail = avail_sz / s->frame_sz;
+
+    if (finished && avail <= n_frames) {
+        s->done = true;
+    }
+
+    size_t n = avail < n_frames ? avail : n_frames;
+    if (n < n_frames && !finished) {
+        s->n_underflows++;
+        s->n_dropped += n_frames - n;
+        s->rebuffering = true;
+    }
+
+    s->ring->read(s->period, n * s->frame_sz);
+
+    return n;
+}
+
+// add 'n_frames' frames of source to accumulator
+static void mix_frames(source* s, float* acc, size_t n_frames) {
+    const size_t n = n_frames * s->format.channels;
+
+    switch (s->format.sample_format) {
+    case PCM_FORMAT_S16:
+        pcm_mix_add_s16(acc, (const int16_t*)s->period, s->gain, n);
+        break;
+    case PCM_FORMAT_S24:
+        pcm_mix_add_s24(acc, (const int32_t*)s->period, s->gain, n);
+        break;
+    default:
+        pcm_mix_add_f32(acc, (const float*)s->period, s->gain, n);
+        break;
+    }
+}
+
+static double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// real-time settings for output (current) thread; failures are not fatal,
+// since they usually mean missing privileges
+static void set_realtime(int fifo_priority, bool lock_memory, int cpu) {
+    if (lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            fprintf(stderr, "warning: mlockall() failed: %s\n", strerror(errno));
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "warning: can't pin to cpu %d: %s\n", cpu, strerror(err));
+        }
+    }
+
+    if (fifo_priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifo_priority;
+
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "warning: can't set SCHED_FIFO: %s\n", strerror(err));
+        }
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-f f32|s16|s24] [-r ms] [-p ms] [-P frames] [-B frames]\n"
+            "          [--fifo priority] [--mlock] [--cpu n] input[:gain]...\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int sample_format = PCM_FORMAT_F32;
+    int ring_ms = 500;
+    int preroll_ms = 200;
+    snd_pcm_uframes_t period_size = 0, buffer_size = 0;
+    int fifo_priority = 0;
+    bool lock_memory = false;
+    int cpu = -1;
+
+    static const struct option long_opts[] = {
+        { "format", required_argument, NULL, 'f' },
+        { "ring", required_argument, NULL, 'r' },
+        { "preroll", required_argument, NULL, 'p' },
+        { "period", required_argument, NULL, 'P' },
+        { "buffer", required_argument, NULL, 'B' },
+        { "fifo", required_argument, NULL, 'F' },
+        { "mlock", no_argument, NULL, 'L' },
+        { "cpu", required_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:r:p:P:B:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            if ((sample_format = pcm_format_parse(optarg)) == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            ring_ms = atoi(optarg);
+            break;
+        case 'p':
+            preroll_ms = atoi(optarg);
+            break;
+        case 'P':
+            period_size = (snd_pcm_uframes_t)atol(optarg);
+            break;
+        case 'B':
+            buffer_size = (snd_pcm_uframes_t)atol(optarg);
+            break;
+        case 'F':
+            fifo_priority = atoi(optarg);
+            break;
+        case 'L':
+            lock_memory = true;
+            break;
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    const int n_sources = argc - optind;
+    if (n_sources == 0 || ring_ms <= 0 || preroll_ms < 0) {
+        usage(argv[0]);
+    }
+
+    source* sources = new source[n_sources];
+
+    for (int n = 0; n < n_sources; n++) {
+        parse_source(&sources[n], argv[optind + n]);
+        open_source(&sources[n]);
+
+        if (sources[n].format.channels != sources[0].format.channels
+            || sources[n].format.sample_rate != sources[0].format.sample_rate) {
+            fprintf(stderr, "%s: channels and sample rate differ from %s\n",
+                    sources[n].path, sources[0].path);
+            exit(1);
+        }
+    }
+
+    // device gets channels and rate of inputs and requested sample format
+    pcm_format format = sources[0].format;
+    format.sample_format = sample_format;
+
+    snd_pcm_t* pcm = NULL;
+    if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        oops("snd_pcm_open");
+    }
+
+    set_hw_params(pcm, &format, &period_size, &buffer_size);
+    set_sw_params(pcm, period_size, buffer_size);
+
+    const size_t n_samples = period_size * format.channels;
+
+    for (int n = 0; n < n_sources; n++) {
+        source* s = &sources[n];
+
+        const size_t bytes_per_ms = (size_t)format.sample_rate * s->frame_sz / 1000;
+
+        // ring must hold at least one period, and pre-roll must fit into it
+        size_t ring_sz = bytes_per_ms * ring_ms;
+        if (ring_sz < period_size * s->frame_sz) {
+            ring_sz = period_size * s->frame_sz;
+        }
+
+        s->ring = new spsc_queue<unsigned char>(ring_sz);
+        s->finished = false;
+        s->preroll_sz = bytes_per_ms * preroll_ms;
+        if (s->preroll_sz > s->ring->capacity()) {
+            s->preroll_sz = s->ring->capacity();
+        }
+        s->rebuffering = false;
+        s->done = false;
+        s->period = (unsigned char*)malloc(period_size * s->frame_sz);
+        s->n_underflows = 0;
+        s->n_dropped = 0;
+
+        // started before real-time settings are applied, so that readers
+        // inherit normal scheduling policy
+        s->reader = std::thread(reader_thread, s);
+    }
+
+    // accumulator, and device samples if they're not floats
+    float* acc = (float*)malloc(n_samples * sizeof(float));
+    void* out = sample_format == PCM_FORMAT_F32
+        ? (void*)acc : malloc(n_samples * pcm_format_sample_size(sample_format));
+
+    pcm_dither dither;
+    pcm_dither_init(&dither, 1);
+
+    set_realtime(fifo_priority, lock_memory, cpu);
+
+    wait_preroll(sources, n_sources);
+
+    uint64_t n_played = 0, n_clips = 0, n_xruns = 0;
+    double mix_time = 0;
+
+    const double cpu_start = cpu_seconds();
+
+    for (;;) {
+        const double mix_start = now_seconds();
+
+        memset(acc, 0, n_samples * sizeof(float));
+
+        // once every input is done, last period is as long as longest input
+        bool all_done = true;
+        size_t n_frames = 0;
+
+        for (int n = 0; n < n_sources; n++) {
+            source* s = &sources[n];
+            if (s->done) {
+                continue;
+            }
+
+            const size_t n_taken = take_frames(s, period_size);
+            mix_frames(s, acc, n_taken);
+
+            if (!s->done) {
+                all_done = false;
+            }
+            if (n_taken > n_frames) {
+                n_frames = n_taken;
+            }
+        }
+
+        if (!all_done) {
+            n_frames = period_size;
+        }
+        if (n_frames == 0) {
+            break;
+        }
+
+        const size_t n = n_frames * format.channels;
+
+        n_clips += pcm_mix_clip(acc, n);
+
+        if (sample_format == PCM_FORMAT_S16) {
+            pcm_dither_s16(&dither, acc, (int16_t*)out, n);
+        } else if (sample_format == PCM_FORMAT_S24) {
+            pcm_dither_s24(&dither, acc, (int32_t*)out, n);
+        }
+
+        mix_time += now_seconds() - mix_start;
+
+        int ret = snd_pcm_writei(pcm, out, n_frames);
+
+        if (ret < 0) {
+            if ((ret = snd_pcm_recover(pcm, ret, 1)) == 0) {
+                n_xruns++;
+            }
+        }
+
+        if (ret < 0) {
+            oops("snd_pcm_writei");
+        }
+
+        n_played += n_frames;
+    }
+
+    snd_pcm_drain(pcm);
+
+    const double cpu_time = cpu_seconds() - cpu_start;
+    const double duration = (double)n_played / format.sample_rate;
+    const double per_sec = duration > 0 ? 1 / duration : 0;
+
+    printf("inputs = %d\n", n_sources);
+    printf("cpu_time = %.3f ms per second of audio\n", cpu_time * 1e3 * per_sec);
+    printf("mix_time = %.3f ms per second of audio\n", mix_time * 1e3 * per_sec);
+    printf("clipped_samples = %llu\n", (unsigned long long)n_clips);
+    printf("device_xruns = %llu\n", (unsigned long long)n_xruns);
+
+    for (int n = 0; n < n_sources; n++) {
+        source* s = &sources[n];
+
+        s->reader.join();
+
+        printf("input = %s, gain = %.3f, format = %s, "
+               "underflows = %llu, dropped_frames = %llu\n",
+               s->path, s->gain, pcm_format_name(s->format.sample_format),
+               (unsigned long long)s->n_underflows, (unsigned long long)s->n_dropped);
+
+        delete s->ring;
+        free(s->period);
+    }
+
+    if (out != acc) {
+        free(out);
+    }
+    free(acc);
+
+    delete[] sources;
+
+    snd_pcm_close(pcm);
+
+    return 0;
+}
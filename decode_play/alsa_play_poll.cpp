@@ -0,0 +1,385 @@
+/* Read decoded audio samples from stdin and send them to one or several ALSA
+ * devices from a single poll() loop.
+ *
+ * Input format:
+ *  - two channels (front left, front right)
+ *  - samples in interleaved format (L R L R ...)
+ *  - samples are little-endian 32-bit floats
+ *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
+ *
+ * Neither stdin nor devices are ever waited on separately: stdin is made
+ * non-blocking, every PCM is opened with SND_PCM_NONBLOCK, and one poll()
+ * call waits for all of them. When a device is writable, exactly as many
+ * frames as snd_pcm_avail_update() reports (or as many as are buffered, if
+ * fewer) are written. With several devices, every one of them plays the
+ * same stream at its own pace; stdin is read only when the slowest device
+ * has taken what was buffered before.
+ *
+ * Usage:
+ *   ./alsa_play_poll [-d device]... [-l latency_ms] [-T file] [-i sec] < cool_song_samples
+ *
+ * Options:
+ *   -d  ALSA device, may be given several times (default: "default")
+ *   -l  device buffer length in milliseconds (default: 100)
+ *   -T  write telemetry JSON lines for every device to given file ("-" for
+ *       stderr), see alsa_telemetry.h
+ *   -i  seconds between telemetry lines (default: 1)
+ *
+ * On exit, reports number of poll() wakeups and context switches per second
+ * of audio, and frames and xruns for every device.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include <alsa/asoundlib.h>
+
+#include "alsa_telemetry.h"
+#include "pcm_format.h"
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+struct output {
+    const char* device;
+    snd_pcm_t* pcm;
+    int n_fds;     // number of poll descriptors of pcm
+    bool polled;   // descriptors were passed to current poll() call
+    size_t pos;    // position in staging buffer, bytes
+    uint64_t n_frames;
+    uint64_t n_xruns;
+    alsa_telemetry* telemetry; // NULL unless -T is given
+};
+
+static snd_pcm_format_t alsa_format(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return SND_PCM_FORMAT_S16_LE;
+    case PCM_FORMAT_S24:
+        return SND_PCM_FORMAT_S24_LE;
+    default:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    }
+}
+
+static void open_output(output* out, const char* device, const pcm_format* format,
+                        unsigned latency_us) {
+    memset(out, 0, sizeof(*out));
+    out->device = device;
+
+    if (snd_pcm_open(&out->pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+        oops("snd_pcm_open");
+    }
+
+    // start threshold is set to buffer size, and avail_min to period size,
+    // so that poll() wakes us up once per period
+    if (snd_pcm_set_params(out->pcm,
+                           alsa_format(format->sample_format),
+                           SND_PCM_ACCESS_RW_INTERLEAVED,
+                           format->channels,
+                           format->sample_rate,
+                           1,
+                           latency_us) < 0) {
+        oops("snd_pcm_set_params");
+    }
+
+    // keep everything set above, and only enable status timestamps
+    snd_pcm_sw_params_t* sw_params = NULL;
+    snd_pcm_sw_params_alloca(&sw_params);
+    if (snd_pcm_sw_params_current(out->pcm, sw_params) < 0) {
+        oops("snd_pcm_sw_params_current");
+    }
+    alsa_telemetry_set_sw_params(out->pcm, sw_params);
+    if (snd_pcm_sw_params(out->pcm, sw_params) < 0) {
+        oops("snd_pcm_sw_params");
+    }
+
+    out->n_fds = snd_pcm_poll_descriptors_count(out->pcm);
+    if (out->n_fds <= 0) {
+        oops("snd_pcm_poll_descriptors_count");
+    }
+}
+
+// write as many buffered frames as device can take now, without blocking
+static void write_output(output* out, const unsigned char* buf, size_t buf_len,
+                         size_t frame_sz) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(out->pcm);
+    if (avail < 0) {
+        if (out->telemetry) {
+            out->telemetry->on_xrun(out->pcm, (int)avail);
+        }
+        if (snd_pcm_recover(out->pcm, (int)avail, 1) < 0) {
+            oops("snd_pcm_avail_update");
+        }
+        out->n_xruns++;
+        return;
+    }
+
+    size_t n = (buf_len - out->pos) / frame_sz;
+    if (n > (size_t)avail) {
+        n = (size_t)avail;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    snd_pcm_sframes_t ret = snd_pcm_writei(out->pcm, buf + out->pos, n);
+    if (ret == -EAGAIN) {
+        return;
+    }
+    if (ret < 0) {
+        if (out->telemetry) {
+            out->telemetry->on_xrun(out->pcm, (int)ret);
+        }
+        if (snd_pcm_recover(out->pcm, (int)ret, 1) < 0) {
+            oops("snd_pcm_writei");
+        }
+        out->n_xruns++;
+        return;
+    }
+
+    out->pos += (size_t)ret * frame_sz;
+    out->n_frames += (uint64_t)ret;
+
+    if (out->telemetry) {
+        out->telemetry->on_write(out->pcm, out->n_frames);
+    }
+}
+
+static double cpu_seconds(const struct rusage* ru) {
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+        + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-d device]... [-l latency_ms] [-T file] [-i sec] < input_file\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    std::vector<const char*> devices;
+    int latency_ms = 100;
+    const char* telemetry_path = NULL;
+    double telemetry_interval = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:l:T:i:")) != -1) {
+        switch (opt) {
+        case 'd':
+            devices.push_back(optarg);
+            break;
+        case 'l':
+            latency_ms = atoi(optarg);
+            break;
+        case 'T':
+            telemetry_path = optarg;
+            break;
+        case 'i':
+            telemetry_interval = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || latency_ms <= 0 || telemetry_interval <= 0) {
+        usage(argv[0]);
+    }
+
+    if (devices.empty()) {
+        devices.push_back("default");
+    }
+
+    // header is read before stdin becomes non-blocking
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        oops("invalid stream header");
+    }
+
+    const int flags = fcntl(STDIN_FILENO, F_GETFL);
+    if (flags < 0 || fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) < 0) {
+        oops("fcntl(stdin)");
+    }
+
+    std::vector<output> outputs(devices.size());
+    for (size_t n = 0; n < devices.size(); n++) {
+        open_output(&outputs[n], devices[n], &format, (unsigned)latency_ms * 1000);
+    }
+
+    // one side thread per device; lines are small and written with single
+    // fprintf() calls, so they don't interleave
+    FILE* telemetry_fp = NULL;
+    if (telemetry_path) {
+        telemetry_fp = strcmp(telemetry_path, "-") == 0 ? stderr : fopen(telemetry_path, "w");
+        if (!telemetry_fp) {
+            oops("can't open telemetry file");
+        }
+        for (size_t n = 0; n < outputs.size(); n++) {
+            outputs[n].telemetry = new alsa_telemetry(
+                telemetry_fp, outputs[n].device, format.sample_rate, telemetry_interval);
+        }
+    }
+
+    const size_t frame_sz = format.channels * pcm_format_sample_size(format.sample_format);
+
+    // staging buffer holds samples read from stdin, until every device has
+    // taken them; one device buffer length is enough to keep all devices fed
+    const size_t buf_cap = ((size_t)format.sample_rate * latency_ms / 1000 + 1) * frame_sz;
+    std::vector<unsigned char> buf(buf_cap);
+
+    memcpy(&buf[0], head, head_sz);
+    size_t buf_len = head_sz;
+
+    bool eof = false;
+    uint64_t n_wakeups = 0;
+
+    std::vector<struct pollfd> fds;
+
+    struct rusage ru_start;
+    getrusage(RUSAGE_SELF, &ru_start);
+
+    for (;;) {
+        fds.clear();
+
+        // wait for stdin only if there's room for more samples
+        const bool poll_stdin = !eof && buf_len < buf_cap;
+        if (poll_stdin) {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            fds.push_back(pfd);
+        }
+
+        // wait for device only if there are samples for it, otherwise
+        // it would be reported as writable all the time
+        bool pending = false;
+        for (size_t n = 0; n < outputs.size(); n++) {
+            output* out = &outputs[n];
+            out->polled = buf_len - out->pos >= frame_sz;
+            if (!out->polled) {
+                continue;
+            }
+            pending = true;
+
+            const size_t first = fds.size();
+            fds.resize(first + out->n_fds);
+            if (snd_pcm_poll_descriptors(out->pcm, &fds[first], out->n_fds) < 0) {
+                oops("snd_pcm_poll_descriptors");
+            }
+        }
+
+        if (eof && !pending) {
+            break;
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oops("poll");
+        }
+        n_wakeups++;
+
+        size_t fd_pos = 0;
+
+        if (poll_stdin) {
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                const ssize_t ret = read(STDIN_FILENO, &buf[buf_len], buf_cap - buf_len);
+                if (ret > 0) {
+                    buf_len += (size_t)ret;
+                } else if (ret == 0) {
+                    eof = true;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    oops("read(stdin)");
+                }
+            }
+            fd_pos++;
+        }
+
+        for (size_t n = 0; n < outputs.size(); n++) {
+            output* out = &outputs[n];
+            if (!out->polled) {
+                continue;
+            }
+
+            unsigned short revents = 0;
+            if (snd_pcm_poll_descriptors_revents(
+                    out->pcm, &fds[fd_pos], out->n_fds, &revents) < 0) {
+                oops("snd_pcm_poll_descriptors_revents");
+            }
+            fd_pos += out->n_fds;
+
+            if (revents & (POLLOUT | POLLERR)) {
+                write_output(out, &buf[0], buf_len, frame_sz);
+            }
+        }
+
+        // drop samples taken by every device
+        size_t min_pos = buf_len;
+        for (size_t n = 0; n < outputs.size(); n++) {
+            if (outputs[n].pos < min_pos) {
+                min_pos = outputs[n].pos;
+            }
+        }
+        if (min_pos > 0) {
+            memmove(&buf[0], &buf[min_pos], buf_len - min_pos);
+            buf_len -= min_pos;
+            for (size_t n = 0; n < outputs.size(); n++) {
+                outputs[n].pos -= min_pos;
+            }
+        }
+    }
+
+    struct rusage ru_end;
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    for (size_t n = 0; n < outputs.size(); n++) {
+        output* out = &outputs[n];
+
+        // stream shorter than device buffer doesn't reach start threshold
+        if (snd_pcm_state(out->pcm) == SND_PCM_STATE_PREPARED && out->n_frames > 0) {
+            snd_pcm_start(out->pcm);
+        }
+
+        // drain would return -EAGAIN in non-blocking mode
+        snd_pcm_nonblock(out->pcm, 0);
+        snd_pcm_drain(out->pcm);
+
+        delete out->telemetry;
+    }
+
+    if (telemetry_fp && telemetry_fp != stderr) {
+        fclose(telemetry_fp);
+    }
+
+    const double duration = outputs.empty() ? 0
+        : (double)outputs[0].n_frames / format.sample_rate;
+
+    const double per_sec = duration > 0 ? 1 / duration : 0;
+
+    printf("wakeups = %llu (%.1f per second of audio)\n",
+           (unsigned long long)n_wakeups, n_wakeups * per_sec);
+    printf("context_switches = %.1f voluntary, %.1f involuntary per second of audio\n",
+           (ru_end.ru_nvcsw - ru_start.ru_nvcsw) * per_sec,
+           (ru_end.ru_nivcsw - ru_start.ru_nivcsw) * per_sec);
+    printf("cpu_time = %.3f ms per second of audio\n",
+           (cpu_seconds(&ru_end) - cpu_seconds(&ru_start)) * 1e3 * per_sec);
+
+    for (size_t n = 0; n < outputs.size(); n++) {
+        printf("device = %s, frames = %llu, xruns = %llu\n",
+               outputs[n].device,
+               (unsigned long long)outputs[n].n_frames,
+               (unsigned long long)outputs[n].n_xruns);
+
+        snd_pcm_close(outputs[n].pcm);
+    }
+
+    return 0;
+}
@@ -4,6 +4,8 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
  *
  * Usage:
  *   ./alsa_play_simple < cool_song_samples
@@ -14,9 +16,20 @@
 
 #include <alsa/asoundlib.h>
 
+#include "pcm_format.h"
+
 #define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
 
-static const int n_channels = 2, sample_rate = 44100;
+static snd_pcm_format_t alsa_format(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return SND_PCM_FORMAT_S16_LE;
+    case PCM_FORMAT_S24:
+        return SND_PCM_FORMAT_S24_LE;
+    default:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    }
+}
 
 int main(int argc, char** argv) {
     if (argc != 1) {
@@ -24,18 +37,26 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        oops("invalid stream header");
+    }
+
     snd_pcm_t* pcm = NULL;
     if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
         oops("snd_pcm_open");
     }
 
     if (snd_pcm_set_params(pcm,
-                           SND_PCM_FORMAT_FLOAT_LE,
+                           alsa_format(format.sample_format),
                            SND_PCM_ACCESS_RW_INTERLEAVED,
-                           n_channels,
-                           sample_rate,
+                           format.channels,
+                           format.sample_rate,
                            1,
-                           sample_rate / 4) < 0) {
+                           format.sample_rate / 4) < 0) {
         oops("snd_pcm_set_params");
     }
 
@@ -47,22 +68,29 @@ int main(int argc, char** argv) {
     printf("period_size = %ld\n", (long)period_size);
     printf("buffer_size = %ld\n", (long)buffer_size);
 
-    const int buf_sz = period_size * n_channels * sizeof(float);
-    void* buf = malloc(buf_sz);
+    const size_t frame_sz = format.channels * pcm_format_sample_size(format.sample_format);
+    const size_t buf_sz = period_size * frame_sz;
+    unsigned char* buf = (unsigned char*)malloc(buf_sz);
 
-    for (;;) {
-        memset(buf, 0, buf_sz);
+    memcpy(buf, head, head_sz);
+    size_t pending_sz = head_sz;
 
-        const ssize_t rd_sz = read(STDIN_FILENO, buf, buf_sz);
+    for (;;) {
+        // read whole period, since pipe may return less, and partial frame
+        // can't be written
+        const ssize_t rd_sz = pcm_read_full(STDIN_FILENO, buf + pending_sz, buf_sz - pending_sz);
         if (rd_sz < 0) {
             oops("read(stdin)");
         }
 
-        if (rd_sz == 0) {
+        const size_t n_frames = (pending_sz + rd_sz) / frame_sz;
+        pending_sz = 0;
+
+        if (n_frames == 0) {
             break;
         }
 
-        int ret = snd_pcm_writei(pcm, buf, period_size);
+        int ret = snd_pcm_writei(pcm, buf, n_frames);
 
         if (ret < 0) {
             if ((ret = snd_pcm_recover(pcm, ret, 1)) == 0) {
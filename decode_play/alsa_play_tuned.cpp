@@ -4,21 +4,122 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
  *
  * Usage:
- *   ./alsa_play_tuned < cool_song_samples
+ *   ./alsa_play_tuned [options] < cool_song_samples
+ *   ./alsa_play_tuned [options] first_song second_song ...
+ *
+ * If files (or FIFOs) are given instead of stdin, they are played one after
+ * another without closing or draining the device: the reader thread (-t is
+ * implied) opens the next one as soon as the previous one is read, and its
+ * samples follow the previous ones in the ring without a single frame in
+ * between. All files must have the same format as the first one; others
+ * are skipped. Silence inserted at track boundaries because the next file
+ * wasn't read in time is reported as inter-track gap, in frames.
+ *
+ * Options:
+ *   -m, --mmap
+ *       mmap mode: samples are read from stdin directly into ALSA ring
+ *       buffer areas (snd_pcm_mmap_begin/commit), instead of being read
+ *       into our buffer and copied to the ring by snd_pcm_writei(); if
+ *       device doesn't support mmap access, falls back to read/write
+ *   -t, --thread
+ *       read stdin in a separate thread into a lock-free ring, so that a
+ *       stalled upstream doesn't block the thread writing to the device;
+ *       if the ring runs dry, silence is written instead of the missing
+ *       samples until the ring is refilled to pre-roll depth
+ *   -r, --ring
+ *       ring size in milliseconds, with -t (default: 500)
+ *   -p, --preroll
+ *       how much of the ring is filled before playback starts, and before
+ *       it resumes after ring underflow, milliseconds (default: 200)
+ *   --fifo
+ *       run output thread with SCHED_FIFO policy and given priority
+ *   --mlock
+ *       lock all process memory with mlockall(), so that output thread
+ *       never waits for a page fault
+ *   --cpu
+ *       pin output thread to given CPU
+ *   -P, --period
+ *       period size in frames (default: about 11 ms)
+ *   -B, --buffer
+ *       buffer size in frames (default: 8 periods)
+ *   --autotune
+ *       don't play stdin; instead, play silence with decreasing period and
+ *       buffer sizes while other threads load the CPU, watching device
+ *       status for xruns, and find the lowest latency that stays xrun-free
+ *       for the whole soak time; result is saved to tune file and used by
+ *       later runs without -P and -B (real-time options above apply to
+ *       tuning too, so pass the same ones)
+ *   --soak
+ *       how long every geometry is played during autotune, seconds
+ *       (default: 10)
+ *   --load
+ *       number of threads loading the CPU during autotune (default: number
+ *       of cores)
+ *   --tune-file
+ *       where autotune result is stored (default: ~/.alsa_play_tuned)
+ *   --telemetry
+ *       write JSON lines with delay percentiles, time between writes, xruns
+ *       and recovery times to given file ("-" for stderr), see
+ *       alsa_telemetry.h
+ *   --telemetry-interval
+ *       seconds between telemetry lines (default: 1)
+ *
+ * On exit, reports number of bytes copied by the player, CPU time per
+ * second of audio, number of ring underflows (upstream was late) and
+ * device xruns (output thread was late), and inter-track gaps.
  */
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <alsa/asoundlib.h>
 
+#include "alsa_telemetry.h"
+#include "pcm_format.h"
+#include "spsc_queue.h"
+
 #define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
 
-static const int n_channels = 2, sample_rate = 44100;
+// number of bytes read from stdin at once by reader thread
+static const size_t reader_block_size = 1 << 16;
+
+// times when ring had less than requested and when device ran dry
+static uint64_t n_underflows;
+static uint64_t n_xruns;
+
+// set if --telemetry is given
+static alsa_telemetry* telemetry;
+
+static snd_pcm_format_t alsa_format(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return SND_PCM_FORMAT_S16_LE;
+    case PCM_FORMAT_S24:
+        return SND_PCM_FORMAT_S24_LE;
+    default:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    }
+}
 
-void set_hw_params(snd_pcm_t* pcm,
+// 'period_size' and 'buffer_size' are requested sizes, or zero for defaults;
+// they're replaced with actual sizes
+void set_hw_params(snd_pcm_t* pcm, const pcm_format* format, bool* use_mmap,
                    snd_pcm_uframes_t* period_size, snd_pcm_uframes_t* buffer_size) {
     //
     snd_pcm_hw_params_t* hw_params = NULL;
@@ -35,22 +136,35 @@ void set_hw_params(snd_pcm_t* pcm,
     }
 
     // set number of channels
-    if (snd_pcm_hw_params_set_channels(pcm, hw_params, n_channels) < 0) {
+    if (snd_pcm_hw_params_set_channels(pcm, hw_params, format->channels) < 0) {
         oops("snd_pcm_hw_params_set_channels");
     }
 
     // set interleaved format (L R L R ...)
-    if (int ret =
-        snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
-        oops("snd_pcm_hw_params_set_access");
+    // with mmap access, we write directly to ring buffer; not every device
+    // supports it, so fall back to read/write access
+    if (*use_mmap) {
+        if (snd_pcm_hw_params_set_access(
+                pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+            printf("mmap access is not supported, using read/write access\n");
+            *use_mmap = false;
+        }
+    }
+    if (!*use_mmap) {
+        if (snd_pcm_hw_params_set_access(
+                pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
+            oops("snd_pcm_hw_params_set_access");
+        }
     }
 
-    // set little endian 32-bit floats
-    if (snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_FLOAT_LE) < 0) {
+    // set little endian 32-bit floats, or integers if stream header says so
+    if (snd_pcm_hw_params_set_format(
+            pcm, hw_params, alsa_format(format->sample_format)) < 0) {
         oops("snd_pcm_hw_params_set_format");
     }
 
     // set sample rate
+    const unsigned int sample_rate = format->sample_rate;
     unsigned int rate = sample_rate;
     if (snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, 0) < 0) {
         oops("snd_pcm_hw_params_set_rate_near");
@@ -59,12 +173,19 @@ void set_hw_params(snd_pcm_t* pcm,
         oops("can't set sample rate (exact value is not supported)");
     }
 
-    // set period time in microseconds
     // ALSA reads 'period_size' samples from circular buffer every period
-    unsigned int period_time = sample_rate / 4;
-    if (int ret =
-        snd_pcm_hw_params_set_period_time_near(pcm, hw_params, &period_time, NULL) < 0) {
-        oops("snd_pcm_hw_params_set_period_time_near");
+    if (*period_size != 0) {
+        // set requested period size
+        if (snd_pcm_hw_params_set_period_size_near(pcm, hw_params, period_size, NULL) < 0) {
+            oops("snd_pcm_hw_params_set_period_size_near");
+        }
+    } else {
+        // set period time in microseconds
+        unsigned int period_time = sample_rate / 4;
+        if (snd_pcm_hw_params_set_period_time_near(
+                pcm, hw_params, &period_time, NULL) < 0) {
+            oops("snd_pcm_hw_params_set_period_time_near");
+        }
     }
 
     // get period size, i.e. number of samples fetched from circular buffer
@@ -74,8 +195,15 @@ void set_hw_params(snd_pcm_t* pcm,
         oops("snd_pcm_hw_params_get_period_size");
     }
 
+    unsigned int period_time = 0;
+    if (snd_pcm_hw_params_get_period_time(hw_params, &period_time, NULL) < 0) {
+        oops("snd_pcm_hw_params_get_period_time");
+    }
+
     // set buffer size, i.e. number of samples in circular buffer
-    *buffer_size = *period_size * 8;
+    if (*buffer_size == 0) {
+        *buffer_size = *period_size * 8;
+    }
     if (snd_pcm_hw_params_set_buffer_size_near(pcm, hw_params, buffer_size) < 0) {
         oops("snd_pcm_hw_params_set_buffer_size_near");
     }
@@ -121,58 +249,928 @@ void set_sw_params(snd_pcm_t* pcm,
         oops("snd_pcm_sw_params_set_avail_min");
     }
 
+    alsa_telemetry_set_sw_params(pcm, sw_params);
+
     // send sw_params to ALSA
     if (snd_pcm_sw_params(pcm, sw_params) < 0) {
         oops("snd_pcm_sw_params");
     }
 }
 
-int main(int argc, char** argv) {
-    if (argc != 1) {
-        fprintf(stderr, "usage: %s < input_file\n", argv[0]);
-        exit(1);
+// no track boundary ahead
+static const uint64_t no_boundary = (uint64_t)-1;
+
+// 'head' holds first bytes of stream that were read with header
+// if 'ring' is set, samples are taken from it instead of stdin
+struct input {
+    pcm_format format;
+    size_t frame_sz;
+    const unsigned char* head;
+    size_t head_sz;
+    int fd;
+
+    spsc_queue<unsigned char>* ring;
+    std::atomic<bool> finished; // reader thread reached end of input
+    size_t preroll_sz;          // ring fill level to start or resume playback
+    bool rebuffering;           // ring underflowed, waiting for pre-roll
+
+    // queue mode: files after the first one, opened by reader thread
+    char** files;
+    int n_files;
+    uint64_t n_dropped_bytes;   // incomplete frames at the end of files
+
+    // frame positions where next file starts, from reader to output
+    spsc_queue<uint64_t>* boundaries;
+    bool end_boundary;          // last boundary was followed by no playable file
+    uint64_t n_consumed;        // frames taken from ring, without silence
+    uint64_t boundary;          // next boundary, or no_boundary
+    std::vector<uint64_t> gaps; // silence frames inserted at every boundary
+};
+
+// open next queued file and check that its format is the same as of
+// the first one
+// returns -1 if it can't be played
+static int open_queued(input* in, const char* path, unsigned char* head, size_t* head_sz) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "warning: skipping %s: %s\n", path, strerror(errno));
+        return -1;
     }
 
-    snd_pcm_t* pcm = NULL;
-    if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
-        oops("snd_pcm_open");
+    pcm_format format;
+    const ssize_t ret = pcm_header_read(fd, &format, head);
+    if (ret < 0
+        || format.sample_format != in->format.sample_format
+        || format.channels != in->format.channels
+        || format.sample_rate != in->format.sample_rate) {
+        fprintf(stderr, "warning: skipping %s: format differs from first input\n", path);
+        close(fd);
+        return -1;
     }
 
-    snd_pcm_uframes_t period_size = 0, buffer_size = 0;
-    set_hw_params(pcm, &period_size, &buffer_size);
-    set_sw_params(pcm, period_size, buffer_size);
+    *head_sz = (size_t)ret;
+    return fd;
+}
+
+// reader thread: copy input to ring, blocking while it's full
+// only whole frames are written, so that in queue mode next file starts
+// exactly at frame boundary
+static void reader_thread(input* in) {
+    unsigned char* block = (unsigned char*)malloc(reader_block_size);
+    if (!block) {
+        oops("malloc()");
+    }
 
-    const int buf_sz = period_size * n_channels * sizeof(float);
-    void* buf = malloc(buf_sz);
+    size_t size = in->head_sz;
+    memcpy(block, in->head, size);
+
+    uint64_t n_written = 0; // frames
+    int next_file = 0;
 
     for (;;) {
-        memset(buf, 0, buf_sz);
+        const ssize_t ret = read(in->fd, block + size, reader_block_size - size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            oops("read()");
+        }
+
+        if (ret == 0) {
+            // incomplete frame at the end of file can't be played
+            in->n_dropped_bytes += size;
+            size = 0;
+
+            if (next_file == in->n_files) {
+                break;
+            }
 
-        const ssize_t rd_sz = read(STDIN_FILENO, buf, buf_sz);
-        if (rd_sz < 0) {
-            oops("read(stdin)");
+            // published before next file is opened, which may block (e.g.
+            // FIFO without writer), so that silence played meanwhile is
+            // counted as gap
+            in->boundaries->push(n_written);
+
+            // switch to next file that can be played
+            if (in->fd != STDIN_FILENO) {
+                close(in->fd);
+            }
+            in->fd = -1;
+            while (in->fd < 0 && next_file < in->n_files) {
+                unsigned char head[PCM_HEADER_SIZE];
+                in->fd = open_queued(in, in->files[next_file++], head, &size);
+                if (in->fd >= 0) {
+                    memcpy(block, head, size);
+                }
+            }
+            if (in->fd < 0) {
+                // published by 'finished' below
+                in->end_boundary = true;
+                break;
+            }
+            continue;
+        }
+
+        size += (size_t)ret;
+
+        const size_t frames_sz = size / in->frame_sz * in->frame_sz;
+        for (size_t pos = 0; pos < frames_sz; ) {
+            in->ring->wait_write(1);
+            pos += in->ring->write(block + pos, frames_sz - pos);
+        }
+        n_written += frames_sz / in->frame_sz;
+
+        memmove(block, block + frames_sz, size - frames_sz);
+        size -= frames_sz;
+    }
+
+    if (in->fd >= 0 && in->fd != STDIN_FILENO) {
+        close(in->fd);
+    }
+
+    free(block);
+
+    in->finished.store(true, std::memory_order_release);
+}
+
+// block until ring holds pre-roll or reader is done
+static void wait_preroll(input* in) {
+    for (unsigned idle = 0;; idle++) {
+        if (in->finished.load(std::memory_order_acquire)
+            || in->ring->read_available() >= in->preroll_sz) {
+            return;
+        }
+        if (idle < 64) {
+            sched_yield();
+        } else {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
         }
+    }
+}
 
-        if (rd_sz == 0) {
+// account silence written at current position: if it's a boundary between
+// files, silence is gap between them
+static void account_silence(input* in, size_t n_frames) {
+    if (!in->boundaries) {
+        return;
+    }
+
+    // skip boundaries that playback has passed
+    for (;;) {
+        if (in->boundary != no_boundary && in->boundary >= in->n_consumed) {
             break;
         }
+        uint64_t boundary = 0;
+        if (in->boundaries->read(&boundary, 1) == 0) {
+            in->boundary = no_boundary;
+            return;
+        }
+        in->boundary = boundary;
+        in->gaps.push_back(0);
+    }
+
+    if (in->boundary == in->n_consumed) {
+        in->gaps.back() += n_frames;
+    }
+}
+
+// take up to 'n_frames' whole frames from ring into 'buf'; never blocks:
+// if ring doesn't have enough, the rest is filled with silence, and until
+// ring is refilled to pre-roll depth, only silence is returned
+// returns number of frames, 0 on end of stream
+static size_t read_ring(input* in, unsigned char* buf, size_t n_frames) {
+    // check flag before ring, so that nothing written before it was set
+    // can be missed
+    const bool done = in->finished.load(std::memory_order_acquire);
 
-        int ret = snd_pcm_writei(pcm, buf, period_size);
+    const size_t avail_sz = in->ring->read_available();
+
+    if (in->rebuffering) {
+        if (!done && avail_sz < in->preroll_sz) {
+            memset(buf, 0, n_frames * in->frame_sz);
+            account_silence(in, n_frames);
+            return n_frames;
+        }
+        in->rebuffering = false;
+    }
+
+    const size_t avail = avail_sz / in->frame_sz;
+
+    if (avail >= n_frames || done) {
+        const size_t n = avail < n_frames ? avail : n_frames;
+        in->ring->read(buf, n * in->frame_sz);
+        in->n_consumed += n;
+        return n;
+    }
+
+    n_underflows++;
+    in->rebuffering = true;
+
+    in->ring->read(buf, avail * in->frame_sz);
+    memset(buf + avail * in->frame_sz, 0, (n_frames - avail) * in->frame_sz);
+    in->n_consumed += avail;
+    account_silence(in, n_frames - avail);
+
+    return n_frames;
+}
+
+// read up to 'n_frames' whole frames from stdin into 'buf', taking
+// bytes from 'head' first
+// returns number of frames read, 0 on end of stream
+static size_t read_frames(input* in, unsigned char* buf, size_t n_frames) {
+    if (in->ring) {
+        return read_ring(in, buf, n_frames);
+    }
+
+    const size_t buf_sz = n_frames * in->frame_sz;
+
+    size_t pending_sz = in->head_sz < buf_sz ? in->head_sz : buf_sz;
+    memcpy(buf, in->head, pending_sz);
+    in->head += pending_sz;
+    in->head_sz -= pending_sz;
+
+    // read whole frames, since pipe may return less, and partial frame
+    // can't be written
+    const ssize_t rd_sz = pcm_read_full(in->fd, buf + pending_sz, buf_sz - pending_sz);
+    if (rd_sz < 0) {
+        oops("read(stdin)");
+    }
+
+    return (pending_sz + rd_sz) / in->frame_sz;
+}
+
+// recover from xrun or suspend reported as 'err'
+// returns snd_pcm_recover() result
+static int recover(snd_pcm_t* pcm, int err) {
+    if (telemetry) {
+        telemetry->on_xrun(pcm, err);
+    }
+
+    const int ret = snd_pcm_recover(pcm, err, 1);
+    if (ret == 0) {
+        // with telemetry, xruns are reported there, out of the hot loop
+        if (!telemetry) {
+            printf("recovered after xrun (overrun/underrun)\n");
+        }
+        n_xruns++;
+    }
+
+    return ret;
+}
+
+// read stdin into our buffer and copy it to ring buffer with snd_pcm_writei()
+// returns number of played frames
+static uint64_t play_rw(snd_pcm_t* pcm, input* in, snd_pcm_uframes_t period_size) {
+    unsigned char* buf = (unsigned char*)malloc(period_size * in->frame_sz);
+
+    uint64_t n_played = 0;
+
+    for (;;) {
+        const size_t n_frames = read_frames(in, buf, period_size);
+        if (n_frames == 0) {
+            break;
+        }
+
+        int ret = snd_pcm_writei(pcm, buf, n_frames);
 
         if (ret < 0) {
-            if ((ret = snd_pcm_recover(pcm, ret, 1)) == 0) {
-                printf("recovered after xrun (overrun/underrun)\n");
-            }
+            ret = recover(pcm, ret);
         }
 
         if (ret < 0) {
             oops("snd_pcm_writei");
         }
+
+        n_played += n_frames;
+
+        if (telemetry) {
+            telemetry->on_write(pcm, n_played);
+        }
     }
 
     free(buf);
 
+    return n_played;
+}
+
+// read stdin directly into ring buffer areas
+// returns number of played frames
+static uint64_t play_mmap(snd_pcm_t* pcm, input* in, snd_pcm_uframes_t period_size) {
+    uint64_t n_played = 0;
+
+    for (bool eof = false; !eof; ) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (recover(pcm, (int)avail) < 0) {
+                oops("snd_pcm_avail_update");
+            }
+            continue;
+        }
+
+        if ((snd_pcm_uframes_t)avail < period_size) {
+            // with mmap access, playback isn't started automatically, so
+            // start it when ring buffer becomes full first time
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                if (snd_pcm_start(pcm) < 0) {
+                    oops("snd_pcm_start");
+                }
+                continue;
+            }
+
+            // wait until ALSA consumes a period
+            const int err = snd_pcm_wait(pcm, -1);
+            if (err < 0) {
+                if (recover(pcm, err) < 0) {
+                    oops("snd_pcm_wait");
+                }
+            }
+            continue;
+        }
+
+        // fill available space, period by period
+        while (avail > 0) {
+            const snd_pcm_channel_area_t* areas = NULL;
+            snd_pcm_uframes_t offset = 0;
+            snd_pcm_uframes_t frames = period_size;
+
+            // get contiguous region of ring buffer; it may be shorter than
+            // requested if it wraps around
+            int ret = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+            if (ret < 0) {
+                if (recover(pcm, ret) < 0) {
+                    oops("snd_pcm_mmap_begin");
+                }
+                break;
+            }
+
+            // interleaved: all channels share one area, 'step' is frame size in bits
+            unsigned char* dst = (unsigned char*)areas[0].addr
+                + areas[0].first / 8 + offset * areas[0].step / 8;
+
+            const size_t n_frames = read_frames(in, dst, frames);
+            if (n_frames < frames) {
+                eof = true;
+            }
+
+            snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, n_frames);
+            if (committed < 0 || (snd_pcm_uframes_t)committed != n_frames) {
+                if (recover(pcm, committed >= 0 ? -EPIPE : (int)committed) < 0) {
+                    oops("snd_pcm_mmap_commit");
+                }
+                break;
+            }
+
+            n_played += n_frames;
+
+            if (telemetry) {
+                telemetry->on_write(pcm, n_played);
+            }
+
+            if (eof) {
+                break;
+            }
+
+            avail -= n_frames;
+        }
+    }
+
+    // stream shorter than ring buffer was never started
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED && n_played > 0) {
+        if (snd_pcm_start(pcm) < 0) {
+            oops("snd_pcm_start");
+        }
+    }
+
+    return n_played;
+}
+
+static double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// real-time settings for output (current) thread; failures are not fatal,
+// since they usually mean missing privileges
+static void set_realtime(int fifo_priority, bool lock_memory, int cpu) {
+    if (lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            fprintf(stderr, "warning: mlockall() failed: %s\n", strerror(errno));
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "warning: can't pin to cpu %d: %s\n", cpu, strerror(err));
+        }
+    }
+
+    if (fifo_priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifo_priority;
+
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "warning: can't set SCHED_FIFO: %s\n", strerror(err));
+        }
+    }
+}
+
+// autotune: keep CPU and caches busy until 'stop' is set
+static void load_thread(const std::atomic<bool>* stop) {
+    // don't inherit real-time policy of output thread
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+    // nor its CPU pinning, otherwise all load lands on output CPU; kernel
+    // drops CPUs that don't exist or aren't allowed
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        CPU_SET(cpu, &cpus);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    std::vector<uint32_t> mem(1 << 20);
+
+    uint32_t x = 1;
+    while (!stop->load(std::memory_order_relaxed)) {
+        for (int n = 0; n < 4096; n++) {
+            x = x * 1664525u + 1013904223u;
+            mem[x & (mem.size() - 1)] += x;
+        }
+    }
+}
+
+// autotune: play silence with given geometry for 'soak' seconds, checking
+// device status after every write
+// returns false on first xrun; 'headroom' is set to the minimum number of
+// frames that were left in buffer
+static bool soak_geometry(const pcm_format* format, double soak,
+                          snd_pcm_uframes_t* period_size, snd_pcm_uframes_t* buffer_size,
+                          snd_pcm_uframes_t* headroom) {
+    snd_pcm_t* pcm = NULL;
+    if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        oops("snd_pcm_open");
+    }
+
+    bool use_mmap = false;
+    set_hw_params(pcm, format, &use_mmap, period_size, buffer_size);
+    set_sw_params(pcm, *period_size, *buffer_size);
+
+    const size_t frame_sz = format->channels * pcm_format_sample_size(format->sample_format);
+    unsigned char* buf = (unsigned char*)calloc(*period_size, frame_sz);
+
+    snd_pcm_status_t* status = NULL;
+    snd_pcm_status_alloca(&status);
+
+    const uint64_t total = (uint64_t)(soak * format->sample_rate);
+
+    snd_pcm_uframes_t max_avail = 0;
+    bool ok = true;
+
+    for (uint64_t n_written = 0; n_written < total; ) {
+        snd_pcm_sframes_t ret = snd_pcm_writei(pcm, buf, *period_size);
+        if (ret < 0) {
+            ok = false;
+            break;
+        }
+        n_written += (uint64_t)ret;
+
+        if (snd_pcm_status(pcm, status) < 0) {
+            oops("snd_pcm_status");
+        }
+
+        const snd_pcm_state_t state = snd_pcm_status_get_state(status);
+        if (state == SND_PCM_STATE_XRUN) {
+            ok = false;
+            break;
+        }
+
+        // largest free space since previous call, i.e. how close the
+        // device came to running dry
+        if (state == SND_PCM_STATE_RUNNING) {
+            const snd_pcm_uframes_t avail = snd_pcm_status_get_avail_max(status);
+            if (avail > max_avail) {
+                max_avail = avail;
+            }
+        }
+    }
+
+    *headroom = max_avail < *buffer_size ? *buffer_size - max_avail : 0;
+
+    snd_pcm_drop(pcm);
+    snd_pcm_close(pcm);
+
+    free(buf);
+
+    return ok;
+}
+
+// autotune: step down through candidate geometries until one fails,
+// and return the last one that didn't
+// returns false if even the largest one failed
+static bool autotune(const pcm_format* format, double soak, size_t n_load,
+                     snd_pcm_uframes_t* best_period, snd_pcm_uframes_t* best_buffer) {
+    std::atomic<bool> stop(false);
+
+    std::vector<std::thread> load;
+    for (size_t n = 0; n < n_load; n++) {
+        load.push_back(std::thread(load_thread, &stop));
+    }
+
+    bool found = false;
+
+    // every period size is tried with 4 and then 2 periods per buffer
+    for (snd_pcm_uframes_t period = 4096; period >= 16; period /= 2) {
+        bool failed = false;
+
+        for (snd_pcm_uframes_t n_periods = 4; n_periods >= 2; n_periods -= 2) {
+            snd_pcm_uframes_t period_size = period, buffer_size = period * n_periods;
+            snd_pcm_uframes_t headroom = 0;
+
+            const bool ok = soak_geometry(format, soak, &period_size, &buffer_size, &headroom);
+
+            printf("autotune: period_size = %lu, buffer_size = %lu, latency = %.2f ms: %s",
+                   (unsigned long)period_size, (unsigned long)buffer_size,
+                   buffer_size * 1e3 / format->sample_rate, ok ? "ok" : "xrun");
+            if (ok) {
+                printf(", min headroom %.2f ms", headroom * 1e3 / format->sample_rate);
+            }
+            printf("\n");
+
+            if (!ok) {
+                failed = true;
+                break;
+            }
+
+            // device may round sizes, so the same geometry may come again
+            if (!found || buffer_size < *best_buffer) {
+                *best_period = period_size;
+                *best_buffer = buffer_size;
+                found = true;
+            }
+        }
+
+        if (failed) {
+            break;
+        }
+    }
+
+    stop.store(true);
+    for (size_t n = 0; n < load.size(); n++) {
+        load[n].join();
+    }
+
+    return found;
+}
+
+static std::string default_tune_file() {
+    const char* home = getenv("HOME");
+    return std::string(home ? home : ".") + "/.alsa_play_tuned";
+}
+
+// tune file holds period and buffer time in microseconds, so that it can
+// be used with any sample rate
+static void save_tune_file(const char* path, const pcm_format* format,
+                           snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size) {
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "warning: can't write %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "%llu %llu\n",
+            (unsigned long long)period_size * 1000000 / format->sample_rate,
+            (unsigned long long)buffer_size * 1000000 / format->sample_rate);
+    fclose(fp);
+}
+
+// returns false if there is no tune file
+static bool load_tune_file(const char* path, const pcm_format* format,
+                           snd_pcm_uframes_t* period_size, snd_pcm_uframes_t* buffer_size) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+
+    unsigned long long period_us = 0, buffer_us = 0;
+    const bool ok = fscanf(fp, "%llu %llu", &period_us, &buffer_us) == 2
+        && period_us > 0 && buffer_us >= period_us;
+    fclose(fp);
+
+    if (!ok) {
+        fprintf(stderr, "warning: ignoring malformed %s\n", path);
+        return false;
+    }
+
+    *period_size = (snd_pcm_uframes_t)(period_us * format->sample_rate / 1000000);
+    *buffer_size = (snd_pcm_uframes_t)(buffer_us * format->sample_rate / 1000000);
+
+    return *period_size > 0;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-m] [-t] [-r ms] [-p ms] [--fifo priority] [--mlock] [--cpu n]\n"
+            "          [-P frames] [-B frames] [--tune-file path]\n"
+            "          [--telemetry path] [--telemetry-interval sec]\n"
+            "          < input_file | input_file...\n"
+            "       %s --autotune [--soak sec] [--load threads] [--tune-file path]\n"
+            "          [--fifo priority] [--mlock] [--cpu n]\n", argv0, argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    bool use_mmap = false;
+    bool use_thread = false;
+    int ring_ms = 500, preroll_ms = 200;
+    int fifo_priority = 0;
+    bool lock_memory = false;
+    int cpu = -1;
+    snd_pcm_uframes_t period_size = 0, buffer_size = 0;
+    bool tune = false;
+    double soak = 10;
+    size_t n_load = std::thread::hardware_concurrency();
+    std::string tune_file = default_tune_file();
+    const char* telemetry_path = NULL;
+    double telemetry_interval = 1;
+
+    static const struct option long_opts[] = {
+        { "mmap", no_argument, NULL, 'm' },
+        { "thread", no_argument, NULL, 't' },
+        { "ring", required_argument, NULL, 'r' },
+        { "preroll", required_argument, NULL, 'p' },
+        { "fifo", required_argument, NULL, 'F' },
+        { "mlock", no_argument, NULL, 'L' },
+        { "cpu", required_argument, NULL, 'C' },
+        { "period", required_argument, NULL, 'P' },
+        { "buffer", required_argument, NULL, 'B' },
+        { "autotune", no_argument, NULL, 'U' },
+        { "soak", required_argument, NULL, 'S' },
+        { "load", required_argument, NULL, 'O' },
+        { "tune-file", required_argument, NULL, 'T' },
+        { "telemetry", required_argument, NULL, 'J' },
+        { "telemetry-interval", required_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "mtr:p:P:B:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            use_mmap = true;
+            break;
+        case 't':
+            use_thread = true;
+            break;
+        case 'r':
+            ring_ms = atoi(optarg);
+            break;
+        case 'p':
+            preroll_ms = atoi(optarg);
+            break;
+        case 'F':
+            fifo_priority = atoi(optarg);
+            break;
+        case 'L':
+            lock_memory = true;
+            break;
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+        case 'P':
+            period_size = (snd_pcm_uframes_t)atol(optarg);
+            break;
+        case 'B':
+            buffer_size = (snd_pcm_uframes_t)atol(optarg);
+            break;
+        case 'U':
+            tune = true;
+            break;
+        case 'S':
+            soak = atof(optarg);
+            break;
+        case 'O':
+            n_load = (size_t)atoi(optarg);
+            break;
+        case 'T':
+            tune_file = optarg;
+            break;
+        case 'J':
+            telemetry_path = optarg;
+            break;
+        case 'I':
+            telemetry_interval = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (ring_ms <= 0 || preroll_ms < 0 || soak <= 0 || telemetry_interval <= 0) {
+        usage(argv[0]);
+    }
+
+    // queue mode: files are opened by reader thread
+    char** files = argv + optind;
+    const int n_files = argc - optind;
+    if (n_files > 0) {
+        use_thread = true;
+    }
+
+    if (tune) {
+        if (n_files > 0) {
+            usage(argv[0]);
+        }
+
+        pcm_format format;
+        pcm_format_default(&format);
+
+        set_realtime(fifo_priority, lock_memory, cpu);
+
+        if (!autotune(&format, soak, n_load, &period_size, &buffer_size)) {
+            oops("autotune: no geometry is xrun-free");
+        }
+
+        printf("autotune: best period_size = %lu, buffer_size = %lu, latency = %.2f ms\n",
+               (unsigned long)period_size, (unsigned long)buffer_size,
+               buffer_size * 1e3 / format.sample_rate);
+
+        save_tune_file(tune_file.c_str(), &format, period_size, buffer_size);
+
+        return 0;
+    }
+
+    int fd = STDIN_FILENO;
+    if (n_files > 0) {
+        if ((fd = open(files[0], O_RDONLY)) < 0) {
+            oops("can't open first input");
+        }
+    }
+
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(fd, &format, head);
+    if (head_sz < 0) {
+        oops("invalid stream header");
+    }
+
+    snd_pcm_t* pcm = NULL;
+    if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        oops("snd_pcm_open");
+    }
+
+    // geometry found by autotune, unless given explicitly
+    if (period_size == 0 && buffer_size == 0) {
+        if (load_tune_file(tune_file.c_str(), &format, &period_size, &buffer_size)) {
+            printf("using geometry from %s\n", tune_file.c_str());
+        }
+    }
+
+    set_hw_params(pcm, &format, &use_mmap, &period_size, &buffer_size);
+    set_sw_params(pcm, period_size, buffer_size);
+
+    input in;
+    in.format = format;
+    in.frame_sz = format.channels * pcm_format_sample_size(format.sample_format);
+    in.head = head;
+    in.head_sz = head_sz;
+    in.fd = fd;
+    in.ring = NULL;
+    in.finished = false;
+    in.preroll_sz = 0;
+    in.rebuffering = false;
+    in.files = n_files > 0 ? files + 1 : NULL;
+    in.n_files = n_files > 0 ? n_files - 1 : 0;
+    in.n_dropped_bytes = 0;
+    in.boundaries = n_files > 1 ? new spsc_queue<uint64_t>(n_files) : NULL;
+    in.end_boundary = false;
+    in.n_consumed = 0;
+    in.boundary = no_boundary;
+
+    std::thread reader;
+
+    if (use_thread) {
+        const size_t bytes_per_ms = (size_t)format.sample_rate * in.frame_sz / 1000;
+
+        // ring must hold at least one period, and pre-roll must fit into it
+        size_t ring_sz = bytes_per_ms * ring_ms;
+        if (ring_sz < period_size * in.frame_sz) {
+            ring_sz = period_size * in.frame_sz;
+        }
+
+        in.ring = new spsc_queue<unsigned char>(ring_sz);
+
+        in.preroll_sz = bytes_per_ms * preroll_ms;
+        if (in.preroll_sz > in.ring->capacity()) {
+            in.preroll_sz = in.ring->capacity();
+        }
+
+        // started before real-time settings are applied, so that reader
+        // inherits normal scheduling policy
+        reader = std::thread(reader_thread, &in);
+    }
+
+    FILE* telemetry_fp = NULL;
+    if (telemetry_path) {
+        telemetry_fp = strcmp(telemetry_path, "-") == 0 ? stderr : fopen(telemetry_path, "w");
+        if (!telemetry_fp) {
+            oops("can't open telemetry file");
+        }
+        // like reader, side thread keeps normal scheduling policy
+        telemetry = new alsa_telemetry(
+            telemetry_fp, "default", format.sample_rate, telemetry_interval);
+    }
+
+    set_realtime(fifo_priority, lock_memory, cpu);
+
+    if (use_thread) {
+        wait_preroll(&in);
+    }
+
+    const double cpu_start = cpu_seconds();
+
+    const uint64_t n_frames = use_mmap
+        ? play_mmap(pcm, &in, period_size)
+        : play_rw(pcm, &in, period_size);
+
     snd_pcm_drain(pcm);
+
+    if (telemetry) {
+        delete telemetry;
+        telemetry = NULL;
+        if (telemetry_fp != stderr) {
+            fclose(telemetry_fp);
+        }
+    }
+
+    if (use_thread) {
+        reader.join();
+        delete in.ring;
+    }
+
+    // boundaries that were passed without silence
+    if (in.boundaries) {
+        uint64_t boundary = 0;
+        while (in.boundaries->read(&boundary, 1) == 1) {
+            in.gaps.push_back(0);
+        }
+        delete in.boundaries;
+    }
+
+    // silence at the last boundary was spent waiting for files which
+    // turned out unplayable, so it's not between tracks
+    uint64_t end_gap = 0;
+    if (in.end_boundary && !in.gaps.empty()) {
+        end_gap = in.gaps.back();
+        in.gaps.pop_back();
+    }
+
+    // in read/write mode, every byte is copied by read() into our buffer
+    // and then by snd_pcm_writei() into ring buffer; in mmap mode, read()
+    // copies it into ring buffer, and that's all; reader thread adds one
+    // more copy, from its block to lock-free ring
+    // CPU time includes reader thread
+    const double cpu_time = cpu_seconds() - cpu_start;
+    const double duration = (double)n_frames / format.sample_rate;
+    const uint64_t n_bytes = n_frames * in.frame_sz;
+    const int n_copies = (use_mmap ? 1 : 2) + (use_thread ? 1 : 0);
+
+    printf("access = %s\n", use_mmap ? "mmap" : "rw");
+    printf("bytes_copied = %llu (%d copies per byte)\n",
+           (unsigned long long)(n_bytes * n_copies), n_copies);
+    printf("cpu_time = %.3f ms per second of audio\n",
+           duration > 0 ? cpu_time * 1e3 / duration : 0.0);
+    printf("ring_underflows = %llu\n", (unsigned long long)n_underflows);
+    printf("device_xruns = %llu\n", (unsigned long long)n_xruns);
+
+    if (n_files > 1) {
+        uint64_t max_gap = 0;
+        for (size_t n = 0; n < in.gaps.size(); n++) {
+            printf("gap_frames[%zu] = %llu\n", n, (unsigned long long)in.gaps[n]);
+            if (in.gaps[n] > max_gap) {
+                max_gap = in.gaps[n];
+            }
+        }
+        printf("max_gap_frames = %llu\n", (unsigned long long)max_gap);
+        if (in.end_boundary) {
+            printf("end_gap_frames = %llu (waiting for unplayable files)\n",
+                   (unsigned long long)end_gap);
+        }
+        printf("dropped_bytes = %llu (incomplete frames at end of files)\n",
+               (unsigned long long)in.n_dropped_bytes);
+    }
+
     snd_pcm_close(pcm);
 
     return 0;
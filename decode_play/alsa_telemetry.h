@@ -0,0 +1,346 @@
+/* Playback telemetry for ALSA players.
+ *
+ * The output thread records an event after every write and every xrun:
+ * snd_pcm_status() is queried once, and delay, position and timestamps are
+ * pushed into a lock-free ring (see spsc_queue.h). If the ring is full, the
+ * event is dropped and counted; the output thread never blocks.
+ *
+ * A side thread drains the ring and, every 'interval' seconds, writes one
+ * JSON line (with a single fwrite(), so that several instances can share a
+ * file) with:
+ *
+ *  - "delay_ms": min, p50, p90, p99 and max delay, i.e. how much audio was
+ *    queued ahead of the speaker right after a write; min is how close the
+ *    device came to running dry
+ *  - "write_interval_ms": p50, p99 and max time between writes
+ *  - "xruns": count per cause ("underrun", "suspend" or "other")
+ *  - "recovery_ms": count, mean and max time from the moment the device
+ *    stopped (trigger timestamp) until the next successful write
+ *  - "rate_hz": playback rate measured by device timestamps, if there was
+ *    no xrun during interval; shows clock drift between hosts
+ *  - "dropped": events lost because the ring was full
+ *
+ * Device timestamps use CLOCK_MONOTONIC if sw_params were set up with
+ * alsa_telemetry_set_sw_params().
+ */
+#ifndef ALSA_TELEMETRY_H
+#define ALSA_TELEMETRY_H
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <alsa/asoundlib.h>
+
+#include "spsc_queue.h"
+
+enum {
+    ALSA_TELEMETRY_WRITE = 1,
+    ALSA_TELEMETRY_XRUN = 2,
+};
+
+enum {
+    ALSA_TELEMETRY_UNDERRUN = 0,
+    ALSA_TELEMETRY_SUSPEND = 1,
+    ALSA_TELEMETRY_OTHER = 2,
+    ALSA_TELEMETRY_N_CAUSES = 3,
+};
+
+struct alsa_telemetry_event {
+    int kind;
+    int cause;          // xrun only
+    int64_t time_ns;    // when event was recorded
+    int64_t htstamp_ns; // status timestamp for write, trigger timestamp for xrun
+    int64_t delay;      // frames
+    uint64_t position;  // frames written so far
+};
+
+// enable status timestamps from the same clock that telemetry uses
+static inline void alsa_telemetry_set_sw_params(snd_pcm_t* pcm,
+                                                snd_pcm_sw_params_t* sw_params) {
+    // failures only make "rate_hz" and "recovery_ms" less precise
+    snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+}
+
+class alsa_telemetry {
+public:
+    // 'name' is reported with every line, 'out' is not closed
+    alsa_telemetry(FILE* out, const char* name, unsigned sample_rate, double interval)
+        : out_(out)
+        , name_(name)
+        , sample_rate_(sample_rate)
+        , interval_(interval)
+        , queue_(1 << 14)
+        , dropped_(0)
+        , stop_(false)
+        , start_ns_(now_ns())
+        , last_write_ns_(0)
+        , xrun_ns_(0) {
+        delays_.reserve(queue_.capacity());
+        write_intervals_.reserve(queue_.capacity());
+        recoveries_.reserve(queue_.capacity());
+
+        thread_ = std::thread(&alsa_telemetry::run, this);
+    }
+
+    // writes last (partial) interval
+    ~alsa_telemetry() {
+        stop_.store(true);
+        thread_.join();
+    }
+
+    // output thread: call after successful write, 'position' is the total
+    // number of frames written
+    void on_write(snd_pcm_t* pcm, uint64_t position) {
+        snd_pcm_status_t* status = NULL;
+        snd_pcm_status_alloca(&status);
+
+        alsa_telemetry_event ev;
+        ev.kind = ALSA_TELEMETRY_WRITE;
+        ev.cause = 0;
+        ev.time_ns = now_ns();
+        ev.position = position;
+
+        if (snd_pcm_status(pcm, status) < 0) {
+            return;
+        }
+
+        snd_htimestamp_t ts;
+        snd_pcm_status_get_htstamp(status, &ts);
+
+        ev.htstamp_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        ev.delay = snd_pcm_status_get_delay(status);
+
+        push(ev);
+    }
+
+    // output thread: call when write or wait failed with 'err', before
+    // snd_pcm_recover()
+    void on_xrun(snd_pcm_t* pcm, int err) {
+        snd_pcm_status_t* status = NULL;
+        snd_pcm_status_alloca(&status);
+
+        alsa_telemetry_event ev;
+        ev.kind = ALSA_TELEMETRY_XRUN;
+        ev.time_ns = now_ns();
+        ev.htstamp_ns = 0;
+        ev.delay = 0;
+        ev.position = 0;
+
+        if (err == -ESTRPIPE) {
+            ev.cause = ALSA_TELEMETRY_SUSPEND;
+        } else if (err == -EPIPE) {
+            ev.cause = ALSA_TELEMETRY_UNDERRUN;
+        } else {
+            ev.cause = ALSA_TELEMETRY_OTHER;
+        }
+
+        // trigger timestamp is when device entered xrun state, which may be
+        // long before we noticed
+        if (snd_pcm_status(pcm, status) == 0) {
+            snd_htimestamp_t ts;
+            snd_pcm_status_get_trigger_htstamp(status, &ts);
+            ev.htstamp_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+        push(ev);
+    }
+
+private:
+    alsa_telemetry(const alsa_telemetry&);
+    alsa_telemetry& operator=(const alsa_telemetry&);
+
+    static int64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    void push(const alsa_telemetry_event& ev) {
+        if (queue_.write(&ev, 1) == 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // side thread: collect events and report every 'interval_' seconds
+    void run() {
+        int64_t next_ns = start_ns_ + (int64_t)(interval_ * 1e9);
+
+        for (;;) {
+            const bool stop = stop_.load();
+
+            collect();
+
+            if (stop || now_ns() >= next_ns) {
+                report();
+                next_ns += (int64_t)(interval_ * 1e9);
+            }
+
+            if (stop) {
+                break;
+            }
+
+            struct timespec ts = { 0, 10000000 };
+            nanosleep(&ts, NULL);
+        }
+
+        fflush(out_);
+    }
+
+    void collect() {
+        alsa_telemetry_event ev;
+
+        while (queue_.read(&ev, 1) == 1) {
+            if (ev.kind == ALSA_TELEMETRY_XRUN) {
+                n_xruns_[ev.cause]++;
+                // keep the first one if several xruns come before recovery
+                if (xrun_ns_ == 0) {
+                    xrun_ns_ = ev.htstamp_ns > 0 && ev.htstamp_ns <= ev.time_ns
+                        ? ev.htstamp_ns : ev.time_ns;
+                }
+                continue;
+            }
+
+            delays_.push_back(ev.delay * 1e3 / sample_rate_);
+
+            if (last_write_ns_ != 0) {
+                write_intervals_.push_back((ev.time_ns - last_write_ns_) / 1e6);
+            }
+            last_write_ns_ = ev.time_ns;
+
+            if (xrun_ns_ != 0) {
+                recoveries_.push_back((ev.time_ns - xrun_ns_) / 1e6);
+                xrun_ns_ = 0;
+            }
+
+            if (n_writes_ == 0) {
+                first_ = ev;
+            }
+            last_ = ev;
+            n_writes_++;
+        }
+    }
+
+    // p-th percentile of sorted values
+    static double percentile(const std::vector<double>& v, double p) {
+        return v[(size_t)(p * (v.size() - 1) + 0.5)];
+    }
+
+    void append(const char* fmt, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        line_ += buf;
+    }
+
+    void report_percentiles(const char* key, std::vector<double>& v, bool detailed) {
+        append("\"%s\":", key);
+        if (v.empty()) {
+            append("null");
+            return;
+        }
+        std::sort(v.begin(), v.end());
+        if (detailed) {
+            append("{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+                   v.front(), percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99),
+                   v.back());
+        } else {
+            append("{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+                   percentile(v, 0.5), percentile(v, 0.99), v.back());
+        }
+    }
+
+    void report() {
+        size_t n_xruns = 0;
+        for (int n = 0; n < ALSA_TELEMETRY_N_CAUSES; n++) {
+            n_xruns += n_xruns_[n];
+        }
+
+        line_.clear();
+
+        append("{\"device\":\"%s\",\"time\":%.3f,\"writes\":%llu,",
+               name_, (now_ns() - start_ns_) / 1e9, (unsigned long long)n_writes_);
+
+        report_percentiles("delay_ms", delays_, true);
+        append(",");
+        report_percentiles("write_interval_ms", write_intervals_, false);
+
+        append(",\"xruns\":{\"underrun\":%llu,\"suspend\":%llu,\"other\":%llu}",
+               (unsigned long long)n_xruns_[ALSA_TELEMETRY_UNDERRUN],
+               (unsigned long long)n_xruns_[ALSA_TELEMETRY_SUSPEND],
+               (unsigned long long)n_xruns_[ALSA_TELEMETRY_OTHER]);
+
+        double recovery_sum = 0, recovery_max = 0;
+        for (size_t n = 0; n < recoveries_.size(); n++) {
+            recovery_sum += recoveries_[n];
+            recovery_max = std::max(recovery_max, recoveries_[n]);
+        }
+        append(",\"recovery_ms\":{\"count\":%llu,\"mean\":%.3f,\"max\":%.3f}",
+               (unsigned long long)recoveries_.size(),
+               recoveries_.empty() ? 0.0 : recovery_sum / recoveries_.size(), recovery_max);
+
+        // frames that reached the speaker between first and last write,
+        // over device time between them; meaningless across an xrun,
+        // since queued frames are dropped
+        append(",\"rate_hz\":");
+        const int64_t ht_ns = last_.htstamp_ns - first_.htstamp_ns;
+        if (n_writes_ > 1 && n_xruns == 0 && first_.htstamp_ns > 0 && ht_ns > 0) {
+            const double played = (double)(last_.position - first_.position)
+                - (double)(last_.delay - first_.delay);
+            append("%.3f", played * 1e9 / ht_ns);
+        } else {
+            append("null");
+        }
+
+        append(",\"dropped\":%llu}\n",
+               (unsigned long long)dropped_.exchange(0, std::memory_order_relaxed));
+
+        fwrite(line_.data(), 1, line_.size(), out_);
+        fflush(out_);
+
+        delays_.clear();
+        write_intervals_.clear();
+        recoveries_.clear();
+        for (int n = 0; n < ALSA_TELEMETRY_N_CAUSES; n++) {
+            n_xruns_[n] = 0;
+        }
+        n_writes_ = 0;
+    }
+
+    FILE* out_;
+    const char* name_;
+    const unsigned sample_rate_;
+    const double interval_;
+
+    spsc_queue<alsa_telemetry_event> queue_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<bool> stop_;
+
+    // side thread state
+    const int64_t start_ns_;
+    int64_t last_write_ns_;
+    int64_t xrun_ns_; // xrun waiting for recovery
+    std::vector<double> delays_;
+    std::vector<double> write_intervals_;
+    std::vector<double> recoveries_;
+    std::string line_;
+    uint64_t n_xruns_[ALSA_TELEMETRY_N_CAUSES] = {};
+    uint64_t n_writes_ = 0;
+    alsa_telemetry_event first_ = {};
+    alsa_telemetry_event last_ = {};
+
+    std::thread thread_;
+};
+
+#endif // ALSA_TELEMETRY_H
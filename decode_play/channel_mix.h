@@ -0,0 +1,225 @@
+/* Mixing of interleaved float samples with any number of channels into
+ * two channels (front left, front right).
+ *
+ * Every input channel has a position. Its contribution to left and right
+ * output channel is:
+ *  - mono: both channels at full level
+ *  - left and right: the same channel at full level
+ *  - center and other unknown positions: both channels at -3 dB
+ *  - back center: both channels at -6 dB
+ *  - back and side left and right: the same channel at -3 dB
+ *  - LFE: dropped
+ *
+ * When more than two channels are mixed, the matrix is scaled down so that
+ * every output channel is a weighted average and can't clip.
+ *
+ * Mono input is just duplicated. Other layouts are mixed two frames per
+ * vector, using SSE on x86 and NEON on ARM.
+ */
+#ifndef CHANNEL_MIX_H
+#define CHANNEL_MIX_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum channel_pos {
+    CHANNEL_MONO,
+    CHANNEL_FRONT_LEFT,
+    CHANNEL_FRONT_RIGHT,
+    CHANNEL_FRONT_CENTER,
+    CHANNEL_LFE,
+    CHANNEL_BACK_LEFT,
+    CHANNEL_BACK_RIGHT,
+    CHANNEL_BACK_CENTER,
+    CHANNEL_SIDE_LEFT,
+    CHANNEL_SIDE_RIGHT,
+    CHANNEL_OTHER,
+};
+
+struct channel_mix {
+    int in_channels;
+    std::vector<float> coefs; // left and right coefficient of every input channel
+};
+
+// default WAV layout for given number of channels
+inline channel_pos channel_mix_default_pos(int channels, int n) {
+    static const channel_pos layouts[8][8] = {
+        { CHANNEL_MONO },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT, CHANNEL_FRONT_CENTER },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT,
+          CHANNEL_BACK_LEFT, CHANNEL_BACK_RIGHT },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT, CHANNEL_FRONT_CENTER,
+          CHANNEL_BACK_LEFT, CHANNEL_BACK_RIGHT },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT, CHANNEL_FRONT_CENTER,
+          CHANNEL_LFE, CHANNEL_BACK_LEFT, CHANNEL_BACK_RIGHT },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT, CHANNEL_FRONT_CENTER,
+          CHANNEL_LFE, CHANNEL_BACK_CENTER, CHANNEL_SIDE_LEFT, CHANNEL_SIDE_RIGHT },
+        { CHANNEL_FRONT_LEFT, CHANNEL_FRONT_RIGHT, CHANNEL_FRONT_CENTER,
+          CHANNEL_LFE, CHANNEL_BACK_LEFT, CHANNEL_BACK_RIGHT,
+          CHANNEL_SIDE_LEFT, CHANNEL_SIDE_RIGHT },
+    };
+
+    if (channels < 1 || channels > 8) {
+        return CHANNEL_OTHER;
+    }
+    return layouts[channels - 1][n];
+}
+
+// 'positions' may be NULL, then default layout is used
+inline void channel_mix_init(channel_mix* m, int in_channels,
+                             const channel_pos* positions) {
+    const float minus_3db = 0.70710678f, minus_6db = 0.5f;
+
+    m->in_channels = in_channels;
+    m->coefs.assign((size_t)in_channels * 2, 0.0f);
+
+    float sum_left = 0, sum_right = 0;
+
+    for (int n = 0; n < in_channels; n++) {
+        const channel_pos pos =
+            positions ? positions[n] : channel_mix_default_pos(in_channels, n);
+
+        float left = 0, right = 0;
+
+        switch (pos) {
+        case CHANNEL_MONO:
+            left = right = 1;
+            break;
+        case CHANNEL_FRONT_LEFT:
+            left = 1;
+            break;
+        case CHANNEL_FRONT_RIGHT:
+            right = 1;
+            break;
+        case CHANNEL_BACK_LEFT:
+        case CHANNEL_SIDE_LEFT:
+            left = minus_3db;
+            break;
+        case CHANNEL_BACK_RIGHT:
+        case CHANNEL_SIDE_RIGHT:
+            right = minus_3db;
+            break;
+        case CHANNEL_BACK_CENTER:
+            left = right = minus_6db;
+            break;
+        case CHANNEL_LFE:
+            break;
+        case CHANNEL_FRONT_CENTER:
+        case CHANNEL_OTHER:
+            left = right = minus_3db;
+            break;
+        }
+
+        m->coefs[n * 2] = left;
+        m->coefs[n * 2 + 1] = right;
+
+        sum_left += left;
+        sum_right += right;
+    }
+
+    const float max_sum = sum_left > sum_right ? sum_left : sum_right;
+
+    if (in_channels > 2 && max_sum > 1) {
+        for (size_t n = 0; n < m->coefs.size(); n++) {
+            m->coefs[n] /= max_sum;
+        }
+    }
+}
+
+// true if input is one channel that is just duplicated
+inline bool channel_mix_is_dup(const channel_mix* m) {
+    return m->in_channels == 1 && m->coefs[0] == 1 && m->coefs[1] == 1;
+}
+
+// duplicate every sample of mono input
+inline void channel_mix_dup(const float* in, float* out, size_t frames) {
+    size_t n = 0;
+
+#if defined(__SSE2__)
+    for (; n + 4 <= frames; n += 4) {
+        const __m128 x = _mm_loadu_ps(in + n);
+        _mm_storeu_ps(out + n * 2, _mm_unpacklo_ps(x, x));
+        _mm_storeu_ps(out + n * 2 + 4, _mm_unpackhi_ps(x, x));
+    }
+#elif defined(__ARM_NEON)
+    for (; n + 4 <= frames; n += 4) {
+        const float32x4_t x = vld1q_f32(in + n);
+        const float32x4x2_t xx = { { x, x } };
+        vst2q_f32(out + n * 2, xx);
+    }
+#endif
+
+    for (; n < frames; n++) {
+        out[n * 2] = out[n * 2 + 1] = in[n];
+    }
+}
+
+// mix 'frames' frames from 'in' into two channels in 'out'
+inline void channel_mix_process(const channel_mix* m, const float* in, float* out,
+                                size_t frames) {
+    if (channel_mix_is_dup(m)) {
+        channel_mix_dup(in, out, frames);
+        return;
+    }
+
+    const int channels = m->in_channels;
+    const float* coefs = &m->coefs[0];
+
+    size_t n = 0;
+
+#if defined(__SSE2__)
+    // two frames at once: (L0 R0 L1 R1)
+    for (; n + 2 <= frames; n += 2) {
+        const float* x0 = in + n * channels;
+        const float* x1 = x0 + channels;
+
+        __m128 acc = _mm_setzero_ps();
+        for (int c = 0; c < channels; c++) {
+            const __m128 x = _mm_setr_ps(x0[c], x0[c], x1[c], x1[c]);
+            const __m128 k = _mm_setr_ps(coefs[c * 2], coefs[c * 2 + 1],
+                                         coefs[c * 2], coefs[c * 2 + 1]);
+            acc = _mm_add_ps(acc, _mm_mul_ps(x, k));
+        }
+
+        _mm_storeu_ps(out + n * 2, acc);
+    }
+#elif defined(__ARM_NEON)
+    for (; n + 2 <= frames; n += 2) {
+        const float* x0 = in + n * channels;
+        const float* x1 = x0 + channels;
+
+        float32x4_t acc = vdupq_n_f32(0);
+        for (int c = 0; c < channels; c++) {
+            const float32x4_t x = vcombine_f32(vdup_n_f32(x0[c]), vdup_n_f32(x1[c]));
+            const float32x2_t k2 = vld1_f32(coefs + c * 2);
+            acc = vmlaq_f32(acc, x, vcombine_f32(k2, k2));
+        }
+
+        vst1q_f32(out + n * 2, acc);
+    }
+#endif
+
+    for (; n < frames; n++) {
+        const float* x = in + n * channels;
+
+        float left = 0, right = 0;
+        for (int c = 0; c < channels; c++) {
+            left += x[c] * coefs[c * 2];
+            right += x[c] * coefs[c * 2 + 1];
+        }
+
+        out[n * 2] = left;
+        out[n * 2 + 1] = right;
+    }
+}
+
+#endif // CHANNEL_MIX_H
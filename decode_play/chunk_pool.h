@@ -0,0 +1,97 @@
+/* Run numbered chunks of work on a pool of threads and consume results in order.
+ *
+ * Chunks 0..n_chunks-1 are taken by worker threads in increasing order, each
+ * worker filling a result slot. Current thread consumes slots strictly in
+ * chunk order. At most 'window' chunks are decoded or waiting to be consumed
+ * at once, so memory use doesn't depend on input length, and slots (and
+ * their buffers) are reused.
+ *
+ * Usage:
+ *   chunk_pool_run<std::vector<float>>(n_chunks, n_workers,
+ *       [](size_t worker, size_t chunk, std::vector<float>& result) { ... },
+ *       [](size_t chunk, std::vector<float>& result) { ... });
+ */
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 'work(worker, chunk, result)' runs in worker threads; 'worker' is in
+// [0; n_workers) and may be used to index per-thread state
+// 'consume(chunk, result)' runs in current thread
+template <class T, class Work, class Consume>
+void chunk_pool_run(size_t n_chunks, size_t n_workers, Work work, Consume consume) {
+    if (n_workers == 0) {
+        n_workers = 1;
+    }
+
+    // two chunks per worker: one being decoded, one waiting for consumer
+    const size_t window = n_workers * 2;
+
+    std::vector<T> slots(window);
+    std::vector<bool> ready(window, false);
+
+    size_t next_chunk = 0;
+    size_t n_consumed = 0;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    auto worker = [&](size_t worker_id) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            // don't run further ahead than consumer allows
+            while (next_chunk < n_chunks && next_chunk >= n_consumed + window) {
+                cond.wait(lock);
+            }
+            if (next_chunk >= n_chunks) {
+                break;
+            }
+
+            const size_t chunk = next_chunk++;
+            T& slot = slots[chunk % window];
+
+            lock.unlock();
+            work(worker_id, chunk, slot);
+            lock.lock();
+
+            ready[chunk % window] = true;
+            cond.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t n = 0; n < n_workers; n++) {
+        workers.push_back(std::thread(worker, n));
+    }
+
+    for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!ready[chunk % window]) {
+                cond.wait(lock);
+            }
+        }
+
+        consume(chunk, slots[chunk % window]);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready[chunk % window] = false;
+            n_consumed++;
+            cond.notify_all();
+        }
+    }
+
+    for (size_t n = 0; n < n_workers; n++) {
+        workers[n].join();
+    }
+}
+
+#endif // CHUNK_POOL_H
@@ -0,0 +1,446 @@
+/* Benchmark decoders on a synthesized corpus.
+ *
+ * First, the corpus is generated using libsndfile: the same deterministic
+ * signal (a few sines per channel plus noise from a fixed-seed generator)
+ * is written in several formats, sample rates and channel counts. Files
+ * that already exist are reused.
+ *
+ * Then every decoder is run on every file with output sent to /dev/null.
+ * Every run is a separate process; wall time, CPU time and peak RSS are
+ * taken from wait4(). Syscalls are counted in one more run under ptrace(),
+ * which is not timed since tracing slows the decoder down a lot.
+ *
+ * Results are printed to stdout as JSON, progress to stderr:
+ *   x_realtime            - audio duration divided by wall time (best run)
+ *   cpu_per_audio_second  - user + system CPU seconds per second of audio
+ *   peak_rss_kb           - maximum resident set size over all runs
+ *   syscalls              - number of syscalls, all threads included
+ *
+ * Usage:
+ *   ./decode_bench [-c corpus_dir] [-d seconds] [-n runs] [decoder...]
+ *
+ * Decoders are looked up in current directory; by default all of them
+ * are benchmarked.
+ */
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+struct corpus_format {
+    const char* ext;
+    int format;
+};
+
+static const corpus_format corpus_formats[] = {
+    { "wav",  SF_FORMAT_WAV | SF_FORMAT_PCM_16 },
+    { "flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_16 },
+    { "ogg",  SF_FORMAT_OGG | SF_FORMAT_VORBIS },
+};
+
+struct corpus_signal {
+    int rate;
+    int channels;
+};
+
+static const corpus_signal corpus_signals[] = {
+    { 44100, 2 },
+    { 44100, 1 },
+    { 48000, 2 },
+    { 96000, 2 },
+    { 48000, 6 },
+};
+
+struct corpus_file {
+    std::string path;
+    const char* ext;
+    int rate;
+    int channels;
+    double seconds;
+};
+
+static const char* const all_decoders[] = {
+    "ffmpeg_decode",
+    "sox_decode_simple",
+    "sox_decode_chain",
+    "sndfile_decode",
+};
+
+struct result {
+    bool ok;
+    double wall;
+    double cpu;
+    long peak_rss_kb;
+    long syscalls;
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double timeval_seconds(const struct timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void generate_file(const corpus_file& file, int format, int seconds) {
+    SF_INFO sinfo = {};
+    sinfo.samplerate = file.rate;
+    sinfo.channels = file.channels;
+    sinfo.format = format;
+
+    if (!sf_format_check(&sinfo)) {
+        fprintf(stderr, "error: %s: format not supported by libsndfile\n",
+                file.path.c_str());
+        exit(1);
+    }
+
+    // write to temporary file, so that interrupted run doesn't leave
+    // truncated file in corpus
+    const std::string tmp_path = file.path + ".tmp";
+
+    SNDFILE* sfile = sf_open(tmp_path.c_str(), SFM_WRITE, &sinfo);
+    if (!sfile) {
+        fprintf(stderr, "error: %s: %s\n", tmp_path.c_str(), sf_strerror(NULL));
+        exit(1);
+    }
+
+    const size_t block_frames = 4096;
+    std::vector<float> buf(block_frames * file.channels);
+
+    uint32_t seed = 12345;
+
+    const size_t total_frames = (size_t)file.rate * seconds;
+
+    for (size_t pos = 0; pos < total_frames; pos += block_frames) {
+        size_t n_frames = total_frames - pos;
+        if (n_frames > block_frames) {
+            n_frames = block_frames;
+        }
+
+        for (size_t i = 0; i < n_frames; i++) {
+            const double t = double(pos + i) / file.rate;
+
+            for (int ch = 0; ch < file.channels; ch++) {
+                // different chord on every channel, so that encoders
+                // can't share data between channels
+                const double f = 220.0 * (1 + ch * 0.25);
+                double s = 0.3 * sin(2 * M_PI * f * t)
+                    + 0.15 * sin(2 * M_PI * f * 1.5 * t)
+                    + 0.1 * sin(2 * M_PI * f * 2.01 * t);
+
+                seed = seed * 1664525u + 1013904223u;
+                s += 0.02 * ((seed >> 8) / double(1 << 24) - 0.5);
+
+                buf[i * file.channels + ch] = (float)s;
+            }
+        }
+
+        if (sf_writef_float(sfile, &buf[0], (sf_count_t)n_frames) != (sf_count_t)n_frames) {
+            fprintf(stderr, "error: %s: %s\n", tmp_path.c_str(), sf_strerror(sfile));
+            exit(1);
+        }
+    }
+
+    sf_close(sfile);
+
+    if (rename(tmp_path.c_str(), file.path.c_str()) != 0) {
+        oops("rename");
+    }
+}
+
+static std::vector<corpus_file> make_corpus(const char* dir, int seconds) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        oops("mkdir");
+    }
+
+    std::vector<corpus_file> corpus;
+
+    for (size_t s = 0; s < sizeof(corpus_signals) / sizeof(corpus_signals[0]); s++) {
+        for (size_t f = 0; f < sizeof(corpus_formats) / sizeof(corpus_formats[0]); f++) {
+            corpus_file file;
+            file.ext = corpus_formats[f].ext;
+            file.rate = corpus_signals[s].rate;
+            file.channels = corpus_signals[s].channels;
+
+            // duration is part of the name, so that changing -d doesn't
+            // reuse files of other length
+            char name[128];
+            snprintf(name, sizeof(name), "%d_%dch_%ds.%s", file.rate, file.channels,
+                     seconds, file.ext);
+            file.path = std::string(dir) + "/" + name;
+
+            struct stat st;
+            if (stat(file.path.c_str(), &st) != 0) {
+                fprintf(stderr, "generating %s\n", file.path.c_str());
+                generate_file(file, corpus_formats[f].format, seconds);
+            }
+
+            // take duration from file itself, not from the requested one
+            SF_INFO sinfo = {};
+            SNDFILE* sfile = sf_open(file.path.c_str(), SFM_READ, &sinfo);
+            if (!sfile) {
+                fprintf(stderr, "error: %s: %s\n", file.path.c_str(), sf_strerror(NULL));
+                exit(1);
+            }
+            file.seconds = double(sinfo.frames) / sinfo.samplerate;
+            sf_close(sfile);
+
+            corpus.push_back(file);
+        }
+    }
+
+    return corpus;
+}
+
+static pid_t spawn(const char* decoder, const char* input, bool traced) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        oops("fork");
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0) {
+            _exit(127);
+        }
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            // let parent set options before exec
+            raise(SIGSTOP);
+        }
+
+        std::string path = std::string("./") + decoder;
+        execl(path.c_str(), decoder, input, (char*)NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// run decoder once and measure it
+static bool run_timed(const char* decoder, const char* input, result* res) {
+    const double start = now_seconds();
+
+    pid_t pid = spawn(decoder, input, false);
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        oops("wait4");
+    }
+
+    const double wall = now_seconds() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return false;
+    }
+
+    const double cpu = timeval_seconds(usage.ru_utime) + timeval_seconds(usage.ru_stime);
+
+    if (res->wall == 0 || wall < res->wall) {
+        res->wall = wall;
+    }
+    if (res->cpu == 0 || cpu < res->cpu) {
+        res->cpu = cpu;
+    }
+    if (usage.ru_maxrss > res->peak_rss_kb) {
+        res->peak_rss_kb = usage.ru_maxrss;
+    }
+
+    return true;
+}
+
+// run decoder once under ptrace and count syscalls of all its threads
+static long count_syscalls(const char* decoder, const char* input) {
+    pid_t pid = spawn(decoder, input, true);
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        oops("waitpid");
+    }
+
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               (void*)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+                       PTRACE_O_EXITKILL)) < 0) {
+        oops("ptrace(PTRACE_SETOPTIONS)");
+    }
+
+    // every syscall stops the thread twice, on entry and on exit;
+    // true means the thread is inside a syscall
+    std::map<pid_t, bool> in_syscall;
+    in_syscall[pid] = false;
+
+    long n_syscalls = 0;
+    bool ok = false;
+
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // no more children
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) {
+                ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+            in_syscall.erase(tid);
+            continue;
+        }
+
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        int sig = 0;
+
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            bool& inside = in_syscall[tid];
+            if (!inside) {
+                n_syscalls++;
+            }
+            inside = !inside;
+        } else if (status >> 16 != 0) {
+            // clone or exec event
+        } else if (WSTOPSIG(status) == SIGSTOP && in_syscall.find(tid) == in_syscall.end()) {
+            // initial stop of a new thread
+            in_syscall[tid] = false;
+        } else {
+            // deliver signal to the decoder
+            sig = WSTOPSIG(status);
+        }
+
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)sig);
+    }
+
+    return ok ? n_syscalls : -1;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-c corpus_dir] [-d seconds] [-n runs] [decoder...]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* corpus_dir = "bench_corpus";
+    int seconds = 30;
+    int runs = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            corpus_dir = optarg;
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (seconds <= 0 || runs <= 0) {
+        usage(argv[0]);
+    }
+
+    std::vector<const char*> decoders;
+    for (int n = optind; n < argc; n++) {
+        decoders.push_back(argv[n]);
+    }
+    if (decoders.empty()) {
+        decoders.assign(all_decoders,
+                        all_decoders + sizeof(all_decoders) / sizeof(all_decoders[0]));
+    }
+
+    for (size_t d = 0; d < decoders.size(); d++) {
+        std::string path = std::string("./") + decoders[d];
+        if (access(path.c_str(), X_OK) != 0) {
+            fprintf(stderr, "error: %s not found, run make first\n", path.c_str());
+            exit(1);
+        }
+    }
+
+    std::vector<corpus_file> corpus = make_corpus(corpus_dir, seconds);
+
+    printf("{\n");
+    printf("  \"runs\": %d,\n", runs);
+    printf("  \"results\": [");
+
+    bool first = true;
+
+    for (size_t d = 0; d < decoders.size(); d++) {
+        for (size_t f = 0; f < corpus.size(); f++) {
+            const corpus_file& file = corpus[f];
+
+            fprintf(stderr, "%s %s\n", decoders[d], file.path.c_str());
+
+            result res = {};
+            res.ok = true;
+
+            for (int r = 0; r < runs && res.ok; r++) {
+                res.ok = run_timed(decoders[d], file.path.c_str(), &res);
+            }
+
+            if (res.ok) {
+                res.syscalls = count_syscalls(decoders[d], file.path.c_str());
+                res.ok = res.syscalls >= 0;
+            }
+
+            printf("%s\n    {\"decoder\": \"%s\", \"file\": \"%s\", \"format\": \"%s\", "
+                   "\"rate\": %d, \"channels\": %d, \"audio_seconds\": %.3f, ",
+                   first ? "" : ",", decoders[d], file.path.c_str(), file.ext,
+                   file.rate, file.channels, file.seconds);
+
+            if (res.ok) {
+                printf("\"ok\": true, \"x_realtime\": %.2f, \"cpu_per_audio_second\": %.6f, "
+                       "\"peak_rss_kb\": %ld, \"syscalls\": %ld}",
+                       file.seconds / res.wall, res.cpu / file.seconds,
+                       res.peak_rss_kb, res.syscalls);
+            } else {
+                // e.g. format not supported by this decoder
+                printf("\"ok\": false}");
+            }
+
+            fflush(stdout);
+            first = false;
+        }
+    }
+
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
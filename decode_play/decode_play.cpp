@@ -0,0 +1,256 @@
+/* Decode audio file and play it in one process, without a pipe.
+ *
+ * Decoder from libpcm_decoder.a runs in its own thread and pushes samples
+ * to a small lock-free ring. Main thread takes samples from the ring and
+ * writes them to ALSA or PulseAudio. When the ring is full, the decoder
+ * waits, so it runs only as far ahead of the device as the ring allows.
+ *
+ * Samples are played in the format of the input file; ALSA plugins or
+ * PulseAudio convert them if the device doesn't support it.
+ *
+ * Usage:
+ *   ./decode_play [options] cool_song.mp3
+ *
+ * Options:
+ *   -b  decoder backend: ffmpeg, sox or sndfile (default: first one that
+ *       can open the file, trying sndfile, ffmpeg and sox)
+ *   -o  output: alsa (default) or pulse
+ *   -d  ALSA device or PulseAudio sink (default: default one)
+ *   -r  ring size in milliseconds (default: 250)
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <alsa/asoundlib.h>
+#include <pulse/error.h>
+#include <pulse/simple.h>
+
+#include "pcm_decoder.h"
+#include "spsc_queue.h"
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+// number of frames decoded at once
+static const size_t decode_frames = 4096;
+
+// number of frames written to device at once
+static const size_t play_frames = 1024;
+
+// ALSA buffer length in microseconds
+static const unsigned alsa_latency = 100000;
+
+struct player {
+    bool pulse;
+    snd_pcm_t* pcm;
+    pa_simple* simple;
+    int channels;
+};
+
+static void open_player(player* p, bool pulse, const char* device,
+                        int channels, int sample_rate) {
+    memset(p, 0, sizeof(*p));
+    p->pulse = pulse;
+    p->channels = channels;
+
+    if (pulse) {
+        pa_sample_spec sample_spec = {};
+        sample_spec.format = PA_SAMPLE_FLOAT32LE;
+        sample_spec.rate = (uint32_t)sample_rate;
+        sample_spec.channels = (uint8_t)channels;
+
+        int error = 0;
+        p->simple = pa_simple_new(NULL, "decode_play", PA_STREAM_PLAYBACK, device,
+                                  "playback", &sample_spec, NULL, NULL, &error);
+        if (!p->simple) {
+            fprintf(stderr, "pa_simple_new: %s\n", pa_strerror(error));
+            exit(1);
+        }
+    } else {
+        if (snd_pcm_open(&p->pcm, device ? device : "default",
+                         SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+            oops("snd_pcm_open");
+        }
+
+        if (snd_pcm_set_params(p->pcm,
+                               SND_PCM_FORMAT_FLOAT_LE,
+                               SND_PCM_ACCESS_RW_INTERLEAVED,
+                               (unsigned)channels,
+                               (unsigned)sample_rate,
+                               1,
+                               alsa_latency) < 0) {
+            oops("snd_pcm_set_params");
+        }
+    }
+}
+
+static void write_player(player* p, const float* buf, size_t frames) {
+    if (p->pulse) {
+        int error = 0;
+        if (pa_simple_write(p->simple, buf, frames * p->channels * sizeof(float),
+                            &error) < 0) {
+            fprintf(stderr, "pa_simple_write: %s\n", pa_strerror(error));
+            exit(1);
+        }
+        return;
+    }
+
+    while (frames > 0) {
+        snd_pcm_sframes_t ret = snd_pcm_writei(p->pcm, buf, frames);
+
+        if (ret < 0) {
+            if ((ret = snd_pcm_recover(p->pcm, (int)ret, 1)) == 0) {
+                printf("recovered after xrun (overrun/underrun)\n");
+                continue;
+            }
+            oops("snd_pcm_writei");
+        }
+
+        buf += ret * p->channels;
+        frames -= (size_t)ret;
+    }
+}
+
+static void close_player(player* p) {
+    if (p->pulse) {
+        int error = 0;
+        if (pa_simple_drain(p->simple, &error) < 0) {
+            fprintf(stderr, "pa_simple_drain: %s\n", pa_strerror(error));
+        }
+        pa_simple_free(p->simple);
+    } else {
+        snd_pcm_drain(p->pcm);
+        snd_pcm_close(p->pcm);
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-b backend] [-o alsa|pulse] [-d device] [-r ring_ms] "
+            "input_file\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* backend = NULL;
+    const char* device = NULL;
+    bool pulse = false;
+    int ring_ms = 250;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:d:r:")) != -1) {
+        switch (opt) {
+        case 'b':
+            backend = optarg;
+            break;
+        case 'o':
+            if (strcmp(optarg, "pulse") == 0) {
+                pulse = true;
+            } else if (strcmp(optarg, "alsa") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        case 'r':
+            ring_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1 || ring_ms <= 0) {
+        usage(argv[0]);
+    }
+
+    pcm_decoder* dec = pcm_decoder_open(argv[optind], backend);
+    if (!dec) {
+        exit(1);
+    }
+
+    const int channels = dec->channels(), sample_rate = dec->sample_rate();
+
+    printf("decoder = %s\n", dec->name());
+    printf("channels = %d\n", channels);
+    printf("sample_rate = %d\n", sample_rate);
+
+    player p;
+    open_player(&p, pulse, device, channels, sample_rate);
+
+    // ring holds samples, not frames; it's never smaller than one block
+    size_t ring_size = (size_t)sample_rate * ring_ms / 1000;
+    if (ring_size < decode_frames) {
+        ring_size = decode_frames;
+    }
+
+    spsc_queue<float> ring(ring_size * channels);
+    std::atomic<bool> finished(false);
+
+    std::thread decode_thread([&]() {
+        std::vector<float> buf(decode_frames * channels);
+
+        while (size_t n = dec->read(&buf[0], decode_frames)) {
+            const float* src = &buf[0];
+            size_t left = n * channels;
+
+            // blocks while ring is full
+            while (left > 0) {
+                ring.wait_write(1);
+                size_t ret = ring.write(src, left);
+                src += ret;
+                left -= ret;
+            }
+        }
+
+        finished.store(true, std::memory_order_release);
+    });
+
+    std::vector<float> buf(play_frames * channels);
+
+    for (unsigned idle = 0;; ) {
+        // check flag before ring, so that nothing written before it was
+        // set can be missed
+        const bool done = finished.load(std::memory_order_acquire);
+
+        // take only whole frames
+        size_t n = ring.read_available() / channels;
+        if (n > play_frames) {
+            n = play_frames;
+        }
+
+        if (n != 0) {
+            ring.read(&buf[0], n * channels);
+            write_player(&p, &buf[0], n);
+            idle = 0;
+            continue;
+        }
+
+        if (done) {
+            break;
+        }
+
+        // decoder is behind: wait for it
+        if (++idle < 64) {
+            sched_yield();
+        } else {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    decode_thread.join();
+
+    close_player(&p);
+
+    delete dec;
+
+    return 0;
+}
@@ -2,16 +2,91 @@
  * Output format:
  *  - two channels (front left, front right)
  *  - samples in interleaved format (L R L R ...)
- *  - samples are 32-bit floats
+ *  - samples are 32-bit floats, unless -f is given
  *  - sample rate is 44100
  *
  * Usage:
- *   ./ffmpeg_decode cool_song.mp3 > cool_song_samples
+ *   ./ffmpeg_decode [-p] [-s] [-m] [-c chunk] [--start sec] [--duration sec] \
+ *       cool_song.mp3 > cool_song_samples
+ *   ./ffmpeg_decode -P workers [-s] [-m] long_recording.flac > samples
+ *   ./ffmpeg_decode -b [options] [-j workers] [-o out_dir] song1.mp3 song2.ogg ...
+ *   ./ffmpeg_decode -b [options] [-j workers] [-o out_dir] < manifest
+ *
+ * Options:
+ *   -p  pipelined mode: demuxer, decoder, resampler and writer run in
+ *       separate threads connected with lock-free queues, and decoder
+ *       uses codec's own frame and slice threading
+ *   -P, --parallel
+ *       decode one seekable file using given number of threads: input is
+ *       split into 30-second chunks, and every worker decodes a chunk with
+ *       its own demuxer and decoder seeked to it; chunks are converted to
+ *       stereo floats by workers, and resampled and written in order by
+ *       main thread; can't be combined with -p, -b, --start and --duration
+ *   -b  batch mode: decode many files in parallel, each one to its own
+ *       output file, and report throughput as multiple of real time;
+ *       files are taken from arguments, or from manifest on stdin with
+ *       "input_file [output_file]" lines
+ *   -s  report number of decoder, resampler and write calls per second of
+ *       audio, and startup latency (time spent opening and probing input,
+ *       and time to first decoded sample) to stderr
+ *   -f, --format
+ *       output sample format: f32, s16 or s24 (see pcm_format.h); when
+ *       given, output starts with stream header; floats are converted to
+ *       integers with dither after resampling
+ *   -c  limit number of samples converted per swr_convert() call, e.g.
+ *       "-c 512" to compare with converting in small fixed-size chunks;
+ *       by default every decoded frame is converted in one call
+ *   -S, --start
+ *       start decoding from given non-negative position in seconds; input
+ *       is seeked to nearest preceding keyframe, and output is trimmed to
+ *       the exact sample
+ *   -D, --duration
+ *       stop after given number of seconds of output
+ *   -m, --mmap
+ *       map input file into memory and read it via custom AVIOContext
+ *       instead of ffmpeg's file protocol, which calls read() into its
+ *       own buffer
+ *   -C, --cache
+ *       cache directory; decoded samples are stored there and reused when
+ *       the same file is decoded again with the same settings
+ *   --cache-size
+ *       cache size limit in megabytes, must be positive (default: 1024);
+ *       least recently used files are removed when it's exceeded
+ *   --cache-hash
+ *       include file contents into cache key, not only inode, size and mtime
+ *   --probesize
+ *       maximum number of bytes read to detect format and stream parameters
+ *   --analyzeduration
+ *       maximum duration of input analyzed to detect stream parameters, seconds
+ *   --fast-open
+ *       trust file extension and container header: demuxer is chosen by
+ *       extension instead of probing file contents, and if header has codec,
+ *       sample rate and channel count, avformat_find_stream_info() is skipped
+ *   --probe-cache
+ *       directory where stream parameters are stored after probing; when the
+ *       same unchanged file is opened again, they're taken from there and
+ *       probing is skipped
+ *   -j  number of worker threads in batch mode (default: number of cores)
+ *   -o  output directory in batch mode (default: next to input file);
+ *       output file is named after input file with ".raw" appended
  */
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
+#include <ctype.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -19,95 +94,885 @@ extern "C" {
 #include <libswresample/swresample.h>
 }
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s input_file > output_file\n", argv[0]);
-        exit(1);
+#include "chunk_pool.h"
+#include "pcm_cache.h"
+#include "pcm_writer.h"
+#include "spsc_queue.h"
+
+static const int out_channels = 2, sample_rate = 44100;
+
+static const uint64_t out_layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
+
+// number of packets or frames that may be queued between two stages
+static const size_t queue_size = 64;
+
+// initial size of output frames, in samples per channel
+static const int min_out_samples = 4096;
+
+// size of AVIOContext buffer for memory-mapped input; reads larger than
+// this are served directly into demuxer's buffer, bypassing AVIOContext one
+static const int mmap_io_buffer_size = 32 * 1024;
+
+// length of input decoded by one worker in parallel mode, seconds
+static const int chunk_seconds = 30;
+
+// how much of input is decoded and dropped before every chunk in parallel
+// mode, seconds
+static const double chunk_preroll = 0.2;
+
+struct options {
+    bool pipelined;  // run stages in separate threads
+    bool stats;      // report number of calls per second of audio
+    int max_chunk;   // if non-zero, limits samples per swr_convert() call
+    double start;    // start position, seconds
+    double duration; // output duration, seconds, or negative if unlimited
+    bool mmap;       // read input via memory mapping
+    const char* cache_dir; // if non-NULL, cache decoded samples there
+    uint64_t cache_size;   // cache size limit in bytes
+    bool cache_hash;       // include file contents into cache key
+    int parallel;          // if greater than 1, number of chunk workers
+    int64_t probesize;       // if non-zero, limits bytes read while probing
+    int64_t analyzeduration; // if non-zero, limits probed duration, microseconds
+    bool fast_open;          // trust file extension and container header
+    const char* probe_cache; // if non-NULL, cache probed stream parameters there
+    int sample_format;       // if non-zero, output format with stream header
+};
+
+// stream parameters found by probing, see probe_cache_load()
+struct probe_params {
+    char format[64];   // demuxer name
+    int stream;
+    int codec_id;
+    int sample_rate;
+    int channels;
+    uint64_t channel_layout;
+    int64_t bit_rate;
+    int block_align;
+    int bits_per_coded_sample;
+    int frame_size;
+    int64_t duration;  // AV_TIME_BASE units
+};
+
+// memory-mapped input file
+struct mmap_input {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+};
+
+struct decoder {
+    const options* opts;
+    mmap_input mm;
+    AVIOContext* avio;
+    AVFormatContext* fmt_ctx;
+    AVCodecContext* codec_ctx;
+    SwrContext* swr_ctx;
+    AVBufferPool* out_pool;
+    int out_pool_samples; // size of buffers in out_pool, in samples per channel
+    int out_rate;         // output sample rate, see open_decoder()
+    int stream;
+    pcm_writer* out;
+    int64_t n_written;    // number of samples written per channel
+    int64_t n_decoded;    // number of avcodec_decode_audio4() calls
+    int64_t n_converted;  // number of swr_convert() calls
+    int64_t trim_start;   // first output sample to write
+    int64_t trim_end;     // last output sample to write plus one, or -1
+    int64_t out_pos;      // output position of next resampled sample
+    std::atomic<bool> finished; // set when trim_end is reached or on error
+    std::atomic<bool> failed;   // resampling or writing failed
+    double open_start;    // when open_decoder() was called
+    double open_time;     // time spent in avformat_open_input()
+    double probe_time;    // time spent in avformat_find_stream_info()
+    double codec_time;    // time spent in avcodec_open2() and swr_init()
+    double first_sample;  // time from open_start to first decoded sample
+    const char* probe_mode; // "full", "header" or "cached"
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// AVIOContext read callback for memory-mapped input
+static int mmap_read(void* opaque, uint8_t* buf, int buf_size) {
+    mmap_input* mm = (mmap_input*)opaque;
+
+    size_t n = mm->size - mm->pos;
+    if (n == 0) {
+        return AVERROR_EOF;
+    }
+    if (n > (size_t)buf_size) {
+        n = (size_t)buf_size;
     }
 
-    const int out_channels = 2, out_samples = 512, sample_rate = 44100;
+    memcpy(buf, mm->data + mm->pos, n);
+    mm->pos += n;
 
-    const int max_buffer_size =
-        av_samples_get_buffer_size(
-            NULL, out_channels, out_samples, AV_SAMPLE_FMT_FLT, 1);
+    return (int)n;
+}
 
-    // register supported formats and codecs
-    av_register_all();
+// AVIOContext seek callback for memory-mapped input
+static int64_t mmap_seek(void* opaque, int64_t offset, int whence) {
+    mmap_input* mm = (mmap_input*)opaque;
+
+    int64_t pos = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return (int64_t)mm->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = (int64_t)mm->pos + offset;
+        break;
+    case SEEK_END:
+        pos = (int64_t)mm->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0 || pos > (int64_t)mm->size) {
+        return AVERROR(EINVAL);
+    }
+
+    mm->pos = (size_t)pos;
+    return pos;
+}
+
+// map input file into memory and create AVIOContext reading from it
+// returns false if file can't be mapped, e.g. if it's not a regular file
+static bool open_mmap_input(decoder* dec, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    // demuxers mostly read forward, so ask kernel for aggressive readahead
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    dec->mm.data = (const uint8_t*)data;
+    dec->mm.size = (size_t)st.st_size;
+    dec->mm.pos = 0;
+
+    uint8_t* buffer = (uint8_t*)av_malloc(mmap_io_buffer_size);
+    assert(buffer);
+
+    dec->avio = avio_alloc_context(
+        buffer, mmap_io_buffer_size, 0, &dec->mm, mmap_read, NULL, mmap_seek);
+    assert(dec->avio);
+
+    return true;
+}
+
+static void close_mmap_input(decoder* dec) {
+    if (dec->avio) {
+        av_freep(&dec->avio->buffer);
+        av_freep(&dec->avio);
+    }
+    if (dec->mm.data) {
+        munmap((void*)dec->mm.data, dec->mm.size);
+        dec->mm.data = NULL;
+    }
+}
+
+// seek input to the nearest keyframe before given position in seconds
+// returns false if input is not seekable
+static bool seek_decoder(decoder* dec, double position) {
+    AVStream* stream = dec->fmt_ctx->streams[dec->stream];
+
+    int64_t ts = av_rescale_q(
+        llround(position * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+
+    if (stream->start_time != AV_NOPTS_VALUE) {
+        ts += stream->start_time;
+    }
+
+    // max_ts == ts means we never land after requested position
+    if (avformat_seek_file(dec->fmt_ctx, dec->stream, INT64_MIN, ts, ts, 0) < 0) {
+        return false;
+    }
+
+    avcodec_flush_buffers(dec->codec_ctx);
+
+    return true;
+}
+
+// path of probe cache file for input file
+// returns false if input can't be cached, e.g. it's not a regular file
+static bool probe_cache_path(const char* dir, const char* path, std::string& result) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    // stored codec ids are only valid for the same libraries
+    const uint64_t ident[] = {
+        (uint64_t)st.st_dev,
+        (uint64_t)st.st_ino,
+        (uint64_t)st.st_size,
+        (uint64_t)st.st_mtim.tv_sec,
+        (uint64_t)st.st_mtim.tv_nsec,
+        (uint64_t)LIBAVFORMAT_VERSION_INT,
+        (uint64_t)LIBAVCODEC_VERSION_INT,
+    };
+    const uint64_t h = pcm_cache_hash(14695981039346656037ull, ident, sizeof(ident));
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.probe", (unsigned long long)h);
+    result = std::string(dir) + name;
+
+    return true;
+}
+
+// load stream parameters probed when input was opened last time
+static bool probe_cache_load(const char* dir, const char* path, probe_params* params) {
+    std::string cache_path;
+    if (!probe_cache_path(dir, path, cache_path)) {
+        return false;
+    }
+
+    FILE* fp = fopen(cache_path.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    memset(params, 0, sizeof(*params));
+
+    unsigned long long layout = 0;
+    long long bit_rate = 0, duration = 0;
+
+    const int n = fscanf(fp, "%63s %d %d %d %d %llx %lld %d %d %d %lld",
+                         params->format, &params->stream, &params->codec_id,
+                         &params->sample_rate, &params->channels, &layout,
+                         &bit_rate, &params->block_align,
+                         &params->bits_per_coded_sample, &params->frame_size,
+                         &duration);
+    fclose(fp);
+
+    params->channel_layout = layout;
+    params->bit_rate = bit_rate;
+    params->duration = duration;
+
+    return n == 11 && params->sample_rate > 0 && params->channels > 0;
+}
+
+// store stream parameters found by avformat_find_stream_info()
+static void probe_cache_store(const char* dir, const char* path, const decoder* dec) {
+    std::string cache_path;
+    if (!probe_cache_path(dir, path, cache_path)) {
+        return;
+    }
+
+    const AVCodecContext* ctx = dec->codec_ctx;
+
+    // demuxer name may be a list, like "mov,mp4,m4a"; any of them can be
+    // passed to av_find_input_format()
+    char format[64];
+    snprintf(format, sizeof(format), "%s", dec->fmt_ctx->iformat->name);
+    format[strcspn(format, ",")] = '\0';
+
+    // write to temporary file, so that concurrent reader never sees
+    // partially written one
+    std::string tmp_path = cache_path + ".XXXXXX";
+
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0) {
+        return;
+    }
+
+    FILE* fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    fprintf(fp, "%s %d %d %d %d %llx %lld %d %d %d %lld\n",
+            format, dec->stream, (int)ctx->codec_id,
+            ctx->sample_rate, ctx->channels, (unsigned long long)ctx->channel_layout,
+            (long long)ctx->bit_rate, ctx->block_align,
+            ctx->bits_per_coded_sample, ctx->frame_size,
+            (long long)dec->fmt_ctx->duration);
+
+    if (fclose(fp) != 0 || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
+
+// find demuxer by file extension, so that avformat_open_input() doesn't
+// have to read and score the beginning of the file against every demuxer
+static AVInputFormat* find_format_by_extension(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return NULL;
+    }
+
+    char ext[16];
+    size_t n = 0;
+    for (const char* p = dot + 1; *p && n < sizeof(ext) - 1; p++) {
+        ext[n++] = (char)tolower((unsigned char)*p);
+    }
+    ext[n] = '\0';
+
+    // many demuxers are named after extension, e.g. "wav", "flac" or "mp3"
+    if (AVInputFormat* fmt = av_find_input_format(ext)) {
+        return fmt;
+    }
+
+    // others list their extensions, e.g. "mov,mp4,m4a" handles ".m4a"
+    for (AVInputFormat* fmt = av_iformat_next(NULL); fmt; fmt = av_iformat_next(fmt)) {
+        if (fmt->extensions && av_match_ext(path, fmt->extensions)) {
+            return fmt;
+        }
+    }
+
+    return NULL;
+}
+
+// true if container header alone gives enough to open decoder and converter
+static bool header_complete(AVFormatContext* fmt_ctx) {
+    for (unsigned n = 0; n < fmt_ctx->nb_streams; n++) {
+        const AVCodecContext* ctx = fmt_ctx->streams[n]->codec;
+        if (ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+            return ctx->codec_id != AV_CODEC_ID_NONE
+                && ctx->sample_rate > 0 && ctx->channels > 0;
+        }
+    }
+    return false;
+}
+
+// fill parameters that container header didn't provide from probe cache
+// returns false if cached parameters don't match the file
+static bool apply_probe_params(AVFormatContext* fmt_ctx, const probe_params* params) {
+    if (params->stream < 0 || (unsigned)params->stream >= fmt_ctx->nb_streams) {
+        return false;
+    }
+
+    AVCodecContext* ctx = fmt_ctx->streams[params->stream]->codec;
+
+    if (ctx->codec_type != AVMEDIA_TYPE_AUDIO || ctx->codec_id != params->codec_id) {
+        return false;
+    }
+
+    if (ctx->sample_rate == 0) {
+        ctx->sample_rate = params->sample_rate;
+    }
+    if (ctx->channels == 0) {
+        ctx->channels = params->channels;
+    }
+    if (ctx->channel_layout == 0) {
+        ctx->channel_layout = params->channel_layout;
+    }
+    if (ctx->bit_rate == 0) {
+        ctx->bit_rate = params->bit_rate;
+    }
+    if (ctx->block_align == 0) {
+        ctx->block_align = params->block_align;
+    }
+    if (ctx->bits_per_coded_sample == 0) {
+        ctx->bits_per_coded_sample = params->bits_per_coded_sample;
+    }
+    if (ctx->frame_size == 0) {
+        ctx->frame_size = params->frame_size;
+    }
+    if (fmt_ctx->duration <= 0) {
+        fmt_ctx->duration = params->duration;
+    }
+
+    return true;
+}
+
+// limits for both format probing and avformat_find_stream_info()
+static AVDictionary* format_options(const options* opts) {
+    AVDictionary* fmt_opts = NULL;
+    if (opts->probesize > 0) {
+        av_dict_set_int(&fmt_opts, "probesize", opts->probesize, 0);
+    }
+    if (opts->analyzeduration > 0) {
+        av_dict_set_int(&fmt_opts, "analyzeduration", opts->analyzeduration, 0);
+    }
+    return fmt_opts;
+}
+
+// if 'native_rate' is false, decoded samples are converted to output format;
+// otherwise they're converted to output sample format and channel layout, but
+// keep input sample rate, so that conversion doesn't keep state between frames
+// returns false if file can't be decoded
+static bool open_decoder(decoder* dec, const char* path, pcm_writer* out,
+                         const options* opts, bool native_rate) {
+    dec->opts = opts;
+    dec->out = out;
 
     // allocate empty format context
     // provides methods for reading input packets
-    AVFormatContext* fmt_ctx = avformat_alloc_context();
-    assert(fmt_ctx);
+    dec->fmt_ctx = avformat_alloc_context();
+    assert(dec->fmt_ctx);
+
+    // read from memory mapping instead of file protocol; format context
+    // doesn't own custom AVIOContext, so we free it ourselves
+    if (opts->mmap) {
+        if (open_mmap_input(dec, path)) {
+            dec->fmt_ctx->pb = dec->avio;
+        } else {
+            fprintf(stderr, "warning: %s: can't mmap, reading normally\n", path);
+        }
+    }
+
+    dec->open_start = now_seconds();
+    dec->first_sample = -1;
+
+    // parameters probed when this file was opened last time
+    probe_params cached;
+    bool have_cached = opts->probe_cache
+        && probe_cache_load(opts->probe_cache, path, &cached);
+
+    // with known demuxer, avformat_open_input() skips format probing
+    AVInputFormat* iformat = NULL;
+    if (have_cached) {
+        iformat = av_find_input_format(cached.format);
+    } else if (opts->fast_open) {
+        iformat = find_format_by_extension(path);
+    }
 
     // determine input file type and initialize format context
-    if (avformat_open_input(&fmt_ctx, argv[1], NULL, NULL) != 0) {
-        fprintf(stderr, "error: avformat_open_input()\n");
-        exit(1);
+    AVDictionary* fmt_opts = format_options(opts);
+    int ret = avformat_open_input(&dec->fmt_ctx, path, iformat, &fmt_opts);
+    av_dict_free(&fmt_opts);
+
+    if (ret != 0 && iformat) {
+        // extension or cache was wrong, probe contents
+        dec->fmt_ctx = avformat_alloc_context();
+        assert(dec->fmt_ctx);
+        if (dec->avio) {
+            avio_seek(dec->avio, 0, SEEK_SET);
+            dec->fmt_ctx->pb = dec->avio;
+        }
+        have_cached = false;
+        // avformat_open_input() consumed options on the first attempt
+        fmt_opts = format_options(opts);
+        ret = avformat_open_input(&dec->fmt_ctx, path, NULL, &fmt_opts);
+        av_dict_free(&fmt_opts);
     }
 
-    // determine supported codecs for input file streams and add
-    // them to format context
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "error: avformat_find_stream_info()\n");
-        exit(1);
+    if (ret != 0) {
+        fprintf(stderr, "error: %s: avformat_open_input()\n", path);
+        return false;
     }
 
+    const double probe_start = now_seconds();
+    dec->open_time = probe_start - dec->open_start;
+
+    // avformat_find_stream_info() reads and decodes packets until it finds
+    // parameters of every stream; skip it if they're already known from
+    // probe cache or, with fast open, from container header
+    if (have_cached && apply_probe_params(dec->fmt_ctx, &cached)) {
+        dec->probe_mode = "cached";
+    } else if (opts->fast_open && header_complete(dec->fmt_ctx)) {
+        dec->probe_mode = "header";
+    } else {
+        dec->probe_mode = "full";
+
+        // determine supported codecs for input file streams and add
+        // them to format context
+        if (avformat_find_stream_info(dec->fmt_ctx, NULL) < 0) {
+            fprintf(stderr, "error: %s: avformat_find_stream_info()\n", path);
+            return false;
+        }
+    }
+
+    dec->probe_time = now_seconds() - probe_start;
+
 #if 0
-    av_dump_format(fmt_ctx, 0, argv[1], false);
+    av_dump_format(dec->fmt_ctx, 0, path, false);
 #endif
 
     // find audio stream in format context
     size_t stream = 0;
-    for (; stream < fmt_ctx->nb_streams; stream++) {
-        if (fmt_ctx->streams[stream]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+    for (; stream < dec->fmt_ctx->nb_streams; stream++) {
+        if (dec->fmt_ctx->streams[stream]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
             break;
         }
     }
-    if (stream == fmt_ctx->nb_streams) {
-        fprintf(stderr, "error: no audio stream found\n");
-        exit(1);
+    if (stream == dec->fmt_ctx->nb_streams) {
+        fprintf(stderr, "error: %s: no audio stream found\n", path);
+        return false;
     }
+    dec->stream = (int)stream;
 
     // get codec context for audio stream
     // provides methods for decoding input packets received from format context
-    AVCodecContext* codec_ctx = fmt_ctx->streams[stream]->codec;
-    assert(codec_ctx);
-
-    if (codec_ctx->channel_layout == 0) {
-        codec_ctx->channel_layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
-    }
+    dec->codec_ctx = dec->fmt_ctx->streams[stream]->codec;
+    assert(dec->codec_ctx);
 
     // find decoder for audio stream
-    AVCodec* codec = avcodec_find_decoder(codec_ctx->codec_id);
+    AVCodec* codec = avcodec_find_decoder(dec->codec_ctx->codec_id);
     if (!codec) {
-        fprintf(stderr, "error: avcodec_find_decoder()\n");
-        exit(1);
+        fprintf(stderr, "error: %s: avcodec_find_decoder()\n", path);
+        return false;
+    }
+
+    const double codec_start = now_seconds();
+
+    // decoded frames are passed to another stage instead of being
+    // consumed before the next decode call, so let them own their buffers
+    dec->codec_ctx->refcounted_frames = 1;
+
+    // let codec decode several frames or slices in parallel;
+    // zero thread count means "one thread per core"
+    if (opts->pipelined) {
+        dec->codec_ctx->thread_count = 0;
+        dec->codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
     }
 
     // initialize codec context with decoder we've found
-    if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
-        fprintf(stderr, "error: avcodec_open2()\n");
-        exit(1);
+    if (avcodec_open2(dec->codec_ctx, codec, NULL) < 0) {
+        fprintf(stderr, "error: %s: avcodec_open2()\n", path);
+        return false;
+    }
+
+    // container or decoder may give channel count without layout
+    if (dec->codec_ctx->channel_layout == 0) {
+        dec->codec_ctx->channel_layout =
+            av_get_default_channel_layout(dec->codec_ctx->channels);
     }
 
+    dec->out_rate = native_rate ? dec->codec_ctx->sample_rate : sample_rate;
+
     // initialize converter from input audio stream to output stream
     // provides methods for converting decoded packets to output stream
-    SwrContext* swr_ctx =
+    dec->swr_ctx =
         swr_alloc_set_opts(NULL,
-                           AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT, // output
-                           AV_SAMPLE_FMT_FLT,                    // output
-                           sample_rate,                          // output
-                           codec_ctx->channel_layout,  // input
-                           codec_ctx->sample_fmt,      // input
-                           codec_ctx->sample_rate,     // input
+                           out_layout,                     // output
+                           AV_SAMPLE_FMT_FLT,              // output
+                           dec->out_rate,                  // output
+                           dec->codec_ctx->channel_layout, // input
+                           dec->codec_ctx->sample_fmt,     // input
+                           dec->codec_ctx->sample_rate,    // input
                            0,
                            NULL);
-    if (!swr_ctx) {
-        fprintf(stderr, "error: swr_alloc_set_opts()\n");
-        exit(1);
+    if (!dec->swr_ctx) {
+        fprintf(stderr, "error: %s: swr_alloc_set_opts()\n", path);
+        return false;
+    }
+
+    // fails on missing or bad stream parameters, which fast open and probe
+    // cache don't verify as thoroughly as avformat_find_stream_info()
+    if (swr_init(dec->swr_ctx) < 0) {
+        fprintf(stderr, "error: %s: swr_init()\n", path);
+        return false;
+    }
+
+    dec->codec_time = now_seconds() - codec_start;
+
+    if (opts->probe_cache && strcmp(dec->probe_mode, "full") == 0) {
+        probe_cache_store(opts->probe_cache, path, dec);
+    }
+
+    // output range, in samples per channel; out_pos is unknown until first
+    // decoded frame arrives
+    dec->trim_start = llround(opts->start * dec->out_rate);
+    dec->trim_end = opts->duration < 0
+        ? -1 : dec->trim_start + llround(opts->duration * dec->out_rate);
+    dec->out_pos = AV_NOPTS_VALUE;
+
+    // if input is not seekable, we'll decode and drop everything before start
+    if (opts->start > 0 && !seek_decoder(dec, opts->start)) {
+        fprintf(stderr, "warning: %s: can't seek, decoding from beginning\n", path);
+    }
+
+    return true;
+}
+
+// may be called for partially opened decoder too
+static void close_decoder(decoder* dec) {
+    if (dec->out_pool) {
+        av_buffer_pool_uninit(&dec->out_pool);
+    }
+
+    swr_free(&dec->swr_ctx);
+
+    if (dec->codec_ctx) {
+        avcodec_close(dec->codec_ctx);
+    }
+    avformat_close_input(&dec->fmt_ctx);
+
+    close_mmap_input(dec);
+}
+
+// stop decoding after an error; output is incomplete and the file fails,
+// but the process goes on, e.g. with other files in batch mode
+static void fail_decoder(decoder* dec, const char* func) {
+    fprintf(stderr, "error: %s\n", func);
+    dec->failed = true;
+    dec->finished = true;
+}
+
+// demuxer stage
+// reads next audio packet from input file, returns false at end of file
+// or when requested duration was already decoded
+static bool read_packet(decoder* dec, AVPacket* packet) {
+    while (!dec->finished && av_read_frame(dec->fmt_ctx, packet) >= 0) {
+        if (packet->stream_index == dec->stream) {
+            return true;
+        }
+        // skip non-audio packets
+        av_packet_unref(packet);
+    }
+    return false;
+}
+
+// decoder stage
+// decodes packet and passes every decoded frame to sink; the sink becomes
+// responsible for unreferencing the frame; NULL packet drains frames
+// buffered inside decoder at end of stream
+template <class Sink>
+static void decode_packet(decoder* dec, AVPacket* packet, AVFrame* frame, Sink sink) {
+    AVPacket pkt;
+    if (packet) {
+        pkt = *packet;
+    } else {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+    }
+
+    for (;;) {
+        // decode packet to frame
+        int got_frame = 0;
+        int ret = avcodec_decode_audio4(dec->codec_ctx, frame, &got_frame, &pkt);
+        dec->n_decoded++;
+        if (ret < 0) {
+            // skip broken packet; when draining, there is nothing more
+            if (packet) {
+                fprintf(stderr, "warning: avcodec_decode_audio4(): skipping broken packet\n");
+            }
+            break;
+        }
+
+        if (got_frame) {
+            sink(frame);
+        }
+
+        if (!packet) {
+            // draining: stop when decoder has nothing more
+            if (!got_frame) {
+                break;
+            }
+        } else {
+            // some codecs put several frames into one packet
+            pkt.data += ret;
+            pkt.size -= ret;
+            if (pkt.size <= 0 || (ret == 0 && !got_frame)) {
+                break;
+            }
+        }
+    }
+}
+
+// get empty output frame with buffer from pool, large enough to hold
+// 'n_samples' samples per channel
+static AVFrame* get_out_frame(decoder* dec, int n_samples) {
+    // pool is reallocated only when a frame larger than any previous one
+    // arrives, which usually happens only for the first few frames; old
+    // pool is freed when all its buffers are returned
+    if (!dec->out_pool || n_samples > dec->out_pool_samples) {
+        if (dec->out_pool) {
+            av_buffer_pool_uninit(&dec->out_pool);
+        }
+        dec->out_pool_samples = FFMAX(n_samples, min_out_samples);
+        dec->out_pool = av_buffer_pool_init(
+            av_samples_get_buffer_size(
+                NULL, out_channels, dec->out_pool_samples, AV_SAMPLE_FMT_FLT, 1),
+            NULL);
+        assert(dec->out_pool);
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    assert(frame);
+
+    frame->buf[0] = av_buffer_pool_get(dec->out_pool);
+    assert(frame->buf[0]);
+
+    frame->data[0] = frame->buf[0]->data;
+    frame->extended_data = frame->data;
+    frame->linesize[0] = frame->buf[0]->size;
+    frame->format = AV_SAMPLE_FMT_FLT;
+    frame->channel_layout = out_layout;
+    frame->channels = out_channels;
+    frame->sample_rate = dec->out_rate;
+    frame->nb_samples = 0;
+
+    return frame;
+}
+
+// find output position of the first decoded frame
+static void init_out_pos(decoder* dec, AVFrame* in) {
+    AVStream* stream = dec->fmt_ctx->streams[dec->stream];
+
+    int64_t ts = in->best_effort_timestamp;
+    if (ts == AV_NOPTS_VALUE) {
+        // no timestamps, assume we're at the beginning
+        dec->out_pos = 0;
+        return;
+    }
+
+    if (stream->start_time != AV_NOPTS_VALUE) {
+        ts -= stream->start_time;
+    }
+
+    const AVRational out_time_base = { 1, dec->out_rate };
+
+    dec->out_pos = av_rescale_q(ts, stream->time_base, out_time_base);
+}
+
+// cut samples outside of [trim_start; trim_end) from output frame
+// returns false if nothing left
+static bool trim_frame(decoder* dec, AVFrame* out) {
+    const int64_t begin = dec->out_pos, end = dec->out_pos + out->nb_samples;
+
+    dec->out_pos = end;
+
+    if (dec->trim_end >= 0 && end >= dec->trim_end) {
+        dec->finished = true;
+    }
+
+    int64_t skip_front = dec->trim_start - begin;
+    if (skip_front < 0) {
+        skip_front = 0;
+    }
+
+    int64_t skip_back = dec->trim_end >= 0 ? end - dec->trim_end : 0;
+    if (skip_back < 0) {
+        skip_back = 0;
+    }
+
+    if (skip_front + skip_back >= out->nb_samples) {
+        return false;
+    }
+
+    out->data[0] += skip_front * out_channels * sizeof(float);
+    out->nb_samples -= (int)(skip_front + skip_back);
+
+    return true;
+}
+
+// resampler stage
+// converts input frame to output frames and passes them to sink; the sink
+// becomes responsible for freeing output frames; NULL input frame flushes
+// samples buffered inside resampler at end of stream
+//
+// output frame is sized using swr_get_out_samples(), so that the whole input
+// frame, together with samples buffered inside resampler, is converted in one
+// call; when flushing, the loop runs until resampler is empty
+//
+// note that NULL input tells swr_convert() to flush, so when we only want to
+// fetch samples buffered inside resampler, we pass non-NULL input with zero
+// samples instead
+template <class Sink>
+static void resample_frame(decoder* dec, AVFrame* in, Sink sink) {
+    const uint8_t** in_data = in ? (const uint8_t**)in->extended_data : NULL;
+    int in_samples = in ? in->nb_samples : 0;
+
+    if (in && dec->out_pos == AV_NOPTS_VALUE) {
+        init_out_pos(dec, in);
+    }
+    if (dec->out_pos == AV_NOPTS_VALUE) {
+        dec->out_pos = 0;
+    }
+
+    for (;;) {
+        int max_samples = swr_get_out_samples(dec->swr_ctx, in_samples);
+        if (max_samples < 0) {
+            fail_decoder(dec, "swr_get_out_samples()");
+            break;
+        }
+        if (!in) {
+            // flushing may also produce samples that are not yet counted
+            // by swr_get_out_samples(), e.g. filter tail
+            max_samples = FFMAX(max_samples, min_out_samples);
+        }
+        if (dec->opts->max_chunk > 0 && max_samples > dec->opts->max_chunk) {
+            max_samples = dec->opts->max_chunk;
+        }
+        if (max_samples == 0) {
+            break;
+        }
+
+        AVFrame* out = get_out_frame(dec, max_samples);
+
+        // convert input frame to output buffer
+        int got_samples = swr_convert(
+            dec->swr_ctx,
+            out->data, max_samples,
+            in_data, in_samples);
+        dec->n_converted++;
+
+        if (got_samples < 0) {
+            av_frame_free(&out);
+            fail_decoder(dec, "swr_convert()");
+            break;
+        }
+
+        if (got_samples == 0) {
+            av_frame_free(&out);
+            break;
+        }
+
+        out->nb_samples = got_samples;
+
+        if (trim_frame(dec, out)) {
+            sink(out);
+        } else {
+            av_frame_free(&out);
+        }
+
+        // keep going only if resampler may still have buffered samples,
+        // i.e. when flushing, or when output was limited by max_chunk
+        if (in && got_samples < max_samples) {
+            break;
+        }
+
+        // after first call, process samples buffered inside swr context
+        in_samples = 0;
+    }
+}
+
+// writer stage
+// writes output frame to output file
+static void write_frame(decoder* dec, AVFrame* out) {
+    if (dec->n_written == 0) {
+        dec->first_sample = now_seconds() - dec->open_start;
     }
-    swr_init(swr_ctx);
 
+    pcm_writer_write_samples(dec->out, (const float*)out->data[0],
+                             (size_t)out->nb_samples * out_channels);
+
+    dec->n_written += out->nb_samples;
+
+    // the rest would be discarded anyway
+    if (dec->out->failed) {
+        dec->failed = true;
+        dec->finished = true;
+    }
+}
+
+// run all stages one after another in current thread
+static void decode_sequential(decoder* dec) {
     // create empty packet for input stream
     AVPacket packet;
     av_init_packet(&packet);
@@ -118,71 +983,685 @@ int main(int argc, char** argv) {
     AVFrame* frame = av_frame_alloc();
     assert(frame);
 
-    // allocate buffer for output stream
-    uint8_t* buffer = (uint8_t*)av_malloc(max_buffer_size);
-    assert(buffer);
+    auto write_sink = [dec](AVFrame* out) {
+        write_frame(dec, out);
+        av_frame_free(&out);
+    };
+
+    auto resample_sink = [dec, write_sink](AVFrame* in) {
+        resample_frame(dec, in, write_sink);
+        av_frame_unref(in);
+    };
 
     // read packet from input audio file
-    while (av_read_frame(fmt_ctx, &packet) >= 0) {
-        // skip non-audio packets
-        if (packet.stream_index != stream) {
-            continue;
+    while (read_packet(dec, &packet)) {
+        decode_packet(dec, &packet, frame, resample_sink);
+
+        // free packet created by demuxer
+        av_packet_unref(&packet);
+    }
+
+    // flush decoder and resampler
+    decode_packet(dec, NULL, frame, resample_sink);
+    resample_frame(dec, NULL, write_sink);
+
+    av_frame_free(&frame);
+}
+
+// run every stage in its own thread; stages pass ownership of packets and
+// frames to each other via queues, and NULL means end of stream
+static void decode_pipelined(decoder* dec) {
+    spsc_queue<AVPacket*> packet_queue(queue_size);
+    spsc_queue<AVFrame*> frame_queue(queue_size);
+    spsc_queue<AVFrame*> out_queue(queue_size);
+
+    std::thread demux_thread([&]() {
+        for (;;) {
+            AVPacket* packet = av_packet_alloc();
+            assert(packet);
+
+            if (!read_packet(dec, packet)) {
+                av_packet_free(&packet);
+                break;
+            }
+
+            packet_queue.push(packet);
         }
+        packet_queue.push(NULL);
+    });
 
-        // decode packet to frame
-        int got_frame = 0;
-        if (avcodec_decode_audio4(codec_ctx, frame, &got_frame, &packet) < 0) {
-            fprintf(stderr, "error: avcodec_decode_audio4()\n");
-            exit(1);
+    std::thread decode_thread([&]() {
+        AVFrame* frame = av_frame_alloc();
+        assert(frame);
+
+        auto sink = [&](AVFrame* decoded) {
+            AVFrame* queued = av_frame_alloc();
+            assert(queued);
+            av_frame_move_ref(queued, decoded);
+            frame_queue.push(queued);
+        };
+
+        for (;;) {
+            AVPacket* packet = packet_queue.pop();
+            if (!packet) {
+                break;
+            }
+            decode_packet(dec, packet, frame, sink);
+            av_packet_free(&packet);
         }
 
-        if (!got_frame) {
-            continue;
+        decode_packet(dec, NULL, frame, sink);
+        frame_queue.push(NULL);
+
+        av_frame_free(&frame);
+    });
+
+    std::thread resample_thread([&]() {
+        auto sink = [&](AVFrame* out) {
+            out_queue.push(out);
+        };
+
+        for (;;) {
+            AVFrame* frame = frame_queue.pop();
+            if (!frame) {
+                break;
+            }
+            resample_frame(dec, frame, sink);
+            av_frame_free(&frame);
         }
 
-        // convert input frame to output buffer
-        int got_samples = swr_convert(
-            swr_ctx,
-            &buffer, out_samples,
-            (const uint8_t **)frame->data, frame->nb_samples);
+        resample_frame(dec, NULL, sink);
+        out_queue.push(NULL);
+    });
 
-        if (got_samples < 0) {
-            fprintf(stderr, "error: swr_convert()\n");
+    // writer runs in current thread
+    for (;;) {
+        AVFrame* out = out_queue.pop();
+        if (!out) {
+            break;
+        }
+        write_frame(dec, out);
+        av_frame_free(&out);
+    }
+
+    demux_thread.join();
+    decode_thread.join();
+    resample_thread.join();
+}
+
+// per-worker state in parallel mode
+struct chunk_worker {
+    decoder dec;
+    bool opened;
+    bool used;    // decoder position is not at the beginning of input
+};
+
+// decode input samples [begin; end), or [begin; end of input) if 'end' is
+// negative, into 'result' as interleaved stereo floats at input sample rate
+static void decode_chunk(chunk_worker* w, const char* path,
+                         int64_t begin, int64_t end, std::vector<float>& result) {
+    decoder* dec = &w->dec;
+
+    dec->trim_start = begin;
+    dec->trim_end = end;
+    dec->out_pos = AV_NOPTS_VALUE;
+    dec->finished = false;
+
+    // start a bit earlier, so that decoder state, like MP3 bit reservoir or
+    // MDCT overlap, is restored when the chunk begins; everything before
+    // 'begin' is trimmed
+    if (begin > 0 || w->used) {
+        double position = (double)begin / dec->out_rate - chunk_preroll;
+        if (position < 0) {
+            position = 0;
+        }
+        if (!seek_decoder(dec, position)) {
+            fprintf(stderr, "error: %s: can't seek\n", path);
             exit(1);
         }
+    }
+    w->used = true;
 
-        while (got_samples > 0) {
-            int buffer_size =
-                av_samples_get_buffer_size(
-                    NULL, out_channels, got_samples, AV_SAMPLE_FMT_FLT, 1);
+    result.clear();
 
-            assert(buffer_size <= max_buffer_size);
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
 
-            // write output buffer to stdout
-            if (write(STDOUT_FILENO, buffer, buffer_size) != buffer_size) {
-                fprintf(stderr, "error: write(stdout)\n");
-                exit(1);
+    AVFrame* frame = av_frame_alloc();
+    assert(frame);
+
+    auto append_sink = [&](AVFrame* out) {
+        const float* samples = (const float*)out->data[0];
+        result.insert(result.end(), samples, samples + out->nb_samples * out_channels);
+        av_frame_free(&out);
+    };
+
+    auto resample_sink = [&](AVFrame* in) {
+        resample_frame(dec, in, append_sink);
+        av_frame_unref(in);
+    };
+
+    while (read_packet(dec, &packet)) {
+        decode_packet(dec, &packet, frame, resample_sink);
+        av_packet_unref(&packet);
+    }
+
+    // reached end of input before end of chunk
+    if (!dec->finished) {
+        decode_packet(dec, NULL, frame, resample_sink);
+        resample_frame(dec, NULL, append_sink);
+    }
+
+    av_frame_free(&frame);
+}
+
+// decode input in chunks of 'chunk_seconds' using opts->parallel threads, each
+// with its own demuxer and decoder seeked to the chunk it decodes; chunks are
+// written in order by current thread, which also resamples them, since
+// resampler keeps state between chunks and its output must not depend on
+// chunk boundaries
+// returns number of written samples per channel, or -1 on error
+static int64_t decode_parallel(const char* path, pcm_writer* out, const options* opts,
+                               int64_t* n_decoded, int64_t* n_converted) {
+    const size_t n_workers = (size_t)opts->parallel;
+
+    std::vector<chunk_worker> workers(n_workers);
+
+    // first decoder is opened here to find input rate and duration
+    if (!open_decoder(&workers[0].dec, path, out, opts, true)) {
+        close_decoder(&workers[0].dec);
+        return -1;
+    }
+    workers[0].opened = true;
+
+    AVFormatContext* fmt_ctx = workers[0].dec.fmt_ctx;
+    const int in_rate = workers[0].dec.out_rate;
+
+    const int64_t chunk_samples = (int64_t)chunk_seconds * in_rate;
+
+    // if duration is unknown or input can't be seeked, the whole input is
+    // one chunk
+    size_t n_chunks = 1;
+    if (fmt_ctx->duration > 0 && fmt_ctx->pb && fmt_ctx->pb->seekable) {
+        const int64_t in_samples = av_rescale(fmt_ctx->duration, in_rate, AV_TIME_BASE);
+        n_chunks = (size_t)((in_samples + chunk_samples - 1) / chunk_samples);
+        if (n_chunks == 0) {
+            n_chunks = 1;
+        }
+    } else {
+        fprintf(stderr, "warning: %s: can't seek, decoding in one thread\n", path);
+    }
+
+    // resampler from worker output to output format, used only if input
+    // sample rate is different
+    SwrContext* swr_ctx = NULL;
+    if (in_rate != sample_rate) {
+        swr_ctx = swr_alloc_set_opts(NULL,
+                                     out_layout, AV_SAMPLE_FMT_FLT, sample_rate,
+                                     out_layout, AV_SAMPLE_FMT_FLT, in_rate,
+                                     0, NULL);
+        if (!swr_ctx || swr_init(swr_ctx) < 0) {
+            fprintf(stderr, "error: %s: swr_init()\n", path);
+            exit(1);
+        }
+    }
+
+    std::vector<float> out_buf;
+    int64_t n_written = 0;
+
+    // convert 'n_samples' samples, or flush resampler if 'in' is NULL,
+    // and write result
+    auto resample_and_write = [&](const float* in, int n_samples) {
+        const uint8_t* in_data = (const uint8_t*)in;
+
+        for (;;) {
+            int max_samples = swr_get_out_samples(swr_ctx, n_samples);
+            if (!in) {
+                max_samples = FFMAX(max_samples, min_out_samples);
+            }
+            if (max_samples <= 0) {
+                break;
             }
 
-            // process samples buffered inside swr context
-            got_samples = swr_convert(swr_ctx, &buffer, out_samples, NULL, 0);
+            out_buf.resize((size_t)max_samples * out_channels);
+            uint8_t* out_data = (uint8_t*)&out_buf[0];
+
+            int got_samples = swr_convert(swr_ctx, &out_data, max_samples,
+                                          in ? &in_data : NULL, n_samples);
+            (*n_converted)++;
+
             if (got_samples < 0) {
                 fprintf(stderr, "error: swr_convert()\n");
                 exit(1);
             }
+
+            pcm_writer_write_samples(out, &out_buf[0], (size_t)got_samples * out_channels);
+            n_written += got_samples;
+
+            if (in || got_samples == 0) {
+                break;
+            }
         }
+    };
+
+    chunk_pool_run<std::vector<float>>(
+        n_chunks, n_workers,
+        [&](size_t worker, size_t chunk, std::vector<float>& result) {
+            chunk_worker* w = &workers[worker];
+
+            if (!w->opened) {
+                if (!open_decoder(&w->dec, path, out, opts, true)) {
+                    exit(1);
+                }
+                w->opened = true;
+            }
+
+            const int64_t begin = (int64_t)chunk * chunk_samples;
+            const int64_t end = chunk + 1 < n_chunks ? begin + chunk_samples : -1;
+
+            decode_chunk(w, path, begin, end, result);
+        },
+        [&](size_t, std::vector<float>& result) {
+            const size_t n_samples = result.size() / out_channels;
 
-        // free packet created by decoder
-        av_free_packet(&packet);
+            if (!swr_ctx) {
+                pcm_writer_write_samples(out, result.data(), result.size());
+                n_written += (int64_t)n_samples;
+                return;
+            }
+
+            // convert in frame-sized pieces, so that output buffer stays small
+            for (size_t pos = 0; pos < n_samples; pos += min_out_samples) {
+                size_t n = n_samples - pos;
+                if (n > (size_t)min_out_samples) {
+                    n = min_out_samples;
+                }
+                resample_and_write(&result[pos * out_channels], (int)n);
+            }
+        });
+
+    if (swr_ctx) {
+        resample_and_write(NULL, 0);
+        swr_free(&swr_ctx);
     }
 
-    av_free(buffer);
-    av_frame_free(&frame);
+    bool failed = false;
+
+    for (size_t n = 0; n < n_workers; n++) {
+        if (workers[n].opened) {
+            *n_decoded += workers[n].dec.n_decoded;
+            *n_converted += workers[n].dec.n_converted;
+            failed = failed || workers[n].dec.failed;
+            close_decoder(&workers[n].dec);
+        }
+    }
+
+    return failed ? -1 : n_written;
+}
+
+// decode one file to output file descriptor
+// returns number of written samples per channel, or -1 on error
+static int64_t decode_file(const char* path, int out_fd, const options* opts) {
+    pcm_cache cache;
+
+    if (opts->cache_dir) {
+        pcm_cache_init(&cache, opts->cache_dir, opts->cache_size, opts->cache_hash);
+
+        // everything that affects output should be here; in parallel mode,
+        // resampling is done in two steps, which may change output slightly
+        char settings[256];
+        snprintf(settings, sizeof(settings),
+                 "ffmpeg_decode %s %d %d start=%.6f duration=%.6f parallel=%d",
+                 opts->sample_format ? pcm_format_name(opts->sample_format) : "flt",
+                 out_channels, sample_rate, opts->start, opts->duration,
+                 opts->parallel > 1);
+
+        int64_t n_bytes = pcm_cache_lookup(&cache, path, settings, out_fd);
+        if (n_bytes == -2) {
+            // output error fails only this file, like write errors below
+            return -1;
+        }
+        if (n_bytes >= 0) {
+            size_t sample_size = sizeof(float);
+            if (opts->sample_format) {
+                sample_size = pcm_format_sample_size(opts->sample_format);
+                n_bytes -= PCM_HEADER_SIZE;
+            }
+            return n_bytes / (int64_t)(out_channels * sample_size);
+        }
+    }
+
+    // write errors fail only this file, see below
+    pcm_writer out;
+    pcm_writer_open(&out, out_fd);
+    out.soft_errors = true;
+
+    if (opts->cache_dir) {
+        out.tee_fd = pcm_cache_begin(&cache);
+    }
+
+    if (opts->sample_format) {
+        const pcm_format format = { opts->sample_format, out_channels, sample_rate };
+        pcm_writer_set_format(&out, &format);
+    }
+
+    int64_t n_written = 0, n_decoded = 0, n_converted = 0;
+
+    // startup latency, reported only when decoding in one decoder
+    char startup[256] = {};
+
+    if (opts->parallel > 1) {
+        n_written = decode_parallel(path, &out, opts, &n_decoded, &n_converted);
+    } else {
+        decoder dec = {};
+        if (open_decoder(&dec, path, &out, opts, false)) {
+            if (opts->pipelined) {
+                decode_pipelined(&dec);
+            } else {
+                decode_sequential(&dec);
+            }
+            n_written = dec.failed ? -1 : dec.n_written;
+            n_decoded = dec.n_decoded;
+            n_converted = dec.n_converted;
+
+            snprintf(startup, sizeof(startup),
+                     "open %.3f ms, probe %.3f ms (%s), codec %.3f ms, "
+                     "first sample %.3f ms",
+                     dec.open_time * 1e3, dec.probe_time * 1e3, dec.probe_mode,
+                     dec.codec_time * 1e3, dec.first_sample * 1e3);
+        } else {
+            n_written = -1;
+        }
+        close_decoder(&dec);
+    }
+
+    pcm_writer_close(&out);
+
+    if (out.failed) {
+        n_written = -1;
+    }
+
+    if (opts->cache_dir) {
+        pcm_cache_end(&cache, n_written >= 0);
+    }
+
+    if (n_written < 0) {
+        return -1;
+    }
+
+    if (opts->stats) {
+        const double duration = (double)n_written / sample_rate;
+
+        fprintf(stderr,
+                "%s: %.3f s of audio, per second: %.1f decode calls, "
+                "%.1f swr_convert calls, %.1f write syscalls\n",
+                path, duration,
+                duration > 0 ? n_decoded / duration : 0.0,
+                duration > 0 ? n_converted / duration : 0.0,
+                duration > 0 ? out.n_syscalls / duration : 0.0);
+
+        if (startup[0]) {
+            fprintf(stderr, "%s: startup: %s\n", path, startup);
+        }
+    }
+
+    return n_written;
+}
+
+struct batch_job {
+    std::string input;
+    std::string output;
+};
+
+// decode every job into its own output file using a pool of worker threads
+// returns number of failed jobs
+static size_t decode_batch(const std::vector<batch_job>& jobs,
+                           size_t n_workers, const options* opts) {
+    std::atomic<size_t> next_job(0), n_failed(0);
+    std::atomic<int64_t> total_samples(0);
+
+    const double batch_start = now_seconds();
+
+    auto worker = [&]() {
+        for (;;) {
+            const size_t n = next_job++;
+            if (n >= jobs.size()) {
+                break;
+            }
+
+            const batch_job& job = jobs[n];
+
+            int fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "error: %s: open()\n", job.output.c_str());
+                n_failed++;
+                continue;
+            }
+
+            const double start = now_seconds();
+            const int64_t n_samples = decode_file(job.input.c_str(), fd, opts);
+            const double elapsed = now_seconds() - start;
+
+            close(fd);
+
+            // partial output is removed, other jobs go on
+            if (n_samples < 0) {
+                fprintf(stderr, "error: %s: decoding failed\n", job.input.c_str());
+                unlink(job.output.c_str());
+                n_failed++;
+                continue;
+            }
+
+            total_samples += n_samples;
+
+            const double duration = (double)n_samples / sample_rate;
+
+            fprintf(stderr, "%s: %.3f s of audio in %.3f s, %.1fx real time\n",
+                    job.input.c_str(), duration, elapsed,
+                    elapsed > 0 ? duration / elapsed : 0.0);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t n = 0; n < n_workers; n++) {
+        workers.push_back(std::thread(worker));
+    }
+    for (size_t n = 0; n < n_workers; n++) {
+        workers[n].join();
+    }
+
+    const double elapsed = now_seconds() - batch_start;
+    const double duration = (double)total_samples / sample_rate;
+
+    fprintf(stderr,
+            "total: %lu files (%lu failed), %.3f s of audio in %.3f s, "
+            "%.1fx real time, %lu workers\n",
+            (unsigned long)jobs.size(), (unsigned long)n_failed.load(),
+            duration, elapsed, elapsed > 0 ? duration / elapsed : 0.0,
+            (unsigned long)n_workers);
 
-    swr_free(&swr_ctx);
+    return n_failed;
+}
+
+// output file name for input file in batch mode: 'input.raw', or
+// 'out_dir/basename.raw' if output directory is specified
+static std::string batch_output(const std::string& input, const char* out_dir) {
+    if (!out_dir) {
+        return input + ".raw";
+    }
+    size_t slash = input.rfind('/');
+    std::string base = (slash == std::string::npos) ? input : input.substr(slash + 1);
+    return std::string(out_dir) + "/" + base + ".raw";
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [options] input_file > output_file\n", argv0);
+    fprintf(stderr, "       %s -P workers [-s] [-m] [cache options] input_file > output_file\n",
+            argv0);
+    fprintf(stderr, "       %s -b [options] [-j workers] [-o out_dir] input_file...\n", argv0);
+    fprintf(stderr, "       %s -b [options] [-j workers] [-o out_dir] < manifest\n", argv0);
+    fprintf(stderr, "options: [-p] [-s] [-m] [-f format] [-c chunk] [--start sec] [--duration sec]\n");
+    fprintf(stderr, "         [--cache dir] [--cache-size mb] [--cache-hash]\n");
+    fprintf(stderr, "         [--probesize bytes] [--analyzeduration sec] [--fast-open]\n");
+    fprintf(stderr, "         [--probe-cache dir]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    options opts = {};
+    opts.duration = -1;
+
+    bool batch = false;
+    size_t n_workers = std::thread::hardware_concurrency();
+    const char* out_dir = NULL;
+
+    static const struct option long_opts[] = {
+        { "start", required_argument, NULL, 'S' },
+        { "duration", required_argument, NULL, 'D' },
+        { "mmap", no_argument, NULL, 'm' },
+        { "cache", required_argument, NULL, 'C' },
+        { "cache-size", required_argument, NULL, 'Z' },
+        { "cache-hash", no_argument, NULL, 'H' },
+        { "parallel", required_argument, NULL, 'P' },
+        { "probesize", required_argument, NULL, 'R' },
+        { "analyzeduration", required_argument, NULL, 'A' },
+        { "fast-open", no_argument, NULL, 'F' },
+        { "probe-cache", required_argument, NULL, 'Q' },
+        { "format", required_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "psmf:c:S:D:C:P:bj:o:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            opts.pipelined = true;
+            break;
+        case 's':
+            opts.stats = true;
+            break;
+        case 'c':
+            opts.max_chunk = atoi(optarg);
+            break;
+        case 'm':
+            opts.mmap = true;
+            break;
+        case 'C':
+            opts.cache_dir = optarg;
+            break;
+        case 'Z':
+            if (atoll(optarg) <= 0) {
+                usage(argv[0]);
+            }
+            opts.cache_size = (uint64_t)atoll(optarg) << 20;
+            break;
+        case 'H':
+            opts.cache_hash = true;
+            break;
+        case 'S':
+            opts.start = atof(optarg);
+            break;
+        case 'D':
+            opts.duration = atof(optarg);
+            break;
+        case 'P':
+            opts.parallel = atoi(optarg);
+            break;
+        case 'R':
+            opts.probesize = atoll(optarg);
+            break;
+        case 'A':
+            opts.analyzeduration = llround(atof(optarg) * 1e6);
+            break;
+        case 'F':
+            opts.fast_open = true;
+            break;
+        case 'Q':
+            opts.probe_cache = optarg;
+            break;
+        case 'f':
+            opts.sample_format = pcm_format_parse(optarg);
+            if (!opts.sample_format) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'j':
+            n_workers = (size_t)atoi(optarg);
+            break;
+        case 'o':
+            out_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (n_workers == 0) {
+        n_workers = 1;
+    }
+
+    if (!batch && argc - optind != 1) {
+        usage(argv[0]);
+    }
+
+    // negative start would shift trim range and silently shorten output
+    if (opts.start < 0) {
+        usage(argv[0]);
+    }
+
+    if (opts.parallel > 1
+        && (batch || opts.pipelined || opts.start != 0 || opts.duration >= 0)) {
+        usage(argv[0]);
+    }
+
+    // register supported formats and codecs
+    av_register_all();
 
-    avcodec_close(codec_ctx);
-    avformat_close_input(&fmt_ctx);
+    if (!batch) {
+        if (decode_file(argv[optind], STDOUT_FILENO, &opts) < 0) {
+            exit(1);
+        }
+        return 0;
+    }
+
+    // in batch mode, inputs are either taken from arguments, or from manifest
+    // read from stdin; every manifest line is "input_file [output_file]"
+    std::vector<batch_job> jobs;
+
+    if (optind < argc) {
+        for (int n = optind; n < argc; n++) {
+            batch_job job;
+            job.input = argv[n];
+            job.output = batch_output(job.input, out_dir);
+            jobs.push_back(job);
+        }
+    } else {
+        char line[4096];
+        while (fgets(line, sizeof(line), stdin)) {
+            char input[4096] = {}, output[4096] = {};
+            int n = sscanf(line, "%4095s %4095s", input, output);
+            if (n < 1) {
+                continue;
+            }
+            batch_job job;
+            job.input = input;
+            job.output = (n == 2) ? std::string(output) : batch_output(job.input, out_dir);
+            jobs.push_back(job);
+        }
+    }
+
+    if (n_workers > jobs.size()) {
+        n_workers = jobs.size();
+    }
+
+    if (decode_batch(jobs, n_workers, &opts) != 0) {
+        exit(1);
+    }
 
     return 0;
 }
@@ -4,9 +4,28 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
+ * s24 samples are shifted to 32-bit samples, since ffmpeg has no codec
+ * for 24-bit samples in 32-bit words.
  *
  * Usage:
- *   ./ffmpeg_play < cool_song_samples
+ *   ./ffmpeg_play [-u] [-d device] < cool_song_samples
+ *
+ * By default, steady state is allocation-free: samples are read into one
+ * buffer that is allocated at startup and sent as a packet that doesn't own
+ * it, and only whole frames that were actually read are sent.
+ *
+ * With -u, samples are read into frames from a small pool and sent with
+ * av_write_uncoded_frame(), which gives them to the ALSA device without
+ * going through packet handling. The muxer takes ownership of every frame
+ * it's given and frees it, so it gets a new AVFrame referencing pooled
+ * samples; a pooled frame is refilled once the muxer dropped its reference.
+ *
+ * On exit, CPU time per minute of audio, write latency and heap allocations
+ * after warm-up are reported (see play_stats.h). With "-d null", ALSA
+ * discards samples as fast as they come, so that it can be used as
+ * a benchmark.
  */
 #include <unistd.h>
 #include <stdlib.h>
@@ -19,18 +38,76 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+#include "pcm_format.h"
+#include "play_stats.h"
+
+// frames that may be held by muxer at once in uncoded mode
+static const int frame_pool_size = 4;
+
+static play_stats stats;
+
+// sample format and codec for input format
+static void get_codec(int sample_format, AVSampleFormat* fmt, AVCodecID* codec_id) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        *fmt = AV_SAMPLE_FMT_S16;
+        *codec_id = AV_CODEC_ID_PCM_S16LE;
+        break;
+    case PCM_FORMAT_S24:
+        *fmt = AV_SAMPLE_FMT_S32;
+        *codec_id = AV_CODEC_ID_PCM_S32LE;
+        break;
+    default:
+        *fmt = AV_SAMPLE_FMT_FLT;
+        *codec_id = AV_CODEC_ID_PCM_F32LE;
+        break;
+    }
+}
+
 int main(int argc, char** argv) {
-    if (argc != 1) {
-        fprintf(stderr, "usage: %s < input_file\n", argv[0]);
+    const char* device = "default";
+    bool uncoded = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:u")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'u':
+            uncoded = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-u] [-d device] < input_file\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "usage: %s [-u] [-d device] < input_file\n", argv[0]);
         exit(1);
     }
 
-    const int in_channels = 2, in_samples = 512, sample_rate = 44100;
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        fprintf(stderr, "invalid stream header\n");
+        exit(1);
+    }
+
+    AVSampleFormat sample_fmt;
+    AVCodecID codec_id;
+    get_codec(format.sample_format, &sample_fmt, &codec_id);
+
+    const int in_channels = format.channels, in_samples = 512;
+    const int sample_rate = format.sample_rate;
     const int bitrate = 64000;
 
     const int max_buffer_size =
         av_samples_get_buffer_size(
-            NULL, in_channels, in_samples, AV_SAMPLE_FMT_FLT, 1);
+            NULL, in_channels, in_samples, sample_fmt, 1);
 
     // register supported formats and codecs
     av_register_all();
@@ -55,6 +132,7 @@ int main(int argc, char** argv) {
 
     // tell format context to use ALSA as ouput device
     fmt_ctx->oformat = fmt;
+    snprintf(fmt_ctx->filename, sizeof(fmt_ctx->filename), "%s", device);
 
     // add stream to format context
     AVStream* stream = avformat_new_stream(fmt_ctx, NULL);
@@ -67,17 +145,37 @@ int main(int argc, char** argv) {
     // format conetxt uses codec context when writing packets
     AVCodecContext* codec_ctx = stream->codec;
     assert(codec_ctx);
-    codec_ctx->codec_id = AV_CODEC_ID_PCM_F32LE;
+    codec_ctx->codec_id = codec_id;
     codec_ctx->codec_type = AVMEDIA_TYPE_AUDIO;
-    codec_ctx->sample_fmt = AV_SAMPLE_FMT_FLT;
+    codec_ctx->sample_fmt = sample_fmt;
     codec_ctx->bit_rate = bitrate;
     codec_ctx->sample_rate = sample_rate;
     codec_ctx->channels = in_channels;
-    codec_ctx->channel_layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
+    codec_ctx->channel_layout = av_get_default_channel_layout(in_channels);
+
+    // allocate buffer for input samples, or frames in uncoded mode
+    uint8_t* buffer = NULL;
+    AVFrame* frame_pool[frame_pool_size] = {};
 
-    // allocate buffer for input samples
-    uint8_t* buffer = (uint8_t*)av_malloc(max_buffer_size);
-    assert(buffer);
+    if (uncoded) {
+        for (int n = 0; n < frame_pool_size; n++) {
+            AVFrame* frame = av_frame_alloc();
+            assert(frame);
+            frame->format = sample_fmt;
+            frame->channel_layout = codec_ctx->channel_layout;
+            frame->channels = in_channels;
+            frame->sample_rate = sample_rate;
+            frame->nb_samples = in_samples;
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                fprintf(stderr, "av_frame_get_buffer()\n");
+                exit(1);
+            }
+            frame_pool[n] = frame;
+        }
+    } else {
+        buffer = (uint8_t*)av_malloc(max_buffer_size);
+        assert(buffer);
+    }
 
     // initialze output device
     if (avformat_write_header(fmt_ctx, NULL) < 0) {
@@ -85,33 +183,101 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
-    for (;;) {
-        memset(buffer, 0, max_buffer_size);
+    // device must accept frames for this stream as is
+    if (uncoded && av_write_uncoded_frame_query(fmt_ctx, stream->index) < 0) {
+        fprintf(stderr, "av_write_uncoded_frame_query()\n");
+        exit(1);
+    }
+
+    const size_t frame_sz = in_channels * av_get_bytes_per_sample(sample_fmt);
+
+    size_t pending_sz = head_sz;
+
+    play_stats_init(&stats);
+
+    for (int period = 0;; period++) {
+        AVFrame* frame = NULL;
+        uint8_t* dst = buffer;
+
+        if (uncoded) {
+            frame = frame_pool[period % frame_pool_size];
+            // pooled frame is still referenced if muxer keeps frames it was
+            // given; in this case, its samples are copied to a new buffer
+            if (av_frame_make_writable(frame) < 0) {
+                fprintf(stderr, "av_frame_make_writable()\n");
+                exit(1);
+            }
+            dst = frame->data[0];
+        }
+
+        // if there's no header, first samples were read with it
+        memcpy(dst, head, pending_sz);
 
-        // read input buffer from stdin
-        ssize_t ret = read(STDIN_FILENO, buffer, max_buffer_size);
+        // read input buffer from stdin; pipe may return less than requested
+        ssize_t ret = pcm_read_full(STDIN_FILENO, dst + pending_sz,
+                                    max_buffer_size - pending_sz);
         if (ret < 0) {
             fprintf(stderr, "read(stdin)\n");
             exit(1);
         }
 
-        if (ret == 0) {
+        // incomplete frame at the end of stream can't be played
+        const size_t size = (pending_sz + ret) / frame_sz * frame_sz;
+        pending_sz = 0;
+
+        if (size == 0) {
             break;
         }
 
-        // create output packet
-        AVPacket packet;
-        av_init_packet(&packet);
-        packet.data = buffer;
-        packet.size = max_buffer_size;
+        play_stats_period_read(&stats);
 
-        // write output packet to format context
-        if (av_write_frame(fmt_ctx, &packet) < 0) {
-            fprintf(stderr, "av_write_frame()\n");
-            exit(1);
+        // move 24 significant bits to the top of 32-bit samples
+        if (format.sample_format == PCM_FORMAT_S24) {
+            int32_t* samples = (int32_t*)dst;
+            for (size_t i = 0; i < size / 4; i++) {
+                samples[i] = (int32_t)((uint32_t)samples[i] << 8);
+            }
+        }
+
+        if (uncoded) {
+            frame->nb_samples = (int)(size / frame_sz);
+
+            // muxer frees the frame it's given, so give it a new reference
+            // to pooled samples
+            AVFrame* ref = av_frame_clone(frame);
+            if (!ref) {
+                fprintf(stderr, "av_frame_clone()\n");
+                exit(1);
+            }
+
+            // write uncoded frame directly to device
+            if (av_write_uncoded_frame(fmt_ctx, stream->index, ref) < 0) {
+                fprintf(stderr, "av_write_uncoded_frame()\n");
+                exit(1);
+            }
+        } else {
+            // create output packet; it doesn't own the buffer, so muxer
+            // doesn't need to allocate anything to reference it
+            AVPacket packet;
+            av_init_packet(&packet);
+            packet.data = buffer;
+            packet.size = (int)size;
+
+            // write output packet to format context
+            if (av_write_frame(fmt_ctx, &packet) < 0) {
+                fprintf(stderr, "av_write_frame()\n");
+                exit(1);
+            }
         }
+
+        play_stats_period_written(&stats, size / frame_sz);
     }
 
+    play_stats_report(&stats, uncoded ? "uncoded frame" : "packet", sample_rate);
+
+    for (int n = 0; n < frame_pool_size; n++) {
+        av_frame_free(&frame_pool[n]);
+    }
     av_free(buffer);
     avformat_free_context(fmt_ctx);
 
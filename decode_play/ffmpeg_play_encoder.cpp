@@ -4,9 +4,22 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
+ * s24 samples are shifted to 32-bit samples, since ffmpeg has no codec
+ * for 24-bit samples in 32-bit words.
  *
  * Usage:
- *   ./ffmpeg_play_encoder < cool_song_samples
+ *   ./ffmpeg_play_encoder [-d device] < cool_song_samples
+ *
+ * Steady state is allocation-free: one frame is allocated at startup and
+ * refilled every period with as many samples as were actually read, and
+ * encoder writes packets into one buffer that is allocated at startup too,
+ * instead of allocating a new payload for every packet. On exit, CPU time
+ * per minute of audio, write latency and heap allocations after warm-up
+ * are reported (see play_stats.h). With
+ * "-d null", ALSA discards samples as fast as they come, so that it can be
+ * used as a benchmark.
  */
 #include <unistd.h>
 #include <stdlib.h>
@@ -19,18 +32,69 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+#include "pcm_format.h"
+#include "play_stats.h"
+
+static play_stats stats;
+
+// sample format and codec for input format
+static void get_codec(int sample_format, AVSampleFormat* fmt, AVCodecID* codec_id) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        *fmt = AV_SAMPLE_FMT_S16;
+        *codec_id = AV_CODEC_ID_PCM_S16LE;
+        break;
+    case PCM_FORMAT_S24:
+        *fmt = AV_SAMPLE_FMT_S32;
+        *codec_id = AV_CODEC_ID_PCM_S32LE;
+        break;
+    default:
+        *fmt = AV_SAMPLE_FMT_FLT;
+        *codec_id = AV_CODEC_ID_PCM_F32LE;
+        break;
+    }
+}
+
 int main(int argc, char** argv) {
-    if (argc != 1) {
-        fprintf(stderr, "usage: %s < input_file\n", argv[0]);
+    const char* device = "default";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] < input_file\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "usage: %s [-d device] < input_file\n", argv[0]);
+        exit(1);
+    }
+
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        fprintf(stderr, "invalid stream header\n");
         exit(1);
     }
 
-    const int in_channels = 2, in_samples = 512, sample_rate = 44100;
+    AVSampleFormat sample_fmt;
+    AVCodecID codec_id;
+    get_codec(format.sample_format, &sample_fmt, &codec_id);
+
+    const int in_channels = format.channels, in_samples = 512;
+    const int sample_rate = format.sample_rate;
     const int bitrate = 64000;
 
     const int max_buffer_size =
         av_samples_get_buffer_size(
-            NULL, in_channels, in_samples, AV_SAMPLE_FMT_FLT, 1);
+            NULL, in_channels, in_samples, sample_fmt, 1);
 
     // register supported formats and codecs
     av_register_all();
@@ -54,6 +118,7 @@ int main(int argc, char** argv) {
     }
 
     fmt_ctx->oformat = fmt;
+    snprintf(fmt_ctx->filename, sizeof(fmt_ctx->filename), "%s", device);
 
     // add stream to format context
     AVStream* stream = avformat_new_stream(fmt_ctx, NULL);
@@ -65,13 +130,13 @@ int main(int argc, char** argv) {
     // initialize stream codec context
     AVCodecContext* codec_ctx = stream->codec;
     assert(codec_ctx);
-    codec_ctx->codec_id = AV_CODEC_ID_PCM_F32LE;
+    codec_ctx->codec_id = codec_id;
     codec_ctx->codec_type = AVMEDIA_TYPE_AUDIO;
-    codec_ctx->sample_fmt = AV_SAMPLE_FMT_FLT;
+    codec_ctx->sample_fmt = sample_fmt;
     codec_ctx->bit_rate = bitrate;
     codec_ctx->sample_rate = sample_rate;
     codec_ctx->channels = in_channels;
-    codec_ctx->channel_layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
+    codec_ctx->channel_layout = av_get_default_channel_layout(in_channels);
 
     // find encoder corresponding to codec id
     AVCodec* codec = avcodec_find_encoder(codec_ctx->codec_id);
@@ -92,9 +157,9 @@ int main(int argc, char** argv) {
 
     // set frame parameters
     frame->nb_samples = in_samples;
-    frame->format = AV_SAMPLE_FMT_FLT;
+    frame->format = sample_fmt;
     frame->sample_rate = sample_rate;
-    frame->channel_layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
+    frame->channel_layout = codec_ctx->channel_layout;
 
     // allocate frame buffers
     if (av_frame_get_buffer(frame, 0) < 0) {
@@ -105,32 +170,61 @@ int main(int argc, char** argv) {
     assert(frame->data[0]);
     assert(frame->linesize[0] == max_buffer_size);
 
+    // buffer for encoded samples; when packet comes with a buffer that is
+    // large enough, encoder writes into it instead of allocating a new one
+    const int packet_buffer_size = max_buffer_size + AV_INPUT_BUFFER_PADDING_SIZE;
+    uint8_t* packet_buffer = (uint8_t*)av_malloc(packet_buffer_size);
+    assert(packet_buffer);
+
     // initialze output device
     if (avformat_write_header(fmt_ctx, NULL) < 0) {
         fprintf(stderr, "avformat_write_header()\n");
         exit(1);
     }
 
+    const size_t frame_sz = in_channels * av_get_bytes_per_sample(sample_fmt);
+
+    memcpy(frame->data[0], head, head_sz);
+    size_t pending_sz = head_sz;
+
+    play_stats_init(&stats);
+
     for (;;) {
-        // create empty packet for encoded samples
+        // create packet for encoded samples, backed by our buffer
         AVPacket packet;
         av_init_packet(&packet);
-        packet.data = NULL;
-        packet.size = 0;
-
-        memset(frame->data[0], 0, max_buffer_size);
+        packet.data = packet_buffer;
+        packet.size = packet_buffer_size;
 
-        // read input frame from stdin
-        ssize_t ret = read(STDIN_FILENO, frame->data[0], max_buffer_size);
+        // read input frame from stdin; pipe may return less than requested
+        ssize_t ret = pcm_read_full(STDIN_FILENO, frame->data[0] + pending_sz,
+                                    max_buffer_size - pending_sz);
         if (ret < 0) {
             fprintf(stderr, "read(stdin)\n");
             exit(1);
         }
 
-        if (ret == 0) {
+        // PCM encoders accept frames of any length, so the last one is just
+        // shorter, and incomplete sample frame at the end is dropped
+        const size_t size = (pending_sz + ret) / frame_sz * frame_sz;
+        pending_sz = 0;
+
+        if (size == 0) {
             break;
         }
 
+        play_stats_period_read(&stats);
+
+        frame->nb_samples = (int)(size / frame_sz);
+
+        // move 24 significant bits to the top of 32-bit samples
+        if (format.sample_format == PCM_FORMAT_S24) {
+            int32_t* samples = (int32_t*)frame->data[0];
+            for (size_t i = 0; i < size / 4; i++) {
+                samples[i] = (int32_t)((uint32_t)samples[i] << 8);
+            }
+        }
+
         // encode input frame into packet
         int got_packet = 0;
         if (avcodec_encode_audio2(codec_ctx, &packet, frame, &got_packet) < 0) {
@@ -148,10 +242,16 @@ int main(int argc, char** argv) {
             exit(1);
         }
 
-        // free packet created by encoder
-        av_free_packet(&packet);
+        // packet doesn't own our buffer, so this only releases side data,
+        // if encoder added any
+        av_packet_unref(&packet);
+
+        play_stats_period_written(&stats, (uint64_t)frame->nb_samples);
     }
 
+    play_stats_report(&stats, "encoder", sample_rate);
+
+    av_free(packet_buffer);
     av_frame_free(&frame);
     avformat_free_context(fmt_ctx);
 
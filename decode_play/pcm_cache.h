@@ -0,0 +1,349 @@
+/* On-disk cache of decoded samples.
+ *
+ * Cache is a directory with one "<key>.pcm" file per decoded input, holding
+ * exactly what decoder would write to stdout. Key is a hash of:
+ *  - input file identity: device, inode, size and mtime
+ *  - optionally, input file contents, if file identity is not trusted
+ *  - decoder name and settings, e.g. output format or decoded range
+ *
+ * On hit, cached file is sent to output using sendfile() and decoding is
+ * skipped entirely. On miss, decoder output is also written to a temporary
+ * file in cache directory (see tee_fd in pcm_writer.h), which is renamed to
+ * "<key>.pcm" if decoding succeeds.
+ *
+ * When cache becomes larger than its size limit, least recently used files
+ * are removed. A file is used when it's created or hit, and we keep track
+ * of it by updating its mtime. Temporary files are locked while being
+ * written; unlocked ones were left by a decoder that crashed or exited on
+ * error, and are removed as well.
+ *
+ * Hit and miss counters are kept in "stats" file in cache directory.
+ */
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct pcm_cache {
+    std::string dir;
+    uint64_t max_size;      // size limit in bytes
+    bool hash_content;      // include file contents into key
+    std::string path;       // cache file for current input
+    std::string tmp_path;   // temporary file being written on miss
+    int tmp_fd;
+};
+
+// default size limit
+static const uint64_t pcm_cache_default_size = 1ull << 30;
+
+// 64-bit FNV-1a
+inline uint64_t pcm_cache_hash(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t n = 0; n < size; n++) {
+        h ^= p[n];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// 'max_size' 0 means default size limit
+inline void pcm_cache_init(pcm_cache* c, const char* dir, uint64_t max_size,
+                           bool hash_content) {
+    c->dir = dir;
+    c->max_size = max_size ? max_size : pcm_cache_default_size;
+    c->hash_content = hash_content;
+    c->tmp_fd = -1;
+
+    mkdir(dir, 0755);
+}
+
+// increment "hits" or "misses" counter in stats file
+inline void pcm_cache_count(pcm_cache* c, bool hit) {
+    const std::string stats_path = c->dir + "/stats";
+
+    int fd = open(stats_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    // several decoders may share the same cache
+    flock(fd, LOCK_EX);
+
+    char buf[128] = {};
+    unsigned long long hits = 0, misses = 0;
+
+    if (pread(fd, buf, sizeof(buf) - 1, 0) > 0) {
+        sscanf(buf, "hits %llu misses %llu", &hits, &misses);
+    }
+
+    if (hit) {
+        hits++;
+    } else {
+        misses++;
+    }
+
+    int len = snprintf(buf, sizeof(buf), "hits %llu\nmisses %llu\n", hits, misses);
+    if (pwrite(fd, buf, (size_t)len, 0) != len || ftruncate(fd, len) != 0) {
+        fprintf(stderr, "warning: %s: can't update\n", stats_path.c_str());
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// compute cache file path for input file and decoder settings
+// returns false if input can't be cached, e.g. it's not a regular file
+inline bool pcm_cache_key(pcm_cache* c, const char* input, const char* settings) {
+    c->path.clear();
+
+    int fd = open(input, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t h = 14695981039346656037ull;
+
+    const uint64_t ident[] = {
+        (uint64_t)st.st_dev,
+        (uint64_t)st.st_ino,
+        (uint64_t)st.st_size,
+        (uint64_t)st.st_mtim.tv_sec,
+        (uint64_t)st.st_mtim.tv_nsec,
+    };
+    h = pcm_cache_hash(h, ident, sizeof(ident));
+    h = pcm_cache_hash(h, settings, strlen(settings));
+
+    if (c->hash_content && st.st_size > 0) {
+        void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        h = pcm_cache_hash(h, data, (size_t)st.st_size);
+        munmap(data, (size_t)st.st_size);
+    }
+
+    close(fd);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)h);
+    c->path = c->dir + name;
+
+    return true;
+}
+
+// look up input in cache; on hit, send cached samples to out_fd and return
+// number of bytes sent; on miss, return -1; if out_fd can't be written, or
+// cache file turns out truncated after part of it was sent, return -2, and
+// output is incomplete
+inline int64_t pcm_cache_lookup(pcm_cache* c, const char* input,
+                                const char* settings, int out_fd) {
+    if (!pcm_cache_key(c, input, settings)) {
+        return -1;
+    }
+
+    int fd = open(c->path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        pcm_cache_count(c, false);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        pcm_cache_count(c, false);
+        return -1;
+    }
+
+    // mark file as recently used
+    futimens(fd, NULL);
+
+    off_t off = 0;
+    while (off < st.st_size) {
+        ssize_t ret = sendfile(out_fd, fd, &off, (size_t)(st.st_size - off));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "error: sendfile()\n");
+            close(fd);
+            return -2;
+        }
+        if (ret == 0) {
+            // file was truncated under us
+            break;
+        }
+    }
+
+    close(fd);
+
+    // truncated file is useless; if nothing was sent, just decode
+    if (off != st.st_size) {
+        fprintf(stderr, "warning: %s: truncated cache file, removing\n", c->path.c_str());
+        unlink(c->path.c_str());
+        pcm_cache_count(c, false);
+        return off == 0 ? -1 : -2;
+    }
+
+    pcm_cache_count(c, true);
+
+    return (int64_t)off;
+}
+
+// start writing cache file for input passed to last pcm_cache_lookup()
+// returns file descriptor to write decoded samples to, or -1
+inline int pcm_cache_begin(pcm_cache* c) {
+    if (c->path.empty()) {
+        return -1;
+    }
+
+    std::string tmpl = c->path + ".XXXXXX";
+    std::vector<char> buf(tmpl.begin(), tmpl.end());
+    buf.push_back('\0');
+
+    c->tmp_fd = mkstemp(&buf[0]);
+    if (c->tmp_fd < 0) {
+        fprintf(stderr, "warning: %s: can't create cache file\n", c->dir.c_str());
+        return -1;
+    }
+
+    // lock is released when we close the file or die, so that eviction
+    // can tell abandoned files from ones being written
+    flock(c->tmp_fd, LOCK_EX);
+
+    // mkstemp() creates file readable only by us
+    fchmod(c->tmp_fd, 0644);
+
+    c->tmp_path = &buf[0];
+
+    return c->tmp_fd;
+}
+
+struct pcm_cache_entry {
+    std::string path;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+inline bool pcm_cache_older(const pcm_cache_entry& a, const pcm_cache_entry& b) {
+    if (a.mtime.tv_sec != b.mtime.tv_sec) {
+        return a.mtime.tv_sec < b.mtime.tv_sec;
+    }
+    return a.mtime.tv_nsec < b.mtime.tv_nsec;
+}
+
+// true if 'name' is "<key>.pcm.XXXXXX" temporary file
+inline bool pcm_cache_is_tmp(const char* name) {
+    const char* ext = strstr(name, ".pcm.");
+    return ext && strlen(ext) == 11;
+}
+
+// remove temporary file if nobody is writing it; returns true if removed
+inline bool pcm_cache_remove_stale(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // if we win a race with pcm_cache_begin() that has just created the
+    // file, its rename() fails and the result is just not cached
+    bool removed = false;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        removed = unlink(path.c_str()) == 0;
+    }
+
+    close(fd);
+    return removed;
+}
+
+// remove abandoned temporary files, then least recently used files until
+// cache fits its size limit; temporary files being written count towards
+// the limit, but are never removed
+inline void pcm_cache_evict(pcm_cache* c) {
+    DIR* d = opendir(c->dir.c_str());
+    if (!d) {
+        return;
+    }
+
+    std::vector<pcm_cache_entry> entries;
+    uint64_t total = 0;
+
+    while (struct dirent* ent = readdir(d)) {
+        const size_t len = strlen(ent->d_name);
+        const bool tmp = pcm_cache_is_tmp(ent->d_name);
+        if (!tmp && (len < 4 || strcmp(ent->d_name + len - 4, ".pcm") != 0)) {
+            continue;
+        }
+
+        pcm_cache_entry e;
+        e.path = c->dir + "/" + ent->d_name;
+
+        if (tmp && pcm_cache_remove_stale(e.path)) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(e.path.c_str(), &st) != 0) {
+            continue;
+        }
+        e.size = (uint64_t)st.st_size;
+        e.mtime = st.st_mtim;
+
+        total += e.size;
+        if (!tmp) {
+            entries.push_back(e);
+        }
+    }
+
+    closedir(d);
+
+    std::sort(entries.begin(), entries.end(), pcm_cache_older);
+
+    for (size_t n = 0; n < entries.size() && total > c->max_size; n++) {
+        if (unlink(entries[n].path.c_str()) == 0) {
+            total -= entries[n].size;
+        }
+    }
+}
+
+// finish writing cache file; if 'ok' is false, decoding failed and the
+// file is discarded
+inline void pcm_cache_end(pcm_cache* c, bool ok) {
+    if (c->tmp_fd < 0) {
+        return;
+    }
+
+    close(c->tmp_fd);
+    c->tmp_fd = -1;
+
+    if (!ok || rename(c->tmp_path.c_str(), c->path.c_str()) != 0) {
+        unlink(c->tmp_path.c_str());
+        return;
+    }
+
+    pcm_cache_evict(c);
+}
+
+#endif // PCM_CACHE_H
@@ -0,0 +1,52 @@
+/* Decoder selection, see pcm_decoder.h.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "pcm_decoder.h"
+
+static pcm_decoder* create(const char* backend) {
+    if (strcmp(backend, "ffmpeg") == 0) {
+        return pcm_decoder_ffmpeg_create();
+    }
+    if (strcmp(backend, "sox") == 0) {
+        return pcm_decoder_sox_create();
+    }
+    if (strcmp(backend, "sndfile") == 0) {
+        return pcm_decoder_sndfile_create();
+    }
+    return NULL;
+}
+
+pcm_decoder* pcm_decoder_open(const char* path, const char* backend) {
+    static const char* const backends[] = { "sndfile", "ffmpeg", "sox" };
+
+    for (size_t n = 0; n < sizeof(backends) / sizeof(backends[0]); n++) {
+        if (backend && strcmp(backend, backends[n]) != 0) {
+            continue;
+        }
+
+        pcm_decoder* dec = create(backends[n]);
+
+        if (dec->open(path)) {
+            return dec;
+        }
+
+        // when trying all backends, only the last error is reported
+        if (backend || n + 1 == sizeof(backends) / sizeof(backends[0])) {
+            fprintf(stderr, "error: %s: %s: %s\n", path, dec->name(), dec->error());
+        }
+
+        delete dec;
+
+        if (backend) {
+            return NULL;
+        }
+    }
+
+    if (backend) {
+        fprintf(stderr, "error: unknown decoder backend: %s\n", backend);
+    }
+
+    return NULL;
+}
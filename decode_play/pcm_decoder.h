@@ -0,0 +1,64 @@
+/* In-process decoders with a pull API (libpcm_decoder.a).
+ *
+ * The same decode loops as in ffmpeg_decode, sox_decode_simple and
+ * sndfile_decode, but instead of writing samples to stdout, they return
+ * them to the caller, so that a player can link a decoder directly and
+ * decode only as fast as it plays.
+ *
+ * Samples are always interleaved 32-bit floats. Number of channels and
+ * sample rate are those of the input file; no resampling or channel
+ * mapping is done, since output devices usually handle any format.
+ *
+ * Usage:
+ *   pcm_decoder* dec = pcm_decoder_open("cool_song.mp3", NULL);
+ *   while (size_t n = dec->read(buf, n_frames)) {
+ *       // play n * dec->channels() samples from buf
+ *   }
+ *   delete dec;
+ */
+#ifndef PCM_DECODER_H
+#define PCM_DECODER_H
+
+#include <stddef.h>
+
+#include <string>
+
+class pcm_decoder {
+public:
+    virtual ~pcm_decoder() {
+    }
+
+    // backend name: "ffmpeg", "sox" or "sndfile"
+    virtual const char* name() const = 0;
+
+    // open input file; returns false and sets error() if it can't be decoded
+    virtual bool open(const char* path) = 0;
+
+    // format of decoded samples, available after open()
+    virtual int channels() const = 0;
+    virtual int sample_rate() const = 0;
+
+    // decode up to 'frames' frames into 'dst'; returns number of frames
+    // decoded, which is less than 'frames' only at the end of input
+    virtual size_t read(float* dst, size_t frames) = 0;
+
+    // description of the last error
+    const char* error() const {
+        return error_.c_str();
+    }
+
+protected:
+    std::string error_;
+};
+
+pcm_decoder* pcm_decoder_ffmpeg_create();
+pcm_decoder* pcm_decoder_sox_create();
+pcm_decoder* pcm_decoder_sndfile_create();
+
+// create decoder with given backend and open file; if backend is NULL,
+// try libsndfile first, since it's the fastest for formats it supports,
+// then FFmpeg and SoX
+// returns NULL and prints error if file can't be decoded
+pcm_decoder* pcm_decoder_open(const char* path, const char* backend);
+
+#endif // PCM_DECODER_H
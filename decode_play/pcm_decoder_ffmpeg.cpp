@@ -0,0 +1,240 @@
+/* FFmpeg decoder, see pcm_decoder.h.
+ */
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+#include "pcm_decoder.h"
+
+class ffmpeg_decoder : public pcm_decoder {
+public:
+    ffmpeg_decoder()
+        : fmt_ctx_(NULL)
+        , codec_ctx_(NULL)
+        , swr_ctx_(NULL)
+        , stream_(-1)
+        , packet_(NULL)
+        , frame_(NULL)
+        , draining_(false)
+        , finished_(false)
+        , out_frames_(0)
+        , out_pos_(0) {
+        memset(&pkt_, 0, sizeof(pkt_));
+    }
+
+    ~ffmpeg_decoder() {
+        av_frame_free(&frame_);
+        av_packet_free(&packet_);
+        swr_free(&swr_ctx_);
+        if (codec_ctx_) {
+            avcodec_close(codec_ctx_);
+        }
+        avformat_close_input(&fmt_ctx_);
+    }
+
+    const char* name() const {
+        return "ffmpeg";
+    }
+
+    bool open(const char* path) {
+        av_register_all();
+
+        if (avformat_open_input(&fmt_ctx_, path, NULL, NULL) != 0) {
+            error_ = "avformat_open_input()";
+            return false;
+        }
+
+        if (avformat_find_stream_info(fmt_ctx_, NULL) < 0) {
+            error_ = "avformat_find_stream_info()";
+            return false;
+        }
+
+        for (unsigned n = 0; n < fmt_ctx_->nb_streams; n++) {
+            if (fmt_ctx_->streams[n]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+                stream_ = (int)n;
+                break;
+            }
+        }
+        if (stream_ < 0) {
+            error_ = "no audio stream found";
+            return false;
+        }
+
+        codec_ctx_ = fmt_ctx_->streams[stream_]->codec;
+
+        if (codec_ctx_->channel_layout == 0) {
+            codec_ctx_->channel_layout = av_get_default_channel_layout(codec_ctx_->channels);
+        }
+
+        AVCodec* codec = avcodec_find_decoder(codec_ctx_->codec_id);
+        if (!codec) {
+            error_ = "avcodec_find_decoder()";
+            return false;
+        }
+
+        codec_ctx_->refcounted_frames = 1;
+
+        if (avcodec_open2(codec_ctx_, codec, NULL) < 0) {
+            error_ = "avcodec_open2()";
+            return false;
+        }
+
+        // only sample format is converted: planar or integer samples
+        // become interleaved floats
+        swr_ctx_ = swr_alloc_set_opts(NULL,
+                                      codec_ctx_->channel_layout, // output
+                                      AV_SAMPLE_FMT_FLT,          // output
+                                      codec_ctx_->sample_rate,    // output
+                                      codec_ctx_->channel_layout, // input
+                                      codec_ctx_->sample_fmt,     // input
+                                      codec_ctx_->sample_rate,    // input
+                                      0,
+                                      NULL);
+        if (!swr_ctx_ || swr_init(swr_ctx_) < 0) {
+            error_ = "swr_init()";
+            return false;
+        }
+
+        packet_ = av_packet_alloc();
+        frame_ = av_frame_alloc();
+        if (!packet_ || !frame_) {
+            error_ = "out of memory";
+            return false;
+        }
+
+        return true;
+    }
+
+    int channels() const {
+        return codec_ctx_->channels;
+    }
+
+    int sample_rate() const {
+        return codec_ctx_->sample_rate;
+    }
+
+    size_t read(float* dst, size_t frames) {
+        const int n_channels = codec_ctx_->channels;
+
+        size_t done = 0;
+
+        while (done < frames) {
+            if (out_pos_ == out_frames_ && !decode_frame()) {
+                break;
+            }
+
+            size_t n = out_frames_ - out_pos_;
+            if (n > frames - done) {
+                n = frames - done;
+            }
+
+            memcpy(dst + done * n_channels, &out_[out_pos_ * n_channels],
+                   n * n_channels * sizeof(float));
+
+            out_pos_ += n;
+            done += n;
+        }
+
+        return done;
+    }
+
+private:
+    // read next audio packet into pkt_, or switch to draining at the end
+    void next_packet() {
+        av_packet_unref(packet_);
+
+        while (av_read_frame(fmt_ctx_, packet_) >= 0) {
+            if (packet_->stream_index == stream_) {
+                pkt_ = *packet_;
+                return;
+            }
+            av_packet_unref(packet_);
+        }
+
+        // NULL packet drains frames buffered inside decoder
+        draining_ = true;
+        av_init_packet(&pkt_);
+        pkt_.data = NULL;
+        pkt_.size = 0;
+    }
+
+    // decode next frame and convert it into out_; returns false at the end
+    bool decode_frame() {
+        while (!finished_) {
+            if (pkt_.size <= 0 && !draining_) {
+                next_packet();
+            }
+
+            int got_frame = 0;
+            int ret = avcodec_decode_audio4(codec_ctx_, frame_, &got_frame, &pkt_);
+
+            if (ret < 0 && !draining_) {
+                // skip broken packet
+                pkt_.size = 0;
+                continue;
+            }
+
+            if (!draining_) {
+                // some codecs put several frames into one packet
+                pkt_.data += ret;
+                pkt_.size -= ret;
+                if (ret == 0 && !got_frame) {
+                    pkt_.size = 0;
+                }
+            }
+
+            if (got_frame) {
+                convert_frame(frame_);
+                av_frame_unref(frame_);
+                if (out_frames_ != 0) {
+                    return true;
+                }
+            } else if (draining_) {
+                finished_ = true;
+            }
+        }
+
+        return false;
+    }
+
+    void convert_frame(AVFrame* frame) {
+        const int max_out = swr_get_out_samples(swr_ctx_, frame->nb_samples);
+
+        if (out_.size() < (size_t)max_out * codec_ctx_->channels) {
+            out_.resize((size_t)max_out * codec_ctx_->channels);
+        }
+
+        uint8_t* out = (uint8_t*)&out_[0];
+
+        int ret = swr_convert(swr_ctx_, &out, max_out,
+                              (const uint8_t**)frame->extended_data, frame->nb_samples);
+
+        out_frames_ = ret > 0 ? (size_t)ret : 0;
+        out_pos_ = 0;
+    }
+
+    AVFormatContext* fmt_ctx_;
+    AVCodecContext* codec_ctx_;
+    SwrContext* swr_ctx_;
+    int stream_;
+
+    AVPacket* packet_;   // last packet read from demuxer
+    AVPacket pkt_;       // part of packet_ not yet decoded
+    AVFrame* frame_;
+    bool draining_;      // demuxer reached the end
+    bool finished_;      // decoder is drained
+
+    std::vector<float> out_; // converted samples of the last frame
+    size_t out_frames_;
+    size_t out_pos_;
+};
+
+pcm_decoder* pcm_decoder_ffmpeg_create() {
+    return new ffmpeg_decoder;
+}
@@ -0,0 +1,66 @@
+/* libsndfile decoder, see pcm_decoder.h.
+ */
+#include <string.h>
+
+#include <sndfile.h>
+
+#include "pcm_decoder.h"
+
+class sndfile_decoder : public pcm_decoder {
+public:
+    sndfile_decoder()
+        : sfile_(NULL) {
+        memset(&sinfo_, 0, sizeof(sinfo_));
+    }
+
+    ~sndfile_decoder() {
+        if (sfile_) {
+            sf_close(sfile_);
+        }
+    }
+
+    const char* name() const {
+        return "sndfile";
+    }
+
+    bool open(const char* path) {
+        sfile_ = sf_open(path, SFM_READ, &sinfo_);
+        if (!sfile_) {
+            error_ = sf_strerror(NULL);
+            return false;
+        }
+        return true;
+    }
+
+    int channels() const {
+        return sinfo_.channels;
+    }
+
+    int sample_rate() const {
+        return sinfo_.samplerate;
+    }
+
+    size_t read(float* dst, size_t frames) {
+        size_t done = 0;
+
+        // sf_readf_float() may return less than requested before the end
+        while (done < frames) {
+            sf_count_t ret = sf_readf_float(
+                sfile_, dst + done * sinfo_.channels, (sf_count_t)(frames - done));
+            if (ret <= 0) {
+                break;
+            }
+            done += (size_t)ret;
+        }
+
+        return done;
+    }
+
+private:
+    SNDFILE* sfile_;
+    SF_INFO sinfo_;
+};
+
+pcm_decoder* pcm_decoder_sndfile_create() {
+    return new sndfile_decoder;
+}
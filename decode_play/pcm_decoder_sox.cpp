@@ -0,0 +1,88 @@
+/* SoX decoder, see pcm_decoder.h.
+ */
+#include <math.h>
+
+#include <vector>
+
+#include <sox.h>
+
+#include "pcm_decoder.h"
+#include "sox_convert.h"
+
+class sox_decoder : public pcm_decoder {
+public:
+    sox_decoder()
+        : input_(NULL) {
+    }
+
+    ~sox_decoder() {
+        if (input_) {
+            sox_close(input_);
+        }
+    }
+
+    const char* name() const {
+        return "sox";
+    }
+
+    bool open(const char* path) {
+        // SoX is initialized once per process and never deinitialized,
+        // since several decoders may exist at the same time
+        static const bool initialized = sox_init() == SOX_SUCCESS;
+        if (!initialized) {
+            error_ = "sox_init()";
+            return false;
+        }
+
+        input_ = sox_open_read(path, NULL, NULL, NULL);
+        if (!input_) {
+            error_ = "sox_open_read()";
+            return false;
+        }
+
+        if (input_->signal.channels == 0 || input_->signal.rate <= 0) {
+            error_ = "unknown format";
+            return false;
+        }
+
+        return true;
+    }
+
+    int channels() const {
+        return (int)input_->signal.channels;
+    }
+
+    int sample_rate() const {
+        return (int)lround(input_->signal.rate);
+    }
+
+    size_t read(float* dst, size_t frames) {
+        const size_t n_samples = frames * input_->signal.channels;
+
+        if (buf_.size() < n_samples) {
+            buf_.resize(n_samples);
+        }
+
+        size_t done = 0;
+
+        while (done < n_samples) {
+            size_t ret = sox_read(input_, &buf_[done], n_samples - done);
+            if (ret == 0) {
+                break;
+            }
+            done += ret;
+        }
+
+        sox_to_float(&buf_[0], dst, done);
+
+        return done / input_->signal.channels;
+    }
+
+private:
+    sox_format_t* input_;
+    std::vector<sox_sample_t> buf_;
+};
+
+pcm_decoder* pcm_decoder_sox_create() {
+    return new sox_decoder;
+}
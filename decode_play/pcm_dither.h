@@ -0,0 +1,247 @@
+/* Conversion of 32-bit floats to s16 or s24 samples with TPDF dither.
+ *
+ * Every sample is scaled to integer range, triangular dither of +/-1 LSB
+ * is added, and result is rounded to nearest and saturated. Dither is the
+ * difference of two uniform random values, both taken from one 32-bit
+ * xorshift output (low and high halves), so every sample costs one
+ * generator step.
+ *
+ * Every vector lane has its own generator. On x86, SSE2 or AVX2 kernel is
+ * selected at runtime depending on CPU features. Other CPUs use the scalar
+ * kernel.
+ *
+ * s24 samples are stored in the low 24 bits of 32-bit words, see
+ * pcm_format.h.
+ */
+#ifndef PCM_DITHER_H
+#define PCM_DITHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_DITHER_X86
+#include <immintrin.h>
+#endif
+
+struct pcm_dither {
+    uint32_t state[8]; // generator per vector lane, never zero
+};
+
+typedef void (*pcm_dither_s16_fn)(pcm_dither* d, const float* in, int16_t* out, size_t n);
+typedef void (*pcm_dither_s24_fn)(pcm_dither* d, const float* in, int32_t* out, size_t n);
+
+inline void pcm_dither_init(pcm_dither* d, uint32_t seed) {
+    for (int n = 0; n < 8; n++) {
+        // splitmix-style scrambling, so that lanes are not correlated
+        uint32_t x = seed + 0x9e3779b9u * (uint32_t)(n + 1);
+        x = (x ^ (x >> 16)) * 0x85ebca6bu;
+        x = (x ^ (x >> 13)) * 0xc2b2ae35u;
+        x ^= x >> 16;
+        d->state[n] = x ? x : 1;
+    }
+}
+
+inline uint32_t pcm_dither_next(uint32_t* x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// dither, round and saturate one sample
+inline int32_t pcm_dither_sample(uint32_t* x, float v, float scale, float lo, float hi) {
+    const uint32_t r = pcm_dither_next(x);
+    const float d = (float)((int32_t)(r & 0xffff) - (int32_t)(r >> 16)) * (1.0f / 65536.0f);
+
+    float y = v * scale + d;
+    if (y < lo) {
+        y = lo;
+    }
+    if (y > hi) {
+        y = hi;
+    }
+
+    return (int32_t)__builtin_lrintf(y);
+}
+
+// reference implementation, also used for tails shorter than vector size
+inline void pcm_dither_s16_scalar(pcm_dither* d, const float* in, int16_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (int16_t)pcm_dither_sample(&d->state[0], in[i], 32768.0f, -32768.0f, 32767.0f);
+    }
+}
+
+inline void pcm_dither_s24_scalar(pcm_dither* d, const float* in, int32_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = pcm_dither_sample(&d->state[0], in[i], 8388608.0f, -8388608.0f, 8388607.0f);
+    }
+}
+
+#ifdef PCM_DITHER_X86
+
+// dither, scale and saturate 4 samples; result is rounded by conversion
+__attribute__((target("sse2")))
+inline __m128i pcm_dither_sse2(__m128i* x, __m128 v, __m128 scale, __m128 lo, __m128 hi) {
+    __m128i r = *x;
+    r = _mm_xor_si128(r, _mm_slli_epi32(r, 13));
+    r = _mm_xor_si128(r, _mm_srli_epi32(r, 17));
+    r = _mm_xor_si128(r, _mm_slli_epi32(r, 5));
+    *x = r;
+
+    const __m128i d_int = _mm_sub_epi32(
+        _mm_and_si128(r, _mm_set1_epi32(0xffff)), _mm_srli_epi32(r, 16));
+    const __m128 d = _mm_mul_ps(_mm_cvtepi32_ps(d_int), _mm_set1_ps(1.0f / 65536.0f));
+
+    __m128 y = _mm_add_ps(_mm_mul_ps(v, scale), d);
+    y = _mm_min_ps(_mm_max_ps(y, lo), hi);
+
+    // default MXCSR rounding mode is round to nearest
+    return _mm_cvtps_epi32(y);
+}
+
+__attribute__((target("sse2")))
+inline void pcm_dither_s16_sse2(pcm_dither* d, const float* in, int16_t* out, size_t n) {
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+
+    __m128i x = _mm_loadu_si128((const __m128i*)d->state);
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = pcm_dither_sse2(&x, _mm_loadu_ps(in + i), scale, lo, hi);
+        __m128i b = pcm_dither_sse2(&x, _mm_loadu_ps(in + i + 4), scale, lo, hi);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(a, b));
+    }
+
+    _mm_storeu_si128((__m128i*)d->state, x);
+
+    pcm_dither_s16_scalar(d, in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void pcm_dither_s24_sse2(pcm_dither* d, const float* in, int32_t* out, size_t n) {
+    const __m128 scale = _mm_set1_ps(8388608.0f);
+    const __m128 lo = _mm_set1_ps(-8388608.0f);
+    const __m128 hi = _mm_set1_ps(8388607.0f);
+
+    __m128i x = _mm_loadu_si128((const __m128i*)d->state);
+
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)(out + i),
+                         pcm_dither_sse2(&x, _mm_loadu_ps(in + i), scale, lo, hi));
+    }
+
+    _mm_storeu_si128((__m128i*)d->state, x);
+
+    pcm_dither_s24_scalar(d, in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i pcm_dither_avx2(__m256i* x, __m256 v, __m256 scale, __m256 lo, __m256 hi) {
+    __m256i r = *x;
+    r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 13));
+    r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+    r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 5));
+    *x = r;
+
+    const __m256i d_int = _mm256_sub_epi32(
+        _mm256_and_si256(r, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(r, 16));
+    const __m256 d = _mm256_mul_ps(_mm256_cvtepi32_ps(d_int),
+                                   _mm256_set1_ps(1.0f / 65536.0f));
+
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(v, scale), d);
+    y = _mm256_min_ps(_mm256_max_ps(y, lo), hi);
+
+    return _mm256_cvtps_epi32(y);
+}
+
+__attribute__((target("avx2")))
+inline void pcm_dither_s16_avx2(pcm_dither* d, const float* in, int16_t* out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+
+    __m256i x = _mm256_loadu_si256((const __m256i*)d->state);
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = pcm_dither_avx2(&x, _mm256_loadu_ps(in + i), scale, lo, hi);
+        __m256i b = pcm_dither_avx2(&x, _mm256_loadu_ps(in + i + 8), scale, lo, hi);
+        // packs works within 128-bit lanes, so restore sample order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i*)(out + i), packed);
+    }
+
+    _mm256_storeu_si256((__m256i*)d->state, x);
+
+    pcm_dither_s16_scalar(d, in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void pcm_dither_s24_avx2(pcm_dither* d, const float* in, int32_t* out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(8388608.0f);
+    const __m256 lo = _mm256_set1_ps(-8388608.0f);
+    const __m256 hi = _mm256_set1_ps(8388607.0f);
+
+    __m256i x = _mm256_loadu_si256((const __m256i*)d->state);
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(out + i),
+                            pcm_dither_avx2(&x, _mm256_loadu_ps(in + i), scale, lo, hi));
+    }
+
+    _mm256_storeu_si256((__m256i*)d->state, x);
+
+    pcm_dither_s24_scalar(d, in + i, out + i, n - i);
+}
+
+#endif // PCM_DITHER_X86
+
+// select best kernel for current CPU
+inline pcm_dither_s16_fn pcm_dither_s16_select() {
+#ifdef PCM_DITHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_dither_s16_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_dither_s16_sse2;
+    }
+#endif
+    return pcm_dither_s16_scalar;
+}
+
+inline pcm_dither_s24_fn pcm_dither_s24_select() {
+#ifdef PCM_DITHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_dither_s24_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_dither_s24_sse2;
+    }
+#endif
+    return pcm_dither_s24_scalar;
+}
+
+// convert 'n' floats to dithered s16 samples
+inline void pcm_dither_s16(pcm_dither* d, const float* in, int16_t* out, size_t n) {
+    static const pcm_dither_s16_fn fn = pcm_dither_s16_select();
+    fn(d, in, out, n);
+}
+
+// convert 'n' floats to dithered s24 samples in 32-bit words
+inline void pcm_dither_s24(pcm_dither* d, const float* in, int32_t* out, size_t n) {
+    static const pcm_dither_s24_fn fn = pcm_dither_s24_select();
+    fn(d, in, out, n);
+}
+
+#endif // PCM_DITHER_H
@@ -0,0 +1,163 @@
+/* Sample format of decoded PCM streams and its stream header.
+ *
+ * By default, decoders write headerless 32-bit float stereo samples at
+ * 44100 Hz. When output format is requested explicitly (-f option), stream
+ * starts with a 16-byte header:
+ *
+ *   bytes 0-3    magic "PCMH"
+ *   byte  4      sample format, see pcm_sample_format
+ *   byte  5      number of channels
+ *   bytes 6-7    zero
+ *   bytes 8-11   sample rate, little-endian
+ *   bytes 12-15  zero
+ *
+ * Players read the first 16 bytes and check the magic. If it's not there,
+ * the stream is headerless and these bytes are the first two frames of the
+ * default format; as floats, "PCMH" would be a sample of about 2e5, which
+ * never appears in normalized audio.
+ *
+ * s24 samples are 24-bit signed integers in the low bits of 32-bit
+ * little-endian words (SND_PCM_FORMAT_S24_LE in ALSA, PA_SAMPLE_S24_32LE
+ * in PulseAudio).
+ *
+ * This header is also included by C programs.
+ */
+#ifndef PCM_FORMAT_H
+#define PCM_FORMAT_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum pcm_sample_format {
+    PCM_FORMAT_F32 = 1,
+    PCM_FORMAT_S16 = 2,
+    PCM_FORMAT_S24 = 3,
+};
+
+struct pcm_format {
+    int sample_format; // pcm_sample_format
+    int channels;
+    int sample_rate;
+};
+
+#define PCM_HEADER_SIZE 16
+
+static inline void pcm_format_default(struct pcm_format* f) {
+    f->sample_format = PCM_FORMAT_F32;
+    f->channels = 2;
+    f->sample_rate = 44100;
+}
+
+// bytes per sample of one channel, or 0 if format is unknown
+static inline size_t pcm_format_sample_size(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_F32:
+    case PCM_FORMAT_S24:
+        return 4;
+    case PCM_FORMAT_S16:
+        return 2;
+    }
+    return 0;
+}
+
+static inline const char* pcm_format_name(int sample_format) {
+    switch (sample_format) {
+    case PCM_FORMAT_F32:
+        return "f32";
+    case PCM_FORMAT_S16:
+        return "s16";
+    case PCM_FORMAT_S24:
+        return "s24";
+    }
+    return "unknown";
+}
+
+// parse "f32", "s16" or "s24", returns 0 if name is unknown
+static inline int pcm_format_parse(const char* name) {
+    if (strcmp(name, "f32") == 0) {
+        return PCM_FORMAT_F32;
+    }
+    if (strcmp(name, "s16") == 0) {
+        return PCM_FORMAT_S16;
+    }
+    if (strcmp(name, "s24") == 0) {
+        return PCM_FORMAT_S24;
+    }
+    return 0;
+}
+
+static inline void pcm_header_encode(const struct pcm_format* f,
+                                     unsigned char buf[PCM_HEADER_SIZE]) {
+    memset(buf, 0, PCM_HEADER_SIZE);
+    memcpy(buf, "PCMH", 4);
+    buf[4] = (unsigned char)f->sample_format;
+    buf[5] = (unsigned char)f->channels;
+    buf[8] = (unsigned char)(f->sample_rate & 0xff);
+    buf[9] = (unsigned char)((f->sample_rate >> 8) & 0xff);
+    buf[10] = (unsigned char)((f->sample_rate >> 16) & 0xff);
+    buf[11] = (unsigned char)((f->sample_rate >> 24) & 0xff);
+}
+
+// returns 1 and fills 'f' if buffer holds a valid header
+static inline int pcm_header_decode(const unsigned char buf[PCM_HEADER_SIZE],
+                                    struct pcm_format* f) {
+    if (memcmp(buf, "PCMH", 4) != 0) {
+        return 0;
+    }
+
+    f->sample_format = buf[4];
+    f->channels = buf[5];
+    f->sample_rate = (int)((uint32_t)buf[8] | (uint32_t)buf[9] << 8
+                           | (uint32_t)buf[10] << 16 | (uint32_t)buf[11] << 24);
+
+    return pcm_format_sample_size(f->sample_format) != 0
+        && f->channels > 0 && f->sample_rate > 0;
+}
+
+// read until buffer is full or end of stream, since pipe may return less
+// than requested and players need whole frames
+// returns number of bytes read, or -1 on error
+static inline ssize_t pcm_read_full(int fd, void* buf, size_t size) {
+    size_t len = 0;
+
+    while (len < size) {
+        ssize_t ret = read(fd, (unsigned char*)buf + len, size - len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        len += (size_t)ret;
+    }
+
+    return (ssize_t)len;
+}
+
+// read stream header from 'fd' and fill 'f'
+// if stream has no header, 'f' is set to default format, and the bytes read
+// are stored in 'buf' and must be played before the rest of the stream
+// returns number of such bytes, or -1 if header is invalid or read failed
+static inline ssize_t pcm_header_read(int fd, struct pcm_format* f,
+                                      unsigned char buf[PCM_HEADER_SIZE]) {
+    const ssize_t len = pcm_read_full(fd, buf, PCM_HEADER_SIZE);
+    if (len < 0) {
+        return -1;
+    }
+
+    if (len == PCM_HEADER_SIZE && memcmp(buf, "PCMH", 4) == 0) {
+        return pcm_header_decode(buf, f) ? 0 : -1;
+    }
+
+    pcm_format_default(f);
+
+    return len;
+}
+
+#endif // PCM_FORMAT_H
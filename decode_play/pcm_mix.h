@@ -0,0 +1,295 @@
+/* Mixing kernels: accumulate scaled samples into a float buffer, and clip it.
+ *
+ * pcm_mix_add_f32(), pcm_mix_add_s16() and pcm_mix_add_s24() add 'gain'
+ * times every input sample to the accumulator; integer samples are first
+ * converted to floats in [-1, 1). pcm_mix_clip() saturates the accumulator
+ * to [-1, 1] and counts clipped samples.
+ *
+ * Every kernel does one multiply and one add per sample (no FMA), so vector
+ * kernels give exactly the same results as scalar ones.
+ *
+ * On x86, SSE2 or AVX2 kernel is selected at runtime depending on CPU
+ * features. Other CPUs use the scalar kernel.
+ *
+ * s24 samples are stored in the low 24 bits of 32-bit words, see
+ * pcm_format.h.
+ */
+#ifndef PCM_MIX_H
+#define PCM_MIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_MIX_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*pcm_mix_add_f32_fn)(float* acc, const float* in, float gain, size_t n);
+typedef void (*pcm_mix_add_s16_fn)(float* acc, const int16_t* in, float gain, size_t n);
+typedef void (*pcm_mix_add_s24_fn)(float* acc, const int32_t* in, float gain, size_t n);
+typedef size_t (*pcm_mix_clip_fn)(float* acc, size_t n);
+
+// reference implementation, also used for tails shorter than vector size
+inline void pcm_mix_add_f32_scalar(float* acc, const float* in, float gain, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += in[i] * gain;
+    }
+}
+
+inline void pcm_mix_add_s16_scalar(float* acc, const int16_t* in, float gain, size_t n) {
+    const float scale = gain * (1.0f / 32768.0f);
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += (float)in[i] * scale;
+    }
+}
+
+inline void pcm_mix_add_s24_scalar(float* acc, const int32_t* in, float gain, size_t n) {
+    const float scale = gain * (1.0f / 8388608.0f);
+    for (size_t i = 0; i < n; i++) {
+        // sign-extend low 24 bits
+        acc[i] += (float)((int32_t)((uint32_t)in[i] << 8) >> 8) * scale;
+    }
+}
+
+// returns number of clipped samples
+inline size_t pcm_mix_clip_scalar(float* acc, size_t n) {
+    size_t clips = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (acc[i] > 1.0f) {
+            acc[i] = 1.0f;
+            clips++;
+        } else if (acc[i] < -1.0f) {
+            acc[i] = -1.0f;
+            clips++;
+        }
+    }
+    return clips;
+}
+
+#ifdef PCM_MIX_X86
+
+__attribute__((target("sse2")))
+inline void pcm_mix_add_f32_sse2(float* acc, const float* in, float gain, size_t n) {
+    const __m128 g = _mm_set1_ps(gain);
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(in + i), g));
+        __m128 b = _mm_add_ps(_mm_loadu_ps(acc + i + 4),
+                              _mm_mul_ps(_mm_loadu_ps(in + i + 4), g));
+        _mm_storeu_ps(acc + i, a);
+        _mm_storeu_ps(acc + i + 4, b);
+    }
+
+    pcm_mix_add_f32_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void pcm_mix_add_s16_sse2(float* acc, const int16_t* in, float gain, size_t n) {
+    const __m128 scale = _mm_set1_ps(gain * (1.0f / 32768.0f));
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+        // put every sample into high half of 32-bit lane and shift it back
+        // with sign extension
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        __m128 a = _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        __m128 b = _mm_add_ps(_mm_loadu_ps(acc + i + 4),
+                              _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        _mm_storeu_ps(acc + i, a);
+        _mm_storeu_ps(acc + i + 4, b);
+    }
+
+    pcm_mix_add_s16_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void pcm_mix_add_s24_sse2(float* acc, const int32_t* in, float gain, size_t n) {
+    const __m128 scale = _mm_set1_ps(gain * (1.0f / 8388608.0f));
+
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+        x = _mm_srai_epi32(_mm_slli_epi32(x, 8), 8);
+        _mm_storeu_ps(acc + i,
+                      _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_cvtepi32_ps(x), scale)));
+    }
+
+    pcm_mix_add_s24_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+inline size_t pcm_mix_clip_sse2(float* acc, size_t n) {
+    const __m128 lo = _mm_set1_ps(-1.0f);
+    const __m128 hi = _mm_set1_ps(1.0f);
+
+    size_t clips = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_loadu_ps(acc + i);
+        const __m128 out = _mm_or_ps(_mm_cmplt_ps(v, lo), _mm_cmpgt_ps(v, hi));
+        clips += __builtin_popcount(_mm_movemask_ps(out));
+        _mm_storeu_ps(acc + i, _mm_min_ps(_mm_max_ps(v, lo), hi));
+    }
+
+    return clips + pcm_mix_clip_scalar(acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void pcm_mix_add_f32_avx2(float* acc, const float* in, float gain, size_t n) {
+    const __m256 g = _mm256_set1_ps(gain);
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                 _mm256_mul_ps(_mm256_loadu_ps(in + i), g));
+        __m256 b = _mm256_add_ps(_mm256_loadu_ps(acc + i + 8),
+                                 _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), g));
+        _mm256_storeu_ps(acc + i, a);
+        _mm256_storeu_ps(acc + i + 8, b);
+    }
+
+    pcm_mix_add_f32_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void pcm_mix_add_s16_avx2(float* acc, const int16_t* in, float gain, size_t n) {
+    const __m256 scale = _mm256_set1_ps(gain * (1.0f / 32768.0f));
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        const __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+        const __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+        __m256 a = _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                 _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        __m256 b = _mm256_add_ps(_mm256_loadu_ps(acc + i + 8),
+                                 _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+        _mm256_storeu_ps(acc + i, a);
+        _mm256_storeu_ps(acc + i + 8, b);
+    }
+
+    pcm_mix_add_s16_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void pcm_mix_add_s24_avx2(float* acc, const int32_t* in, float gain, size_t n) {
+    const __m256 scale = _mm256_set1_ps(gain * (1.0f / 8388608.0f));
+
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+        x = _mm256_srai_epi32(_mm256_slli_epi32(x, 8), 8);
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                                _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale)));
+    }
+
+    pcm_mix_add_s24_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t pcm_mix_clip_avx2(float* acc, size_t n) {
+    const __m256 lo = _mm256_set1_ps(-1.0f);
+    const __m256 hi = _mm256_set1_ps(1.0f);
+
+    size_t clips = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(acc + i);
+        const __m256 out = _mm256_or_ps(_mm256_cmp_ps(v, lo, _CMP_LT_OQ),
+                                        _mm256_cmp_ps(v, hi, _CMP_GT_OQ));
+        clips += __builtin_popcount(_mm256_movemask_ps(out));
+        _mm256_storeu_ps(acc + i, _mm256_min_ps(_mm256_max_ps(v, lo), hi));
+    }
+
+    return clips + pcm_mix_clip_scalar(acc + i, n - i);
+}
+
+#endif // PCM_MIX_X86
+
+// select best kernel for current CPU
+inline pcm_mix_add_f32_fn pcm_mix_add_f32_select() {
+#ifdef PCM_MIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_mix_add_f32_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_mix_add_f32_sse2;
+    }
+#endif
+    return pcm_mix_add_f32_scalar;
+}
+
+inline pcm_mix_add_s16_fn pcm_mix_add_s16_select() {
+#ifdef PCM_MIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_mix_add_s16_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_mix_add_s16_sse2;
+    }
+#endif
+    return pcm_mix_add_s16_scalar;
+}
+
+inline pcm_mix_add_s24_fn pcm_mix_add_s24_select() {
+#ifdef PCM_MIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_mix_add_s24_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_mix_add_s24_sse2;
+    }
+#endif
+    return pcm_mix_add_s24_scalar;
+}
+
+inline pcm_mix_clip_fn pcm_mix_clip_select() {
+#ifdef PCM_MIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return pcm_mix_clip_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return pcm_mix_clip_sse2;
+    }
+#endif
+    return pcm_mix_clip_scalar;
+}
+
+// add 'gain' times 'n' samples to accumulator
+inline void pcm_mix_add_f32(float* acc, const float* in, float gain, size_t n) {
+    static const pcm_mix_add_f32_fn fn = pcm_mix_add_f32_select();
+    fn(acc, in, gain, n);
+}
+
+inline void pcm_mix_add_s16(float* acc, const int16_t* in, float gain, size_t n) {
+    static const pcm_mix_add_s16_fn fn = pcm_mix_add_s16_select();
+    fn(acc, in, gain, n);
+}
+
+inline void pcm_mix_add_s24(float* acc, const int32_t* in, float gain, size_t n) {
+    static const pcm_mix_add_s24_fn fn = pcm_mix_add_s24_select();
+    fn(acc, in, gain, n);
+}
+
+// saturate 'n' samples to [-1, 1], returns number of clipped samples
+inline size_t pcm_mix_clip(float* acc, size_t n) {
+    static const pcm_mix_clip_fn fn = pcm_mix_clip_select();
+    return fn(acc, n);
+}
+
+#endif // PCM_MIX_H
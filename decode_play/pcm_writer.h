@@ -0,0 +1,322 @@
+/* Output layer for decoded samples.
+ *
+ * Decoders used to write() every 512 samples, i.e. one syscall and one kernel
+ * copy per 4 KiB. Instead, samples are accumulated in two large page-aligned
+ * buffers and handed to the kernel when a buffer becomes full:
+ *
+ *  - if output is a pipe, every buffer is as large as pipe itself, and it is
+ *    given to the kernel with vmsplice(SPLICE_F_GIFT), so that the pipe just
+ *    references our pages instead of copying them; when one buffer is fully
+ *    spliced, the pipe can't hold anything else, so the pages of the other
+ *    buffer were already consumed by reader and we can fill it again
+ *
+ *  - otherwise, buffers are written with one writev() call when both of
+ *    them become full
+ *
+ * The reader is expected to consume the pipe with read(). If it moves
+ * pages further with splice() or tee(), gifted pages may outlive the pipe.
+ *
+ * Optionally, every buffer is also written to a second file descriptor
+ * before it's handed to the main one (see pcm_cache.h).
+ *
+ * Samples are passed as floats. If another output format is set, stream
+ * header is written first, and samples are converted with dither directly
+ * into the buffers (see pcm_format.h and pcm_dither.h).
+ *
+ * Write errors exit the process, unless 'soft_errors' is set: then the
+ * error is recorded in 'failed' and everything else is discarded, so that
+ * a decoder writing many files can fail only the current one.
+ */
+#ifndef PCM_WRITER_H
+#define PCM_WRITER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "pcm_dither.h"
+#include "pcm_format.h"
+
+struct pcm_writer {
+    int fd;
+    bool is_pipe;
+    size_t buf_size;     // size of every buffer
+    unsigned char* buf[2];
+    size_t buf_len[2];   // number of bytes in every buffer
+    int cur;             // buffer being filled
+    size_t n_syscalls;   // number of vmsplice() and writev() calls
+    int tee_fd;          // if non-negative, gets a copy of everything
+    int sample_format;   // pcm_sample_format of output
+    pcm_dither dither;
+    bool soft_errors;    // set 'failed' on write error instead of exiting
+    bool failed;         // write error happened, output is incomplete
+};
+
+// preferred pipe size; may be limited by /proc/sys/fs/pipe-max-size
+static const int pcm_writer_pipe_size = 1 << 20;
+
+// buffer size for regular files
+static const size_t pcm_writer_file_buf_size = 1 << 20;
+
+inline void pcm_writer_open(pcm_writer* w, int fd) {
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->tee_fd = -1;
+    w->sample_format = PCM_FORMAT_F32;
+
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        // try to enlarge pipe, but it's fine if we're not allowed to
+        fcntl(fd, F_SETPIPE_SZ, pcm_writer_pipe_size);
+
+        int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+        if (pipe_size > 0) {
+            w->is_pipe = true;
+            w->buf_size = (size_t)pipe_size;
+        }
+    }
+
+    if (!w->is_pipe) {
+        w->buf_size = pcm_writer_file_buf_size;
+    }
+
+    w->buf_size = (w->buf_size + page_size - 1) / page_size * page_size;
+
+    // buffers are mmapped instead of malloced, so that gifted pages are
+    // never reused by allocator after pcm_writer_close()
+    for (int n = 0; n < 2; n++) {
+        void* p = mmap(NULL, w->buf_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "error: mmap()\n");
+            exit(1);
+        }
+        w->buf[n] = (unsigned char*)p;
+    }
+}
+
+// report write error and exit, or just remember it if errors are soft
+inline void pcm_writer_fail(pcm_writer* w, const char* func) {
+    fprintf(stderr, "error: %s\n", func);
+    if (!w->soft_errors) {
+        exit(1);
+    }
+    w->failed = true;
+}
+
+// write copy of buffer to tee_fd, if any
+// it must happen before buffer is given to the pipe
+inline void pcm_writer_tee(pcm_writer* w, int n) {
+    if (w->tee_fd < 0 || w->failed) {
+        return;
+    }
+
+    const unsigned char* p = w->buf[n];
+    size_t size = w->buf_len[n];
+
+    while (size > 0) {
+        ssize_t ret = write(w->tee_fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pcm_writer_fail(w, "write(tee)");
+            return;
+        }
+        p += ret;
+        size -= (size_t)ret;
+    }
+}
+
+// give whole buffer to the pipe
+inline void pcm_writer_splice(pcm_writer* w, int n) {
+    pcm_writer_tee(w, n);
+
+    if (w->failed) {
+        w->buf_len[n] = 0;
+        return;
+    }
+
+    struct iovec iov;
+    iov.iov_base = w->buf[n];
+    iov.iov_len = w->buf_len[n];
+
+    while (iov.iov_len > 0) {
+        ssize_t ret = vmsplice(w->fd, &iov, 1, SPLICE_F_GIFT);
+        w->n_syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pcm_writer_fail(w, "vmsplice()");
+            break;
+        }
+        iov.iov_base = (unsigned char*)iov.iov_base + ret;
+        iov.iov_len -= (size_t)ret;
+    }
+
+    w->buf_len[n] = 0;
+}
+
+// write both buffers, oldest first
+inline void pcm_writer_writev(pcm_writer* w) {
+    const int first = w->cur ^ 1, second = w->cur;
+
+    pcm_writer_tee(w, first);
+    pcm_writer_tee(w, second);
+
+    if (w->failed) {
+        w->buf_len[0] = w->buf_len[1] = 0;
+        return;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = w->buf[first];
+    iov[0].iov_len = w->buf_len[first];
+    iov[1].iov_base = w->buf[second];
+    iov[1].iov_len = w->buf_len[second];
+
+    struct iovec* p = iov;
+    int cnt = 2;
+
+    while (cnt > 0) {
+        ssize_t ret = writev(w->fd, p, cnt);
+        w->n_syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pcm_writer_fail(w, "writev()");
+            break;
+        }
+        // skip written buffers and adjust partially written one
+        size_t left = (size_t)ret;
+        while (cnt > 0 && left >= p->iov_len) {
+            left -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (unsigned char*)p->iov_base + left;
+            p->iov_len -= left;
+        }
+    }
+
+    w->buf_len[0] = w->buf_len[1] = 0;
+}
+
+// called when current buffer is full
+inline void pcm_writer_switch(pcm_writer* w) {
+    if (w->is_pipe) {
+        pcm_writer_splice(w, w->cur);
+    } else if (w->buf_len[w->cur ^ 1] != 0) {
+        pcm_writer_writev(w);
+    }
+    w->cur ^= 1;
+}
+
+// get free space in current buffer, to fill it directly instead of
+// calling pcm_writer_write(); returned size is never zero
+inline void* pcm_writer_begin(pcm_writer* w, size_t* size) {
+    if (w->buf_len[w->cur] == w->buf_size) {
+        pcm_writer_switch(w);
+    }
+    *size = w->buf_size - w->buf_len[w->cur];
+    return w->buf[w->cur] + w->buf_len[w->cur];
+}
+
+// mark 'size' bytes returned by pcm_writer_begin() as filled
+inline void pcm_writer_commit(pcm_writer* w, size_t size) {
+    w->buf_len[w->cur] += size;
+}
+
+// copy samples to buffers, handing full buffers to the kernel
+inline void pcm_writer_write(pcm_writer* w, const void* data, size_t size) {
+    const unsigned char* src = (const unsigned char*)data;
+
+    while (size > 0) {
+        size_t avail = 0;
+        void* dst = pcm_writer_begin(w, &avail);
+
+        const size_t n = size < avail ? size : avail;
+        memcpy(dst, src, n);
+        pcm_writer_commit(w, n);
+
+        src += n;
+        size -= n;
+    }
+}
+
+// set output format and write stream header; must be called before
+// anything else is written
+inline void pcm_writer_set_format(pcm_writer* w, const pcm_format* f) {
+    w->sample_format = f->sample_format;
+
+    // fixed seed, so that the same input always gives the same output
+    pcm_dither_init(&w->dither, 1);
+
+    unsigned char header[PCM_HEADER_SIZE];
+    pcm_header_encode(f, header);
+
+    pcm_writer_write(w, header, sizeof(header));
+}
+
+// write 'n' float samples, converting them to output format
+inline void pcm_writer_write_samples(pcm_writer* w, const float* samples, size_t n) {
+    if (w->sample_format == PCM_FORMAT_F32) {
+        pcm_writer_write(w, samples, n * sizeof(float));
+        return;
+    }
+
+    const size_t sample_size = pcm_format_sample_size(w->sample_format);
+
+    while (n > 0) {
+        size_t avail = 0;
+        void* dst = pcm_writer_begin(w, &avail);
+
+        size_t cnt = avail / sample_size;
+        if (cnt > n) {
+            cnt = n;
+        }
+
+        if (w->sample_format == PCM_FORMAT_S16) {
+            pcm_dither_s16(&w->dither, samples, (int16_t*)dst, cnt);
+        } else {
+            pcm_dither_s24(&w->dither, samples, (int32_t*)dst, cnt);
+        }
+
+        pcm_writer_commit(w, cnt * sample_size);
+
+        samples += cnt;
+        n -= cnt;
+    }
+}
+
+// hand remaining samples to the kernel and free buffers; doesn't close
+// file descriptor
+inline void pcm_writer_close(pcm_writer* w) {
+    if (w->is_pipe) {
+        pcm_writer_splice(w, w->cur);
+    } else {
+        pcm_writer_writev(w);
+    }
+
+    for (int n = 0; n < 2; n++) {
+        munmap(w->buf[n], w->buf_size);
+        w->buf[n] = NULL;
+    }
+}
+
+#endif // PCM_WRITER_H
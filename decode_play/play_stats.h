@@ -0,0 +1,119 @@
+/* Statistics reported by players on exit:
+ *
+ *  - "cpu_time": CPU time (user and system) per minute of audio
+ *  - "write_latency": p50, p99 and max time from the moment a period was
+ *    read from stdin until the device accepted it, i.e. the cost of the
+ *    output path alone
+ *  - "steady_state_allocs": heap allocations after the first
+ *    'play_stats_warmup_periods' periods (see alloc_count.h)
+ *
+ * Latencies are counted in a fixed histogram, so that recording them
+ * doesn't allocate. Include it from exactly one translation unit, like
+ * alloc_count.h.
+ */
+#ifndef PLAY_STATS_H
+#define PLAY_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "alloc_count.h"
+
+// allocations made during first periods belong to startup
+static const int play_stats_warmup_periods = 16;
+
+// latency histogram: 1us bins, last bin collects everything above
+static const int play_stats_n_bins = 100000;
+
+struct play_stats {
+    uint64_t n_frames;
+    uint64_t n_periods;
+    long warm_allocs;
+    double cpu_start;
+    int64_t period_start_ns;
+    uint32_t latency_us[play_stats_n_bins];
+};
+
+static inline double play_stats_cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static inline int64_t play_stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void play_stats_init(play_stats* st) {
+    memset(st, 0, sizeof(*st));
+    st->warm_allocs = -1;
+    st->cpu_start = play_stats_cpu_seconds();
+}
+
+// call when period was read from stdin
+static inline void play_stats_period_read(play_stats* st) {
+    if (st->n_periods == (uint64_t)play_stats_warmup_periods) {
+        st->warm_allocs = alloc_count();
+    }
+    st->period_start_ns = play_stats_now_ns();
+}
+
+// call when device accepted 'n_frames' frames of the period
+static inline void play_stats_period_written(play_stats* st, uint64_t n_frames) {
+    int64_t us = (play_stats_now_ns() - st->period_start_ns) / 1000;
+    if (us >= play_stats_n_bins) {
+        us = play_stats_n_bins - 1;
+    }
+    st->latency_us[us]++;
+    st->n_frames += n_frames;
+    st->n_periods++;
+}
+
+// smallest latency in microseconds which is not less than 'p' of periods
+static inline int play_stats_percentile(const play_stats* st, double p) {
+    const uint64_t rank = (uint64_t)(p * (st->n_periods - 1) + 0.5);
+    uint64_t count = 0;
+    for (int n = 0; n < play_stats_n_bins; n++) {
+        count += st->latency_us[n];
+        if (count > rank) {
+            return n;
+        }
+    }
+    return play_stats_n_bins - 1;
+}
+
+static inline void play_stats_report(const play_stats* st, const char* path,
+                                     int sample_rate) {
+    const long end_allocs = alloc_count();
+    const double cpu_time = play_stats_cpu_seconds() - st->cpu_start;
+    const double minutes = (double)st->n_frames / sample_rate / 60;
+
+    printf("path = %s\n", path);
+    printf("cpu_time = %.3f ms per minute of audio\n",
+           minutes > 0 ? cpu_time * 1e3 / minutes : 0.0);
+    if (st->n_periods > 0) {
+        printf("write_latency = p50 %d us, p99 %d us, max %d us\n",
+               play_stats_percentile(st, 0.5), play_stats_percentile(st, 0.99),
+               play_stats_percentile(st, 1));
+    }
+    if (end_allocs < 0) {
+        printf("steady_state_allocs = not counted (build with -DALLOC_COUNT)\n");
+    } else if (st->warm_allocs < 0) {
+        printf("steady_state_allocs = unknown (less than %d periods)\n",
+               play_stats_warmup_periods);
+    } else {
+        const long allocs = end_allocs - st->warm_allocs;
+        const uint64_t periods = st->n_periods - play_stats_warmup_periods;
+        printf("steady_state_allocs = %ld (after %d periods, %.2f per period)\n",
+               allocs, play_stats_warmup_periods,
+               periods > 0 ? (double)allocs / periods : 0.0);
+    }
+}
+
+#endif // PLAY_STATS_H
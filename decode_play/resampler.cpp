@@ -0,0 +1,424 @@
+/* Streaming sample rate converter, see resampler.h.
+ */
+#include <string.h>
+#include <math.h>
+
+#include "resampler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESAMPLER_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef RESAMPLER_NO_PRESETS
+// generated by resampler_gen into resampler_tables.cpp
+extern const resampler_preset resampler_presets[];
+extern const size_t resampler_n_presets;
+#endif
+
+struct quality_params {
+    int zero_crossings;  // number of zero crossings of sinc on every side
+    double kaiser_beta;  // Kaiser window parameter
+    double cutoff;       // passband edge relative to lower Nyquist frequency
+};
+
+static const quality_params qualities[] = {
+    { 8, 5.7, 0.80 },    // RESAMPLER_LOW
+    { 16, 7.9, 0.88 },   // RESAMPLER_MEDIUM
+    { 32, 10.1, 0.91 },  // RESAMPLER_HIGH
+    { 64, 13.1, 0.95 },  // RESAMPLER_VERY_HIGH
+};
+
+// cutoff relative to input Nyquist frequency
+static double filter_cutoff(uint64_t L, uint64_t M, resampler_quality quality) {
+    return qualities[quality].cutoff * (L < M ? (double)L / M : 1.0);
+}
+
+// number of input frames on every side of output time covered by filter
+static int filter_half_width(uint64_t L, uint64_t M, resampler_quality quality) {
+    return (int)ceil(qualities[quality].zero_crossings / filter_cutoff(L, M, quality));
+}
+
+// modified Bessel function of the first kind, order 0
+static double bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 64; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-17) {
+            break;
+        }
+    }
+    return sum;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        const uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// sum lanes of vector accumulator into channels; lane count must be
+// a multiple of channel count
+static inline void reduce_lanes(const float* lanes, int n_lanes, int channels, float* acc) {
+    for (int c = 0; c < channels; c++) {
+        acc[c] = 0;
+    }
+    for (int i = 0; i < n_lanes; i++) {
+        acc[i % channels] += lanes[i];
+    }
+}
+
+static void dot_scalar(const float* x, const float* k, int n, int channels, float* acc) {
+    if (channels == 1) {
+        float a = 0;
+        for (int i = 0; i < n; i++) {
+            a += x[i] * k[i];
+        }
+        acc[0] = a;
+    } else if (channels == 2) {
+        float a0 = 0, a1 = 0;
+        for (int i = 0; i < n; i += 2) {
+            a0 += x[i] * k[i];
+            a1 += x[i + 1] * k[i + 1];
+        }
+        acc[0] = a0;
+        acc[1] = a1;
+    } else {
+        for (int c = 0; c < channels; c++) {
+            float a = 0;
+            for (int i = c; i < n; i += channels) {
+                a += x[i] * k[i];
+            }
+            acc[c] = a;
+        }
+    }
+}
+
+#ifdef RESAMPLER_X86
+
+// 'n' is a multiple of 8, since n_taps is
+__attribute__((target("sse2")))
+static void dot_sse(const float* x, const float* k, int n, int channels, float* acc) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+
+    for (int i = 0; i < n; i += 8) {
+        a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(k + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(k + i + 4)));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(a0, a1));
+
+    reduce_lanes(lanes, 4, channels, acc);
+}
+
+__attribute__((target("avx2,fma")))
+static void dot_avx2(const float* x, const float* k, int n, int channels, float* acc) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(k + i), a0);
+        a1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(k + i + 8), a1);
+    }
+    if (i < n) {
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(k + i), a0);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(a0, a1));
+
+    reduce_lanes(lanes, 8, channels, acc);
+}
+
+#endif // RESAMPLER_X86
+
+#ifdef RESAMPLER_NEON
+
+static void dot_neon(const float* x, const float* k, int n, int channels, float* acc) {
+    float32x4_t a0 = vdupq_n_f32(0), a1 = vdupq_n_f32(0);
+
+    for (int i = 0; i < n; i += 8) {
+        a0 = vmlaq_f32(a0, vld1q_f32(x + i), vld1q_f32(k + i));
+        a1 = vmlaq_f32(a1, vld1q_f32(x + i + 4), vld1q_f32(k + i + 4));
+    }
+
+    float lanes[4];
+    vst1q_f32(lanes, vaddq_f32(a0, a1));
+
+    reduce_lanes(lanes, 4, channels, acc);
+}
+
+#endif // RESAMPLER_NEON
+
+struct kernel {
+    const char* name;
+    resampler_dot_fn fn;
+    int n_lanes;
+};
+
+static const kernel kernels[] = {
+    { "scalar", dot_scalar, 1 },
+#ifdef RESAMPLER_X86
+    { "sse", dot_sse, 4 },
+    { "avx2", dot_avx2, 8 },
+#endif
+#ifdef RESAMPLER_NEON
+    { "neon", dot_neon, 4 },
+#endif
+};
+
+static const size_t n_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+static bool kernel_supported(const kernel& k) {
+#ifdef RESAMPLER_X86
+    __builtin_cpu_init();
+    if (strcmp(k.name, "sse") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(k.name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+    (void)k;
+    return true;
+}
+
+// best supported kernel, last one in the list
+static const kernel* select_kernel() {
+    const kernel* best = &kernels[0];
+    for (size_t n = 1; n < n_kernels; n++) {
+        if (kernel_supported(kernels[n])) {
+            best = &kernels[n];
+        }
+    }
+    return best;
+}
+
+static const kernel* current_kernel = select_kernel();
+
+
+bool resampler_parse_quality(const char* name, resampler_quality* quality) {
+    static const char* const names[] = { "low", "medium", "high", "very-high" };
+
+    for (int n = 0; n < 4; n++) {
+        if (strcmp(name, names[n]) == 0) {
+            *quality = (resampler_quality)n;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void resampler_design(int in_rate, int out_rate, resampler_quality quality,
+                      int* n_phases, int* n_taps, std::vector<float>& rows) {
+    const quality_params& q = qualities[quality];
+
+    const uint64_t g = gcd((uint64_t)in_rate, (uint64_t)out_rate);
+    const uint64_t L = (uint64_t)out_rate / g, M = (uint64_t)in_rate / g;
+
+    *n_phases = L > (uint64_t)resampler_max_phases ? resampler_max_phases : (int)L;
+
+    const double fc = filter_cutoff(L, M, quality);
+
+    // taps are padded with zeros at the end to multiple of vector size
+    const int half_width = filter_half_width(L, M, quality);
+    *n_taps = (half_width * 2 + 7) / 8 * 8;
+
+    const double i0_beta = bessel_i0(q.kaiser_beta);
+
+    rows.assign((size_t)(*n_phases + 1) * *n_taps, 0.0f);
+
+    std::vector<double> row(*n_taps);
+
+    // tap 'i' of phase 'p' is applied to input frame which is
+    // (half_width - 1 - i + p / n_phases) frames before output time
+    for (int p = 0; p <= *n_phases; p++) {
+        const double frac = (double)p / *n_phases;
+
+        double sum = 0;
+        for (int i = 0; i < *n_taps; i++) {
+            const double x = frac + half_width - 1 - i;
+            const double w = x / half_width;
+
+            double h = 0;
+            if (w * w < 1) {
+                h = x != 0 ? sin(M_PI * fc * x) / (M_PI * x) : fc;
+                h *= bessel_i0(q.kaiser_beta * sqrt(1 - w * w)) / i0_beta;
+            }
+
+            row[i] = h;
+            sum += h;
+        }
+
+        // exactly unity gain at DC for every phase
+        for (int i = 0; i < *n_taps; i++) {
+            rows[(size_t)p * *n_taps + i] = (float)(row[i] / sum);
+        }
+    }
+}
+
+void resampler_init(resampler* r, int channels, int in_rate, int out_rate,
+                    resampler_quality quality) {
+    const uint64_t g = gcd((uint64_t)in_rate, (uint64_t)out_rate);
+
+    r->channels = channels;
+    r->L = (uint64_t)out_rate / g;
+    r->M = (uint64_t)in_rate / g;
+
+    const float* rows = NULL;
+    std::vector<float> computed;
+
+    r->preset = false;
+
+#ifndef RESAMPLER_NO_PRESETS
+    for (size_t n = 0; n < resampler_n_presets; n++) {
+        const resampler_preset& p = resampler_presets[n];
+        if (p.in_rate == in_rate && p.out_rate == out_rate && p.quality == quality) {
+            r->n_phases = p.n_phases;
+            r->n_taps = p.n_taps;
+            rows = p.rows;
+            r->preset = true;
+            break;
+        }
+    }
+#endif
+
+    if (!rows) {
+        resampler_design(in_rate, out_rate, quality, &r->n_phases, &r->n_taps, computed);
+        rows = &computed[0];
+    }
+
+    r->interpolate = (uint64_t)r->n_phases != r->L;
+
+    // repeat every coefficient for every channel
+    const size_t n_coefs = (size_t)(r->n_phases + 1) * r->n_taps;
+
+    r->coefs.resize(n_coefs * channels);
+    for (size_t i = 0; i < n_coefs; i++) {
+        for (int c = 0; c < channels; c++) {
+            r->coefs[i * channels + c] = rows[i];
+        }
+    }
+
+    // vector kernels need lane count to be a multiple of channel count
+    r->dot = current_kernel->n_lanes % channels == 0 ? current_kernel->fn : dot_scalar;
+
+    // input before the first frame is silence
+    r->buf_frames = (size_t)filter_half_width(r->L, r->M, quality) - 1;
+    r->buf.assign(r->buf_frames * channels, 0.0f);
+    r->pos = 0;
+    r->phase = 0;
+    r->n_in = 0;
+    r->n_out = 0;
+}
+
+size_t resampler_max_output(const resampler* r, size_t in_frames) {
+    // less than n_taps frames are kept between calls, and flush adds
+    // n_taps frames
+    return (size_t)((in_frames + 2 * (uint64_t)r->n_taps) * r->L / r->M) + 2;
+}
+
+// produce output frames while buffered input is enough, but no more than
+// 'limit' frames in total; returns number of frames written to 'out'
+static size_t resampler_run(resampler* r, float* out, uint64_t limit) {
+    const int channels = r->channels;
+    const int row_size = r->n_taps * channels;
+
+    float* dst = out;
+
+    while (r->n_out < limit && r->pos + r->n_taps <= r->buf_frames) {
+        const float* x = &r->buf[r->pos * channels];
+
+        if (!r->interpolate) {
+            r->dot(x, &r->coefs[r->phase * row_size], row_size, channels, dst);
+        } else {
+            const uint64_t num = r->phase * (uint64_t)r->n_phases;
+            const size_t p = (size_t)(num / r->L);
+            const float a = (float)(num % r->L) / (float)r->L;
+
+            float acc0[16], acc1[16];
+            r->dot(x, &r->coefs[p * row_size], row_size, channels, acc0);
+            r->dot(x, &r->coefs[(p + 1) * row_size], row_size, channels, acc1);
+
+            for (int c = 0; c < channels; c++) {
+                dst[c] = acc0[c] + (acc1[c] - acc0[c]) * a;
+            }
+        }
+
+        dst += channels;
+        r->n_out++;
+
+        r->phase += r->M;
+        r->pos += (size_t)(r->phase / r->L);
+        r->phase %= r->L;
+    }
+
+    // drop consumed frames
+    if (r->pos > 0) {
+        const size_t left = r->buf_frames > r->pos ? r->buf_frames - r->pos : 0;
+        memmove(&r->buf[0], &r->buf[(r->buf_frames - left) * channels],
+                left * channels * sizeof(float));
+        r->pos -= r->buf_frames - left;
+        r->buf_frames = left;
+    }
+
+    return (size_t)(dst - out) / channels;
+}
+
+static void resampler_append(resampler* r, const float* in, size_t in_frames) {
+    const size_t need = (r->buf_frames + in_frames) * r->channels;
+    if (r->buf.size() < need) {
+        r->buf.resize(need);
+    }
+
+    if (in) {
+        memcpy(&r->buf[r->buf_frames * r->channels], in,
+               in_frames * r->channels * sizeof(float));
+    } else {
+        memset(&r->buf[r->buf_frames * r->channels], 0,
+               in_frames * r->channels * sizeof(float));
+    }
+
+    r->buf_frames += in_frames;
+}
+
+size_t resampler_process(resampler* r, const float* in, size_t in_frames,
+                         float* out) {
+    resampler_append(r, in, in_frames);
+    r->n_in += in_frames;
+
+    return resampler_run(r, out, UINT64_MAX);
+}
+
+size_t resampler_flush(resampler* r, float* out) {
+    // silence after the last frame; the last output frame needs a whole
+    // (padded) filter width of input starting before the last input frame
+    resampler_append(r, NULL, (size_t)r->n_taps);
+
+    const uint64_t total = (r->n_in * r->L + r->M - 1) / r->M;
+
+    return resampler_run(r, out, total);
+}
+
+const char* resampler_kernel() {
+    return current_kernel->name;
+}
+
+bool resampler_set_kernel(const char* name) {
+    for (size_t n = 0; n < n_kernels; n++) {
+        if (strcmp(kernels[n].name, name) == 0 && kernel_supported(kernels[n])) {
+            current_kernel = &kernels[n];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,108 @@
+/* Streaming sample rate converter for interleaved float samples.
+ *
+ * This is a small static library (libresampler.a) that any decoder can link
+ * instead of depending on swr or SoX for rate conversion.
+ *
+ * Polyphase FIR filter with Kaiser-windowed sinc. If the ratio of output and
+ * input rate, reduced to L/M, has a small enough L, output samples lie at
+ * exactly L different fractional positions between input samples and there
+ * is one filter phase for every position. Otherwise, the table has
+ * resampler_max_phases phases and every output sample is interpolated
+ * between two nearest phases.
+ *
+ * When downsampling, the cutoff is lowered to output Nyquist frequency and
+ * the filter becomes longer accordingly.
+ *
+ * Filter tables for common ratios (48000, 96000 and 22050 to 44100) at every
+ * quality are computed at build time by resampler_gen and linked into the
+ * library (see resampler_tables.cpp); other tables are computed by
+ * resampler_init().
+ *
+ * Every coefficient is repeated for every channel, so that one output frame
+ * is a plain element-wise dot product of the table row and a contiguous
+ * range of interleaved input frames. The dot product is vectorized with
+ * SSE or AVX2 on x86, selected at runtime, and with NEON on ARM.
+ *
+ * Output is aligned with input: output frame k corresponds to input time
+ * k * M / L, and exactly ceil(input_frames * L / M) frames are produced.
+ */
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+enum resampler_quality {
+    RESAMPLER_LOW,       // 8 zero crossings, ~60 dB stopband
+    RESAMPLER_MEDIUM,    // 16 zero crossings, ~80 dB stopband
+    RESAMPLER_HIGH,      // 32 zero crossings, ~100 dB stopband
+    RESAMPLER_VERY_HIGH, // 64 zero crossings, ~130 dB stopband
+};
+
+// dot product of 'n' coefficients and 'n' interleaved samples,
+// accumulated separately for every channel
+typedef void (*resampler_dot_fn)(const float* x, const float* k, int n,
+                                 int channels, float* acc);
+
+struct resampler {
+    int channels;              // up to 16
+    uint64_t L, M;             // output / input rate ratio, reduced
+    int n_phases;              // number of phases in table
+    bool interpolate;          // if n_phases != L
+    bool preset;               // if table was computed at build time
+    int n_taps;                // taps per phase, multiple of 8
+    std::vector<float> coefs;  // (n_phases + 1) rows of n_taps * channels
+    std::vector<float> buf;    // pending input frames, interleaved
+    size_t buf_frames;
+    size_t pos;                // first frame in buf used by next output
+    uint64_t phase;            // position of next output after 'pos', in 1/L
+    uint64_t n_in, n_out;      // total number of input and output frames
+    resampler_dot_fn dot;
+};
+
+// table computed at build time
+struct resampler_preset {
+    int in_rate, out_rate;
+    resampler_quality quality;
+    int n_phases, n_taps;
+    const float* rows;         // n_phases + 1 rows of n_taps
+};
+
+// larger L uses interpolation between phases
+static const int resampler_max_phases = 1024;
+
+// parse quality name ("low", "medium", "high", "very-high")
+// returns false if name is unknown
+bool resampler_parse_quality(const char* name, resampler_quality* quality);
+
+// compute filter table: n_phases + 1 rows of n_taps coefficients
+void resampler_design(int in_rate, int out_rate, resampler_quality quality,
+                      int* n_phases, int* n_taps, std::vector<float>& rows);
+
+void resampler_init(resampler* r, int channels, int in_rate, int out_rate,
+                    resampler_quality quality = RESAMPLER_HIGH);
+
+// upper bound of frames produced by resampler_process() for given input
+// size, or by resampler_flush() if in_frames is zero
+size_t resampler_max_output(const resampler* r, size_t in_frames);
+
+// resample 'in_frames' input frames; 'out' should have space for
+// resampler_max_output(r, in_frames) frames
+// returns number of frames written to 'out'
+size_t resampler_process(resampler* r, const float* in, size_t in_frames,
+                         float* out);
+
+// produce remaining output frames after end of input; 'out' should have
+// space for resampler_max_output(r, 0) frames
+size_t resampler_flush(resampler* r, float* out);
+
+// name of dot product kernel used by new resamplers
+const char* resampler_kernel();
+
+// use given kernel ("scalar", "sse", "avx2", "neon") for new resamplers
+// returns false if it's not supported by current CPU
+bool resampler_set_kernel(const char* name);
+
+#endif // RESAMPLER_H
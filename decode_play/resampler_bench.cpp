@@ -0,0 +1,463 @@
+/* Compare resampler.h with swr and SoX "rate" effect.
+ *
+ * A stereo sine is converted from every input rate to 44100 by every
+ * resampler, in blocks of the same size. For every run, we report:
+ *  - speed as multiple of real time, measured by input duration
+ *  - THD+N: power of everything except the sine in output, relative to
+ *    power of the sine, measured away from the start and the end
+ *
+ * Before that, every input rate in 'check_rates' is converted at every
+ * quality with 1 to 3 channels, in blocks of odd size, to check that
+ * exactly ceil(frames * L / M) frames are produced (see resampler.h).
+ *
+ * SoX works with 32-bit integer samples, so its timing includes conversion
+ * from and to floats (see sox_convert.h).
+ *
+ * Usage:
+ *   ./resampler_bench [seconds] [frequency]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+#include <sox.h>
+
+#include "resampler.h"
+#include "sox_convert.h"
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+static const int channels = 2, out_rate = 44100;
+
+static const uint64_t layout = AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT;
+
+// number of input frames per call
+static const size_t block_frames = 4096;
+
+static const int in_rates[] = { 48000, 96000, 22050, 44056 };
+
+// rates for output length check
+static const int check_rates[] = {
+    8000, 11025, 12345, 22050, 32000, 44056, 44100, 48000, 88200, 96000, 192000,
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::vector<float> make_sine(int rate, double seconds, double freq) {
+    const size_t n_frames = (size_t)(rate * seconds);
+
+    std::vector<float> samples(n_frames * channels);
+    for (size_t n = 0; n < n_frames; n++) {
+        const float v = (float)(0.5 * sin(2 * M_PI * freq * n / rate));
+        for (int c = 0; c < channels; c++) {
+            samples[n * channels + c] = v;
+        }
+    }
+
+    return samples;
+}
+
+// fit a * sin + b * cos + c to the first channel at given frequency and
+// return power of residual relative to power of the sine, in dB
+static double thd_n(const std::vector<float>& samples, double freq) {
+    const size_t n_frames = samples.size() / channels;
+    const size_t skip = out_rate / 10;
+
+    if (n_frames < skip * 3) {
+        return 0;
+    }
+
+    // normal equations for three basis functions
+    double m[3][3] = {}, v[3] = {};
+
+    for (size_t n = skip; n < n_frames - skip; n++) {
+        const double w = 2 * M_PI * freq * n / out_rate;
+        const double basis[3] = { sin(w), cos(w), 1 };
+        const double y = samples[n * channels];
+
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                m[i][j] += basis[i] * basis[j];
+            }
+            v[i] += basis[i] * y;
+        }
+    }
+
+    // Gaussian elimination
+    for (int i = 0; i < 3; i++) {
+        for (int k = i + 1; k < 3; k++) {
+            const double f = m[k][i] / m[i][i];
+            for (int j = i; j < 3; j++) {
+                m[k][j] -= f * m[i][j];
+            }
+            v[k] -= f * v[i];
+        }
+    }
+
+    double coef[3];
+    for (int i = 2; i >= 0; i--) {
+        double s = v[i];
+        for (int j = i + 1; j < 3; j++) {
+            s -= m[i][j] * coef[j];
+        }
+        coef[i] = s / m[i][i];
+    }
+
+    double signal = 0, noise = 0;
+
+    for (size_t n = skip; n < n_frames - skip; n++) {
+        const double w = 2 * M_PI * freq * n / out_rate;
+        const double fit = coef[0] * sin(w) + coef[1] * cos(w);
+        const double e = samples[n * channels] - fit - coef[2];
+
+        signal += fit * fit;
+        noise += e * e;
+    }
+
+    return 10 * log10(noise / signal);
+}
+
+static void report(const char* name, int in_rate, const std::vector<float>& in,
+                   const std::vector<float>& out, double elapsed, double freq) {
+    const double duration = (double)in.size() / channels / in_rate;
+
+    printf("%-26s %6d -> %d  %8.1fx realtime  THD+N %7.1f dB\n",
+           name, in_rate, out_rate, duration / elapsed, thd_n(out, freq));
+}
+
+static void run_resampler(const char* kernel, resampler_quality quality,
+                          const char* quality_name, int in_rate,
+                          const std::vector<float>& in, double freq) {
+    if (!resampler_set_kernel(kernel)) {
+        return;
+    }
+
+    const size_t in_frames = in.size() / channels;
+
+    std::vector<float> out;
+    out.reserve((size_t)((double)in_frames * out_rate / in_rate + 1024) * channels);
+
+    const double start = now_seconds();
+
+    resampler r;
+    resampler_init(&r, channels, in_rate, out_rate, quality);
+
+    std::vector<float> buf(resampler_max_output(&r, block_frames) * channels);
+
+    for (size_t pos = 0; pos < in_frames; pos += block_frames) {
+        const size_t n = in_frames - pos < block_frames ? in_frames - pos : block_frames;
+        const size_t ret = resampler_process(&r, &in[pos * channels], n, &buf[0]);
+        out.insert(out.end(), buf.begin(), buf.begin() + ret * channels);
+    }
+
+    const size_t ret = resampler_flush(&r, &buf[0]);
+    out.insert(out.end(), buf.begin(), buf.begin() + ret * channels);
+
+    const double elapsed = now_seconds() - start;
+
+    const std::string name = std::string("resampler ") + kernel + " " + quality_name;
+    report(name.c_str(), in_rate, in, out, elapsed, freq);
+}
+
+// returns number of mismatches
+static int check_lengths() {
+    const size_t in_frames_per_call = 1000;
+
+    int n_failed = 0;
+
+    for (size_t i = 0; i < sizeof(check_rates) / sizeof(check_rates[0]); i++) {
+        const int in_rate = check_rates[i];
+        // not a multiple of block size, so that last block is partial
+        const size_t in_frames = (size_t)in_rate + 37;
+        const uint64_t expected =
+            ((uint64_t)in_frames * out_rate + in_rate - 1) / in_rate;
+
+        for (int q = 0; q < 4; q++) {
+            for (int ch = 1; ch <= 3; ch++) {
+                resampler r;
+                resampler_init(&r, ch, in_rate, out_rate, (resampler_quality)q);
+
+                const std::vector<float> in(in_frames_per_call * ch, 0.25f);
+                std::vector<float> out(resampler_max_output(&r, in_frames_per_call) * ch);
+
+                uint64_t n_out = 0;
+                for (size_t pos = 0; pos < in_frames; pos += in_frames_per_call) {
+                    const size_t n = in_frames - pos < in_frames_per_call
+                        ? in_frames - pos : in_frames_per_call;
+                    n_out += resampler_process(&r, &in[0], n, &out[0]);
+                }
+                n_out += resampler_flush(&r, &out[0]);
+
+                if (n_out != expected) {
+                    printf("length check: %d -> %d quality %d channels %d: "
+                           "%llu frames, expected %llu\n",
+                           in_rate, out_rate, q, ch,
+                           (unsigned long long)n_out, (unsigned long long)expected);
+                    n_failed++;
+                }
+            }
+        }
+    }
+
+    return n_failed;
+}
+
+// filter_size 0 means swr default
+static void run_swr(const char* name, int filter_size, int in_rate,
+                    const std::vector<float>& in, double freq) {
+    const size_t in_frames = in.size() / channels;
+
+    std::vector<float> out;
+    out.reserve((size_t)((double)in_frames * out_rate / in_rate + 1024) * channels);
+
+    const double start = now_seconds();
+
+    SwrContext* swr = swr_alloc_set_opts(
+        NULL,
+        layout, AV_SAMPLE_FMT_FLT, out_rate,
+        layout, AV_SAMPLE_FMT_FLT, in_rate,
+        0, NULL);
+    if (!swr) {
+        oops("swr_alloc_set_opts()");
+    }
+
+    if (filter_size != 0) {
+        av_opt_set_int(swr, "filter_size", filter_size, 0);
+        av_opt_set_int(swr, "phase_shift", 14, 0);
+    }
+
+    if (swr_init(swr) < 0) {
+        oops("swr_init()");
+    }
+
+    const int max_out = swr_get_out_samples(swr, (int)block_frames) + 1024;
+    std::vector<float> buf((size_t)max_out * channels);
+
+    for (size_t pos = 0;; pos += block_frames) {
+        const uint8_t* src = NULL;
+        int n = 0;
+
+        // NULL input flushes the resampler
+        if (pos < in_frames) {
+            src = (const uint8_t*)&in[pos * channels];
+            n = (int)(in_frames - pos < block_frames ? in_frames - pos : block_frames);
+        }
+
+        uint8_t* dst = (uint8_t*)&buf[0];
+
+        const int ret = swr_convert(swr, &dst, max_out, src ? &src : NULL, n);
+        if (ret < 0) {
+            oops("swr_convert()");
+        }
+
+        out.insert(out.end(), buf.begin(), buf.begin() + ret * channels);
+
+        if (!src && ret == 0) {
+            break;
+        }
+    }
+
+    swr_free(&swr);
+
+    const double elapsed = now_seconds() - start;
+
+    report(name, in_rate, in, out, elapsed, freq);
+}
+
+// state of SoX input and output effects
+static const std::vector<float>* sox_in;
+static size_t sox_in_pos;
+static std::vector<float>* sox_out;
+static std::vector<float> sox_out_buf;
+
+static int sox_input_drain(sox_effect_t* effect, sox_sample_t* output, size_t* out_samples) {
+    size_t n = sox_in->size() - sox_in_pos;
+    if (n > *out_samples) {
+        n = *out_samples / channels * channels;
+    }
+
+    float_to_sox(&(*sox_in)[sox_in_pos], output, n);
+    sox_in_pos += n;
+
+    *out_samples = n;
+
+    return n != 0 ? SOX_SUCCESS : SOX_EOF;
+}
+
+static int sox_output_flow(
+    sox_effect_t* effect, const sox_sample_t* input, sox_sample_t* output,
+    size_t* in_samples,
+    size_t* out_samples)
+{
+    if (sox_out_buf.size() < *in_samples) {
+        sox_out_buf.resize(*in_samples);
+    }
+
+    sox_to_float(input, &sox_out_buf[0], *in_samples);
+    sox_out->insert(sox_out->end(), sox_out_buf.begin(), sox_out_buf.begin() + *in_samples);
+
+    *out_samples = 0;
+
+    return SOX_SUCCESS;
+}
+
+static void run_sox(const char* name, const char* rate_quality, int in_rate,
+                    const std::vector<float>& in, double freq) {
+    std::vector<float> out;
+    out.reserve((size_t)((double)in.size() * out_rate / in_rate) + 1024 * channels);
+
+    sox_in = &in;
+    sox_in_pos = 0;
+    sox_out = &out;
+
+    const double start = now_seconds();
+
+    sox_globals.bufsiz = block_frames * channels;
+
+    sox_encodinginfo_t encoding = {};
+    encoding.encoding = SOX_ENCODING_FLOAT;
+    encoding.bits_per_sample = 32;
+
+    sox_signalinfo_t in_si = {};
+    in_si.rate = in_rate;
+    in_si.channels = channels;
+    in_si.precision = SOX_SAMPLE_PRECISION;
+
+    sox_signalinfo_t out_si = in_si;
+    out_si.rate = out_rate;
+
+    sox_effect_handler_t in_handler = {
+        "input", NULL, SOX_EFF_MCHAN, NULL, NULL, NULL, sox_input_drain, NULL, NULL, 0
+    };
+
+    sox_effect_handler_t out_handler = {
+        "output", NULL, SOX_EFF_MCHAN, NULL, NULL, sox_output_flow, NULL, NULL, NULL, 0
+    };
+
+    sox_effects_chain_t* chain = sox_create_effects_chain(&encoding, &encoding);
+    if (!chain) {
+        oops("sox_create_effects_chain()");
+    }
+
+    {
+        sox_effect_t* effect = sox_create_effect(&in_handler);
+        if (!effect) {
+            oops("sox_create_effect(input)");
+        }
+
+        if (sox_add_effect(chain, effect, &in_si, &in_si) != SOX_SUCCESS) {
+            oops("sox_add_effect(input)");
+        }
+
+        free(effect);
+    }
+
+    {
+        sox_effect_t* effect = sox_create_effect(sox_find_effect("rate"));
+        if (!effect) {
+            oops("sox_create_effect(rate)");
+        }
+
+        const char* args[] = { rate_quality };
+
+        if (sox_effect_options(effect, 1, (char**)args) != SOX_SUCCESS) {
+            oops("sox_effect_options(rate)");
+        }
+
+        if (sox_add_effect(chain, effect, &in_si, &out_si) != SOX_SUCCESS) {
+            oops("sox_add_effect(rate)");
+        }
+
+        free(effect);
+    }
+
+    {
+        sox_effect_t* effect = sox_create_effect(&out_handler);
+        if (!effect) {
+            oops("sox_create_effect(output)");
+        }
+
+        if (sox_add_effect(chain, effect, &in_si, &out_si) != SOX_SUCCESS) {
+            oops("sox_add_effect(output)");
+        }
+
+        free(effect);
+    }
+
+    sox_flow_effects(chain, NULL, NULL);
+
+    sox_delete_effects_chain(chain);
+
+    const double elapsed = now_seconds() - start;
+
+    report(name, in_rate, in, out, elapsed, freq);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [seconds] [frequency]\n", argv[0]);
+        exit(1);
+    }
+
+    const double seconds = argc > 1 ? atof(argv[1]) : 60;
+    const double freq = argc > 2 ? atof(argv[2]) : 997;
+
+    if (sox_init() != SOX_SUCCESS) {
+        oops("sox_init()");
+    }
+
+    static const char* const kernels[] = { "scalar", "sse", "avx2", "neon" };
+
+    static const char* const quality_names[] = {
+        "low", "medium", "high", "very-high",
+    };
+
+    const char* best_kernel = resampler_kernel();
+
+    if (check_lengths() != 0) {
+        fprintf(stderr, "resampler output length check failed\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < sizeof(in_rates) / sizeof(in_rates[0]); i++) {
+        const int in_rate = in_rates[i];
+        const std::vector<float> in = make_sine(in_rate, seconds, freq);
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            run_resampler(kernels[k], RESAMPLER_HIGH, "high", in_rate, in, freq);
+        }
+
+        for (int q = 0; q < 4; q++) {
+            run_resampler(best_kernel, (resampler_quality)q, quality_names[q],
+                          in_rate, in, freq);
+        }
+
+        run_swr("swr", 0, in_rate, in, freq);
+        run_swr("swr filter_size=64", 64, in_rate, in, freq);
+
+        run_sox("sox rate -h", "-h", in_rate, in, freq);
+        run_sox("sox rate -v", "-v", in_rate, in, freq);
+
+        printf("\n");
+    }
+
+    if (sox_quit() != SOX_SUCCESS) {
+        oops("sox_quit()");
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* Generate filter tables for common sample rates, see resampler.h.
+ *
+ * Usage:
+ *   ./resampler_gen > resampler_tables.cpp
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "resampler.h"
+
+static const int in_rates[] = { 48000, 96000, 22050 };
+
+static const int out_rate = 44100;
+
+static const char* const quality_names[] = {
+    "RESAMPLER_LOW", "RESAMPLER_MEDIUM", "RESAMPLER_HIGH", "RESAMPLER_VERY_HIGH",
+};
+
+int main() {
+    const int n_rates = sizeof(in_rates) / sizeof(in_rates[0]);
+    const int n_qualities = sizeof(quality_names) / sizeof(quality_names[0]);
+
+    int n_phases[n_rates][n_qualities], n_taps[n_rates][n_qualities];
+
+    printf("// generated by resampler_gen, don't edit\n"
+           "#include \"resampler.h\"\n");
+
+    for (int r = 0; r < n_rates; r++) {
+        for (int q = 0; q < n_qualities; q++) {
+            std::vector<float> rows;
+            resampler_design(in_rates[r], out_rate, (resampler_quality)q,
+                             &n_phases[r][q], &n_taps[r][q], rows);
+
+            printf("\nstatic const float rows_%d_%d[] = {\n", in_rates[r], q);
+
+            // hex floats are exact
+            for (size_t n = 0; n < rows.size(); n++) {
+                printf("%s%af,%s",
+                       n % 4 == 0 ? "    " : " ",
+                       (double)rows[n],
+                       n % 4 == 3 || n + 1 == rows.size() ? "\n" : "");
+            }
+
+            printf("};\n");
+        }
+    }
+
+    printf("\nextern const resampler_preset resampler_presets[] = {\n");
+
+    for (int r = 0; r < n_rates; r++) {
+        for (int q = 0; q < n_qualities; q++) {
+            printf("    { %d, %d, %s, %d, %d, rows_%d_%d },\n",
+                   in_rates[r], out_rate, quality_names[q],
+                   n_phases[r][q], n_taps[r][q], in_rates[r], q);
+        }
+    }
+
+    printf("};\n"
+           "\nextern const size_t resampler_n_presets = %d;\n",
+           n_rates * n_qualities);
+
+    return 0;
+}
@@ -2,60 +2,451 @@
  * Output format:
  *  - two channels (front left, front right)
  *  - samples in interleaved format (L R L R ...)
- *  - samples are 32-bit floats
+ *  - samples are 32-bit floats, unless -f is given
  *  - sample rate is 44100
  *
+ * Input with other sample rate or number of channels is converted in-process
+ * (see resampler.h and channel_mix.h). Mono input is resampled before it's
+ * duplicated, other input is mixed into two channels before resampling, so
+ * that resampler never handles more channels than necessary.
+ *
  * Usage:
- *   ./sndfile_decode cool_song.wav > cool_song_samples
+ *   ./sndfile_decode [-q quality] [-P workers] [-f format] cool_song.wav > cool_song_samples
+ *
+ * Options:
+ *   -q  resampler quality: low, medium, high (default) or very-high
+ *   -P  decode seekable input in parallel: file is split into chunks of
+ *       frames, every worker seeks its own handle to the chunk it decodes,
+ *       and chunks are written in order; output is the same as without -P
+ *   -f  output sample format: f32, s16 or s24 (see pcm_format.h); when
+ *       given, output starts with stream header
  */
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <vector>
+
 #include <sndfile.h>
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s input_file > output_file\n", argv[0]);
+#include "channel_mix.h"
+#include "chunk_pool.h"
+#include "pcm_writer.h"
+#include "resampler.h"
+
+// number of frames read at once
+static const sf_count_t read_frames = 1 << 14;
+
+// number of frames decoded by one worker in parallel mode
+static const sf_count_t chunk_frames = 1 << 20;
+
+// channel positions from file header, if any
+static bool get_channel_map(SNDFILE* sfile, int channels,
+                            std::vector<channel_pos>& positions) {
+    std::vector<int> map(channels);
+    if (!sf_command(sfile, SFC_GET_CHANNEL_MAP_INFO,
+                    &map[0], (int)(channels * sizeof(int)))) {
+        return false;
+    }
+
+    positions.resize(channels);
+
+    for (int n = 0; n < channels; n++) {
+        switch (map[n]) {
+        case SF_CHANNEL_MAP_MONO:
+            positions[n] = CHANNEL_MONO;
+            break;
+        case SF_CHANNEL_MAP_LEFT:
+        case SF_CHANNEL_MAP_FRONT_LEFT:
+        case SF_CHANNEL_MAP_FRONT_LEFT_OF_CENTER:
+            positions[n] = CHANNEL_FRONT_LEFT;
+            break;
+        case SF_CHANNEL_MAP_RIGHT:
+        case SF_CHANNEL_MAP_FRONT_RIGHT:
+        case SF_CHANNEL_MAP_FRONT_RIGHT_OF_CENTER:
+            positions[n] = CHANNEL_FRONT_RIGHT;
+            break;
+        case SF_CHANNEL_MAP_CENTER:
+        case SF_CHANNEL_MAP_FRONT_CENTER:
+            positions[n] = CHANNEL_FRONT_CENTER;
+            break;
+        case SF_CHANNEL_MAP_LFE:
+            positions[n] = CHANNEL_LFE;
+            break;
+        case SF_CHANNEL_MAP_REAR_LEFT:
+            positions[n] = CHANNEL_BACK_LEFT;
+            break;
+        case SF_CHANNEL_MAP_REAR_RIGHT:
+            positions[n] = CHANNEL_BACK_RIGHT;
+            break;
+        case SF_CHANNEL_MAP_REAR_CENTER:
+            positions[n] = CHANNEL_BACK_CENTER;
+            break;
+        case SF_CHANNEL_MAP_SIDE_LEFT:
+            positions[n] = CHANNEL_SIDE_LEFT;
+            break;
+        case SF_CHANNEL_MAP_SIDE_RIGHT:
+            positions[n] = CHANNEL_SIDE_RIGHT;
+            break;
+        default:
+            positions[n] = CHANNEL_OTHER;
+            break;
+        }
+    }
+
+    return true;
+}
+
+// read samples directly into writer buffers
+static void copy_samples(SNDFILE* sfile, pcm_writer* writer, int channels) {
+    // integer output needs conversion, so samples can't be read in place
+    if (writer->sample_format != PCM_FORMAT_F32) {
+        std::vector<float> buffer((size_t)read_frames * channels);
+
+        for (;;) {
+            sf_count_t ret = sf_readf_float(sfile, &buffer[0], read_frames);
+            if (ret <= 0) {
+                break;
+            }
+
+            pcm_writer_write_samples(writer, &buffer[0], (size_t)ret * channels);
+        }
+        return;
+    }
+
+    const size_t frame_size = channels * sizeof(float);
+
+    for (;;) {
+        size_t size = 0;
+        float* dst = (float*)pcm_writer_begin(writer, &size);
+
+        sf_count_t n = (sf_count_t)(size / frame_size);
+        if (n > read_frames) {
+            n = read_frames;
+        }
+
+        sf_count_t ret = sf_readf_float(sfile, dst, n);
+        if (ret <= 0) {
+            break;
+        }
+
+        pcm_writer_commit(writer, (size_t)ret * frame_size);
+    }
+}
+
+struct converter {
+    bool mix_first;        // mix before resampling
+    bool need_mix;
+    bool need_resample;
+    channel_mix mix;
+    resampler rs;
+    std::vector<float> mix_buf;
+    std::vector<float> rs_buf;
+};
+
+// first conversion stage: mix channels if it's done before resampling;
+// it keeps no state, so in parallel mode it runs in worker threads
+// returns 'in' or 'buf'
+static const float* mix_before_resample(const converter* conv, const float* in,
+                                        float* buf, size_t frames) {
+    if (conv->need_mix && conv->mix_first) {
+        channel_mix_process(&conv->mix, in, buf, frames);
+        return buf;
+    }
+    return in;
+}
+
+// second conversion stage: resample 'frames' frames, or flush resampler if
+// 'in' is NULL, mix channels if it's done after resampling, and write result
+static void resample_and_write(converter* conv, pcm_writer* writer,
+                               const float* in, size_t frames) {
+    const int out_channels = 2;
+
+    const float* src = in;
+    size_t n = frames;
+
+    if (conv->need_resample) {
+        if (in) {
+            n = resampler_process(&conv->rs, src, n, &conv->rs_buf[0]);
+        } else {
+            n = resampler_flush(&conv->rs, &conv->rs_buf[0]);
+        }
+        src = &conv->rs_buf[0];
+    } else if (!in) {
+        return;
+    }
+
+    if (conv->need_mix && !conv->mix_first) {
+        channel_mix_process(&conv->mix, src, &conv->mix_buf[0], n);
+        src = &conv->mix_buf[0];
+    }
+
+    pcm_writer_write_samples(writer, src, n * out_channels);
+}
+
+// convert 'frames' input frames, or flush resampler if 'in' is NULL,
+// and write result
+static void convert_samples(converter* conv, pcm_writer* writer,
+                            const float* in, size_t frames) {
+    const float* src = in;
+
+    if (in) {
+        src = mix_before_resample(conv, in, &conv->mix_buf[0], frames);
+    }
+
+    resample_and_write(conv, writer, src, frames);
+}
+
+// per-worker state in parallel mode
+struct chunk_reader {
+    SNDFILE* sfile;
+    std::vector<float> buf;
+};
+
+// decode chunk number 'chunk' into 'result'; if 'conv' is non-NULL, only
+// the first conversion stage is applied
+static void read_chunk(const char* path, const SF_INFO& sinfo, const converter* conv,
+                       chunk_reader* reader, size_t chunk, std::vector<float>& result) {
+    if (!reader->sfile) {
+        // every worker needs its own handle, since every one seeks it
+        SF_INFO info;
+        memset(&info, 0, sizeof(info));
+
+        reader->sfile = sf_open(path, SFM_READ, &info);
+        if (!reader->sfile) {
+            fprintf(stderr, "sf_open()\n");
+            exit(1);
+        }
+    }
+
+    const sf_count_t begin = (sf_count_t)chunk * chunk_frames;
+
+    if (sf_seek(reader->sfile, begin, SEEK_SET) != begin) {
+        fprintf(stderr, "sf_seek()\n");
         exit(1);
     }
 
-    const int out_channels = 2, out_samples = 512, sample_rate = 44100;
+    const bool mix = conv && conv->need_mix && conv->mix_first;
+    const int channels = mix ? 2 : sinfo.channels;
+
+    // last chunk is read until the end, in case the number of frames in
+    // file header is not exact
+    sf_count_t left = begin + chunk_frames < sinfo.frames ? chunk_frames : -1;
+
+    result.clear();
+
+    while (left != 0) {
+        sf_count_t n = read_frames;
+        if (left > 0 && n > left) {
+            n = left;
+        }
+
+        const size_t pos = result.size();
+        sf_count_t ret;
+
+        if (mix) {
+            reader->buf.resize((size_t)n * sinfo.channels);
+            ret = sf_readf_float(reader->sfile, &reader->buf[0], n);
+            if (ret > 0) {
+                result.resize(pos + (size_t)ret * channels);
+                mix_before_resample(conv, &reader->buf[0], &result[pos], (size_t)ret);
+            }
+        } else {
+            result.resize(pos + (size_t)n * channels);
+            ret = sf_readf_float(reader->sfile, &result[pos], n);
+            result.resize(pos + (size_t)(ret > 0 ? ret : 0) * channels);
+        }
+
+        if (ret <= 0) {
+            break;
+        }
+        if (left > 0) {
+            left -= ret;
+        }
+    }
+}
+
+// decode input in chunks of 'chunk_frames' frames using 'n_workers' threads,
+// each seeking its own handle to the beginning of the chunk; chunks are
+// written in order by current thread, which also resamples them, since
+// resampler keeps state between chunks and its output must not depend on
+// chunk boundaries
+static void decode_parallel(const char* path, const SF_INFO& sinfo, size_t n_workers,
+                            converter* conv, pcm_writer* writer) {
+    const size_t n_chunks = (size_t)((sinfo.frames + chunk_frames - 1) / chunk_frames);
+
+    // channels in chunks passed from workers
+    const int channels = conv && conv->need_mix && conv->mix_first ? 2 : sinfo.channels;
+
+    std::vector<chunk_reader> readers(n_workers);
+
+    chunk_pool_run<std::vector<float>>(
+        n_chunks, n_workers,
+        [&](size_t worker, size_t chunk, std::vector<float>& result) {
+            read_chunk(path, sinfo, conv, &readers[worker], chunk, result);
+        },
+        [&](size_t, std::vector<float>& result) {
+            if (!conv) {
+                pcm_writer_write_samples(writer, result.data(), result.size());
+                return;
+            }
+
+            const size_t frames = result.size() / channels;
+
+            // buffers in converter are sized for read_frames
+            for (size_t pos = 0; pos < frames; pos += read_frames) {
+                size_t n = frames - pos;
+                if (n > (size_t)read_frames) {
+                    n = read_frames;
+                }
+                resample_and_write(conv, writer, &result[pos * channels], n);
+            }
+        });
+
+    if (conv) {
+        resample_and_write(conv, writer, NULL, 0);
+    }
+
+    for (size_t n = 0; n < n_workers; n++) {
+        if (readers[n].sfile) {
+            sf_close(readers[n].sfile);
+        }
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-q quality] [-P workers] [-f format] input_file > output_file\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    resampler_quality quality = RESAMPLER_HIGH;
+    size_t n_workers = 1;
+    int sample_format = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "q:P:f:")) != -1) {
+        switch (opt) {
+        case 'q':
+            if (!resampler_parse_quality(optarg, &quality)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'P':
+            n_workers = (size_t)atoi(optarg);
+            if (n_workers == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'f':
+            sample_format = pcm_format_parse(optarg);
+            if (!sample_format) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+
+    const int out_channels = 2, sample_rate = 44100;
 
     SF_INFO sinfo;
     memset(&sinfo, 0, sizeof(sinfo));
 
-    SNDFILE* sfile = sf_open(argv[1], SFM_READ, &sinfo);
+    SNDFILE* sfile = sf_open(argv[optind], SFM_READ, &sinfo);
     if (!sfile) {
         fprintf(stderr, "sf_open()\n");
         exit(1);
     }
 
-    if (sinfo.channels != out_channels) {
-        fprintf(stderr, "unsupported # of channels\n");
+    if (sinfo.channels < 1 || sinfo.samplerate < 1) {
+        fprintf(stderr, "unsupported format\n");
         exit(1);
     }
 
-    if (sinfo.samplerate != sample_rate) {
-        fprintf(stderr, "unsupported sample rate\n");
-        exit(1);
+    bool parallel = false;
+    if (n_workers > 1) {
+        if (sinfo.seekable && sinfo.frames > 0) {
+            parallel = true;
+        } else {
+            fprintf(stderr, "warning: input is not seekable, decoding in one thread\n");
+        }
     }
 
-    float buffer[out_samples * out_channels] = {};
+    pcm_writer writer;
+    pcm_writer_open(&writer, STDOUT_FILENO);
 
-    for (;;) {
-        sf_count_t ret = sf_readf_float(sfile, buffer, 512);
-        if (ret == 0) {
-            break;
+    if (sample_format) {
+        const pcm_format format = { sample_format, out_channels, sample_rate };
+        pcm_writer_set_format(&writer, &format);
+    }
+
+    if (sinfo.channels == out_channels && sinfo.samplerate == sample_rate) {
+        if (parallel) {
+            decode_parallel(argv[optind], sinfo, n_workers, NULL, &writer);
+        } else {
+            copy_samples(sfile, &writer, out_channels);
         }
+    } else {
+        converter conv;
+        conv.mix_first = sinfo.channels > out_channels;
+        conv.need_mix = sinfo.channels != out_channels;
+        conv.need_resample = sinfo.samplerate != sample_rate;
 
-        if (write(STDOUT_FILENO, buffer, sizeof(buffer)) != sizeof(buffer)) {
-            fprintf(stderr, "write(stdout)\n");
-            exit(1);
+        // channels seen by resampler
+        const int rs_channels = conv.mix_first ? out_channels : sinfo.channels;
+
+        if (conv.need_mix) {
+            std::vector<channel_pos> positions;
+            if (get_channel_map(sfile, sinfo.channels, positions)) {
+                channel_mix_init(&conv.mix, sinfo.channels, &positions[0]);
+            } else {
+                channel_mix_init(&conv.mix, sinfo.channels, NULL);
+            }
+        }
+
+        size_t max_frames = read_frames;
+
+        if (conv.need_resample) {
+            resampler_init(&conv.rs, rs_channels, sinfo.samplerate, sample_rate, quality);
+
+            const size_t max_output = resampler_max_output(&conv.rs, read_frames);
+            conv.rs_buf.resize(max_output * rs_channels);
+
+            if (max_output > max_frames) {
+                max_frames = max_output;
+            }
+        }
+
+        conv.mix_buf.resize(max_frames * out_channels);
+
+        if (parallel) {
+            decode_parallel(argv[optind], sinfo, n_workers, &conv, &writer);
+        } else {
+            std::vector<float> buffer((size_t)read_frames * sinfo.channels);
+
+            for (;;) {
+                sf_count_t ret = sf_readf_float(sfile, &buffer[0], read_frames);
+                if (ret <= 0) {
+                    break;
+                }
+
+                convert_samples(&conv, &writer, &buffer[0], (size_t)ret);
+            }
+
+            convert_samples(&conv, &writer, NULL, 0);
         }
     }
 
+    pcm_writer_close(&writer);
+
     sf_close(sfile);
 
     return 0;
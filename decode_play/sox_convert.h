@@ -0,0 +1,319 @@
+/* Conversion between SoX samples (32-bit integers) and 32-bit floats.
+ *
+ * Produces exactly the same results and clip counts as SoX macros:
+ *  - sox_to_float() is SOX_SAMPLE_TO_FLOAT_32BIT applied to every sample
+ *  - float_to_sox() is SOX_FLOAT_32BIT_TO_SAMPLE applied to every sample
+ *
+ * On x86, SSE2, AVX2 or AVX-512 kernel is selected at runtime depending on
+ * CPU features. Other CPUs use the macros directly.
+ *
+ * Why vector kernels are exact:
+ *  - SOX_SAMPLE_TO_FLOAT_32BIT rounds the sample to a multiple of 128 and
+ *    multiplies it by 2^-31 in double precision; a multiple of 128 that fits
+ *    into 32 bits has at most 24 significant bits, so both steps are exact
+ *    in single precision as well
+ *  - SOX_FLOAT_32BIT_TO_SAMPLE multiplies the float by 2^31, which is exact,
+ *    and rounds half away from zero; we compute it as truncated value plus
+ *    one step away from zero if fractional part is at least 0.5, where both
+ *    truncated value and fractional part are exact
+ */
+#ifndef SOX_CONVERT_H
+#define SOX_CONVERT_H
+
+#include <stddef.h>
+
+#include <sox.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOX_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*sox_to_float_fn)(const sox_sample_t* in, float* out, size_t n);
+typedef size_t (*float_to_sox_fn)(const float* in, sox_sample_t* out, size_t n);
+
+// reference implementation, also used for tails shorter than vector size
+// returns number of clipped samples
+inline size_t sox_to_float_scalar(const sox_sample_t* in, float* out, size_t n) {
+    size_t clips = 0; SOX_SAMPLE_LOCALS;
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = SOX_SAMPLE_TO_FLOAT_32BIT(in[i], clips);
+    }
+
+    return clips;
+}
+
+inline size_t float_to_sox_scalar(const float* in, sox_sample_t* out, size_t n) {
+    size_t clips = 0; SOX_SAMPLE_LOCALS;
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = SOX_FLOAT_32BIT_TO_SAMPLE(in[i], clips);
+    }
+
+    return clips;
+}
+
+#ifdef SOX_CONVERT_X86
+
+__attribute__((target("sse2")))
+inline size_t sox_to_float_sse2(const sox_sample_t* in, float* out, size_t n) {
+    const __m128i clip_max = _mm_set1_epi32(SOX_SAMPLE_MAX - 64);
+    const __m128i bias = _mm_set1_epi32(64);
+    const __m128i mask = _mm_set1_epi32(~127);
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+
+        __m128 clip = _mm_castsi128_ps(_mm_cmpgt_epi32(x, clip_max));
+
+        __m128 y = _mm_mul_ps(
+            _mm_cvtepi32_ps(_mm_and_si128(_mm_add_epi32(x, bias), mask)), scale);
+
+        y = _mm_or_ps(_mm_and_ps(clip, one), _mm_andnot_ps(clip, y));
+
+        _mm_storeu_ps(out + i, y);
+
+        clips += (size_t)__builtin_popcount(_mm_movemask_ps(clip));
+    }
+
+    return clips + sox_to_float_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+inline size_t float_to_sox_sse2(const float* in, sox_sample_t* out, size_t n) {
+    const __m128 scale = _mm_set1_ps(2147483648.0f);
+    const __m128 pos_limit = _mm_set1_ps(2147483648.0f);
+    const __m128 neg_limit = _mm_set1_ps(-2147483648.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128i max = _mm_set1_epi32(SOX_SAMPLE_MAX);
+    const __m128i min = _mm_set1_epi32(SOX_SAMPLE_MIN);
+    const __m128i one = _mm_set1_epi32(1);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+
+        // round half away from zero
+        __m128i t = _mm_cvttps_epi32(v);
+        __m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+        __m128i round = _mm_castps_si128(
+            _mm_cmpge_ps(_mm_and_ps(frac, abs_mask), half));
+        // step is +1 for positive and -1 for negative values
+        __m128i step = _mm_or_si128(
+            _mm_srai_epi32(_mm_castps_si128(v), 31), one);
+        t = _mm_add_epi32(t, _mm_and_si128(round, step));
+
+        // saturate
+        __m128i sat_pos = _mm_castps_si128(_mm_cmpge_ps(v, pos_limit));
+        __m128i clip_pos = _mm_castps_si128(_mm_cmpgt_ps(v, pos_limit));
+        __m128i clip_neg = _mm_castps_si128(_mm_cmplt_ps(v, neg_limit));
+
+        t = _mm_or_si128(_mm_and_si128(sat_pos, max), _mm_andnot_si128(sat_pos, t));
+        t = _mm_or_si128(_mm_and_si128(clip_neg, min), _mm_andnot_si128(clip_neg, t));
+
+        _mm_storeu_si128((__m128i*)(out + i), t);
+
+        clips += (size_t)__builtin_popcount(
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(clip_pos, clip_neg))));
+    }
+
+    return clips + float_to_sox_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t sox_to_float_avx2(const sox_sample_t* in, float* out, size_t n) {
+    const __m256i clip_max = _mm256_set1_epi32(SOX_SAMPLE_MAX - 64);
+    const __m256i bias = _mm256_set1_epi32(64);
+    const __m256i mask = _mm256_set1_epi32(~127);
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+
+        __m256 clip = _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, clip_max));
+
+        __m256 y = _mm256_mul_ps(
+            _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_add_epi32(x, bias), mask)),
+            scale);
+
+        y = _mm256_blendv_ps(y, one, clip);
+
+        _mm256_storeu_ps(out + i, y);
+
+        clips += (size_t)__builtin_popcount(_mm256_movemask_ps(clip));
+    }
+
+    return clips + sox_to_float_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t float_to_sox_avx2(const float* in, sox_sample_t* out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(2147483648.0f);
+    const __m256 pos_limit = _mm256_set1_ps(2147483648.0f);
+    const __m256 neg_limit = _mm256_set1_ps(-2147483648.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 max = _mm256_castsi256_ps(_mm256_set1_epi32(SOX_SAMPLE_MAX));
+    const __m256 min = _mm256_castsi256_ps(_mm256_set1_epi32(SOX_SAMPLE_MIN));
+    const __m256i one = _mm256_set1_epi32(1);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+
+        // round half away from zero
+        __m256i t = _mm256_cvttps_epi32(v);
+        __m256 frac = _mm256_sub_ps(v, _mm256_cvtepi32_ps(t));
+        __m256i round = _mm256_castps_si256(
+            _mm256_cmp_ps(_mm256_and_ps(frac, abs_mask), half, _CMP_GE_OQ));
+        // step is +1 for positive and -1 for negative values
+        __m256i step = _mm256_or_si256(
+            _mm256_srai_epi32(_mm256_castps_si256(v), 31), one);
+        t = _mm256_add_epi32(t, _mm256_and_si256(round, step));
+
+        // saturate
+        __m256 sat_pos = _mm256_cmp_ps(v, pos_limit, _CMP_GE_OQ);
+        __m256 clip_pos = _mm256_cmp_ps(v, pos_limit, _CMP_GT_OQ);
+        __m256 clip_neg = _mm256_cmp_ps(v, neg_limit, _CMP_LT_OQ);
+
+        __m256 r = _mm256_castsi256_ps(t);
+        r = _mm256_blendv_ps(r, max, sat_pos);
+        r = _mm256_blendv_ps(r, min, clip_neg);
+
+        _mm256_storeu_ps((float*)(out + i), r);
+
+        clips += (size_t)__builtin_popcount(
+            _mm256_movemask_ps(_mm256_or_ps(clip_pos, clip_neg)));
+    }
+
+    return clips + float_to_sox_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline size_t sox_to_float_avx512(const sox_sample_t* in, float* out, size_t n) {
+    const __m512i clip_max = _mm512_set1_epi32(SOX_SAMPLE_MAX - 64);
+    const __m512i bias = _mm512_set1_epi32(64);
+    const __m512i mask = _mm512_set1_epi32(~127);
+    const __m512 scale = _mm512_set1_ps(1.0f / 2147483648.0f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512((const void*)(in + i));
+
+        __mmask16 clip = _mm512_cmpgt_epi32_mask(x, clip_max);
+
+        __m512 y = _mm512_mul_ps(
+            _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_add_epi32(x, bias), mask)),
+            scale);
+
+        y = _mm512_mask_blend_ps(clip, y, one);
+
+        _mm512_storeu_ps(out + i, y);
+
+        clips += (size_t)__builtin_popcount(clip);
+    }
+
+    return clips + sox_to_float_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline size_t float_to_sox_avx512(const float* in, sox_sample_t* out, size_t n) {
+    const __m512 scale = _mm512_set1_ps(2147483648.0f);
+    const __m512 pos_limit = _mm512_set1_ps(2147483648.0f);
+    const __m512 neg_limit = _mm512_set1_ps(-2147483648.0f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512i max = _mm512_set1_epi32(SOX_SAMPLE_MAX);
+    const __m512i min = _mm512_set1_epi32(SOX_SAMPLE_MIN);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i minus_one = _mm512_set1_epi32(-1);
+
+    size_t clips = 0, i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_mul_ps(_mm512_loadu_ps(in + i), scale);
+
+        // round half away from zero
+        __m512i t = _mm512_cvttps_epi32(v);
+        __m512 frac = _mm512_sub_ps(v, _mm512_cvtepi32_ps(t));
+        __mmask16 up = _mm512_cmp_ps_mask(frac, half, _CMP_GE_OQ);
+        __mmask16 down = _mm512_cmp_ps_mask(frac, _mm512_set1_ps(-0.5f), _CMP_LE_OQ);
+        t = _mm512_mask_add_epi32(t, up, t, one);
+        t = _mm512_mask_add_epi32(t, down, t, minus_one);
+
+        // saturate
+        __mmask16 sat_pos = _mm512_cmp_ps_mask(v, pos_limit, _CMP_GE_OQ);
+        __mmask16 clip_pos = _mm512_cmp_ps_mask(v, pos_limit, _CMP_GT_OQ);
+        __mmask16 clip_neg = _mm512_cmp_ps_mask(v, neg_limit, _CMP_LT_OQ);
+
+        t = _mm512_mask_mov_epi32(t, sat_pos, max);
+        t = _mm512_mask_mov_epi32(t, clip_neg, min);
+
+        _mm512_storeu_si512((void*)(out + i), t);
+
+        clips += (size_t)__builtin_popcount(clip_pos | clip_neg);
+    }
+
+    return clips + float_to_sox_scalar(in + i, out + i, n - i);
+}
+
+#endif // SOX_CONVERT_X86
+
+// select best kernel for current CPU
+inline sox_to_float_fn sox_to_float_select() {
+#ifdef SOX_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return sox_to_float_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return sox_to_float_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return sox_to_float_sse2;
+    }
+#endif
+    return sox_to_float_scalar;
+}
+
+inline float_to_sox_fn float_to_sox_select() {
+#ifdef SOX_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return float_to_sox_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return float_to_sox_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return float_to_sox_sse2;
+    }
+#endif
+    return float_to_sox_scalar;
+}
+
+// convert 'n' SoX samples to floats, returns number of clipped samples
+inline size_t sox_to_float(const sox_sample_t* in, float* out, size_t n) {
+    static const sox_to_float_fn fn = sox_to_float_select();
+    return fn(in, out, n);
+}
+
+// convert 'n' floats to SoX samples, returns number of clipped samples
+inline size_t float_to_sox(const float* in, sox_sample_t* out, size_t n) {
+    static const float_to_sox_fn fn = float_to_sox_select();
+    return fn(in, out, n);
+}
+
+#endif // SOX_CONVERT_H
@@ -0,0 +1,184 @@
+/* Check and benchmark sample conversion kernels from sox_convert.h.
+ *
+ * Every kernel supported by current CPU is compared against SoX macros on
+ * random and corner-case inputs; results and clip counts must be identical.
+ * Then every kernel is timed on a large buffer.
+ *
+ * Usage:
+ *   ./sox_convert_bench [n_samples] [n_iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "sox_convert.h"
+
+#define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
+
+struct kernel {
+    const char* name;
+    sox_to_float_fn to_float;
+    float_to_sox_fn to_sox;
+    bool supported;
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t rand32() {
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static float rand_float() {
+    switch (rand() % 4) {
+    case 0:
+        // arbitrary bit pattern, including huge values and infinities
+        {
+            uint32_t bits = rand32();
+            // skip NaNs, since converting them is undefined behavior
+            if ((bits & 0x7f800000) == 0x7f800000) {
+                bits &= ~0x00400000u;
+                bits &= ~0x007fffffu;
+            }
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return f;
+        }
+    case 1:
+        // close to full scale
+        return (rand() % 2 ? 1.0f : -1.0f) + (float)(rand() % 2001 - 1000) * 1e-9f;
+    case 2:
+        // exactly half-way between two samples
+        return ((float)(int)(rand32() % (1 << 23)) - (1 << 22) + 0.5f)
+            / 2147483648.0f;
+    default:
+        // usual signal
+        return (float)rand() / RAND_MAX * 2.4f - 1.2f;
+    }
+}
+
+static sox_sample_t rand_sample() {
+    switch (rand() % 3) {
+    case 0:
+        return SOX_SAMPLE_MAX - (sox_sample_t)(rand() % 256);
+    case 1:
+        return SOX_SAMPLE_MIN + (sox_sample_t)(rand() % 256);
+    default:
+        return (sox_sample_t)rand32();
+    }
+}
+
+static void check(const kernel& k, size_t n) {
+    std::vector<sox_sample_t> samples(n), sox_ref(n), sox_out(n);
+    std::vector<float> floats(n), float_ref(n), float_out(n);
+
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = rand_sample();
+        floats[i] = rand_float();
+    }
+
+    // odd sizes check tails too
+    for (size_t len = n - 7; len <= n; len++) {
+        size_t clips_ref = sox_to_float_scalar(&samples[0], &float_ref[0], len);
+        size_t clips_out = k.to_float(&samples[0], &float_out[0], len);
+
+        if (clips_ref != clips_out
+            || memcmp(&float_ref[0], &float_out[0], len * sizeof(float)) != 0) {
+            fprintf(stderr, "%s: sox_to_float mismatch\n", k.name);
+            exit(1);
+        }
+
+        clips_ref = float_to_sox_scalar(&floats[0], &sox_ref[0], len);
+        clips_out = k.to_sox(&floats[0], &sox_out[0], len);
+
+        if (clips_ref != clips_out
+            || memcmp(&sox_ref[0], &sox_out[0], len * sizeof(sox_sample_t)) != 0) {
+            fprintf(stderr, "%s: float_to_sox mismatch\n", k.name);
+            exit(1);
+        }
+    }
+}
+
+static void bench(const kernel& k, size_t n, size_t n_iter) {
+    std::vector<sox_sample_t> samples(n);
+    std::vector<float> floats(n);
+
+    for (size_t i = 0; i < n; i++) {
+        samples[i] = (sox_sample_t)rand32();
+    }
+
+    size_t clips = 0;
+
+    double start = now_seconds();
+    for (size_t i = 0; i < n_iter; i++) {
+        clips += k.to_float(&samples[0], &floats[0], n);
+    }
+    const double to_float_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (size_t i = 0; i < n_iter; i++) {
+        clips += k.to_sox(&floats[0], &samples[0], n);
+    }
+    const double to_sox_time = now_seconds() - start;
+
+    printf("%-8s  sox_to_float %7.3f ns/sample  float_to_sox %7.3f ns/sample"
+           "  (clips %lu)\n",
+           k.name,
+           to_float_time * 1e9 / (n * n_iter),
+           to_sox_time * 1e9 / (n * n_iter),
+           (unsigned long)clips);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [n_samples] [n_iterations]\n", argv[0]);
+        exit(1);
+    }
+
+    const size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1 << 16;
+    const size_t n_iter = argc > 2 ? (size_t)atol(argv[2]) : 1000;
+
+    if (n < 8) {
+        oops("n_samples should be at least 8");
+    }
+
+    std::vector<kernel> kernels;
+
+    kernel scalar = { "scalar", sox_to_float_scalar, float_to_sox_scalar, true };
+    kernels.push_back(scalar);
+
+#ifdef SOX_CONVERT_X86
+    __builtin_cpu_init();
+
+    kernel sse2 = { "sse2", sox_to_float_sse2, float_to_sox_sse2,
+                    (bool)__builtin_cpu_supports("sse2") };
+    kernel avx2 = { "avx2", sox_to_float_avx2, float_to_sox_avx2,
+                    (bool)__builtin_cpu_supports("avx2") };
+    kernel avx512 = { "avx512", sox_to_float_avx512, float_to_sox_avx512,
+                      (bool)__builtin_cpu_supports("avx512f") };
+    kernels.push_back(sse2);
+    kernels.push_back(avx2);
+    kernels.push_back(avx512);
+#endif
+
+    srand(1);
+
+    for (size_t i = 0; i < kernels.size(); i++) {
+        if (!kernels[i].supported) {
+            printf("%-8s  not supported by CPU\n", kernels[i].name);
+            continue;
+        }
+        for (int round = 0; round < 100; round++) {
+            check(kernels[i], 1024);
+        }
+        bench(kernels[i], n, n_iter);
+    }
+
+    return 0;
+}
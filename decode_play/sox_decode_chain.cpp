@@ -2,47 +2,148 @@
  * Output format:
  *  - two channels (front left, front right)
  *  - samples in interleaved format (L R L R ...)
- *  - samples are 32-bit floats
+ *  - samples are 32-bit floats, unless -f is given
  *  - sample rate is 44100
  *
  * Usage:
- *   ./sox_decode_simple cool_song.mp3 > cool_song_samples
+ *   ./sox_decode_chain [options] cool_song.mp3 > cool_song_samples
+ *
+ * Options:
+ *   -B, --bufsiz
+ *       number of samples processed by every effect per call (default: SoX
+ *       default, 8192); larger blocks mean fewer calls of every effect
+ *   -t, --thread
+ *       convert and write samples in a separate thread; effects chain only
+ *       copies samples to a lock-free queue
+ *   -f, --format
+ *       output sample format: f32, s16 or s24 (see pcm_format.h); when
+ *       given, output starts with stream header
+ *   -s  report throughput and number of write syscalls to stderr
+ *   -C, --cache
+ *       cache directory; decoded samples are stored there and reused when
+ *       the same file is decoded again
+ *   --cache-size
+ *       cache size limit in megabytes, must be positive (default: 1024)
+ *   --cache-hash
+ *       include file contents into cache key, not only inode, size and mtime
  */
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
 
 #include <sox.h>
 
+#include "pcm_cache.h"
+#include "pcm_writer.h"
+#include "sox_convert.h"
+#include "spsc_queue.h"
+
 #define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
 
-static int stdout_writer(
-    sox_effect_t* effect, const sox_sample_t* input, sox_sample_t* output,
-    size_t* in_samples,
-    size_t* out_samples)
-{
-    size_t clips = 0; SOX_SAMPLE_LOCALS;
+// queue size in samples, when writer thread is used
+static const size_t queue_size = 1 << 20;
+
+// max number of samples taken from queue at once by writer thread
+static const size_t thread_block_size = 1 << 16;
+
+static pcm_writer writer;
+static float* float_buf; // used if output isn't f32
+static size_t n_written;
+static size_t n_clips;
 
-    for (size_t pos = 0; pos < *in_samples; ) {
-        size_t wr = 512;
-        if (wr > (*in_samples - pos)) {
-            wr = (*in_samples - pos);
+static spsc_queue<sox_sample_t>* queue;
+static std::atomic<bool> finished;
+
+// convert samples directly into writer buffers, which are handed to the
+// kernel only when they're full
+static void write_samples(const sox_sample_t* input, size_t n_samples) {
+    // integer output is converted from floats with dither
+    if (writer.sample_format != PCM_FORMAT_F32) {
+        while (n_samples > 0) {
+            const size_t n = n_samples < thread_block_size ? n_samples : thread_block_size;
+
+            n_clips += sox_to_float(input, float_buf, n);
+            pcm_writer_write_samples(&writer, float_buf, n);
+
+            n_written += n;
+
+            input += n;
+            n_samples -= n;
         }
+        return;
+    }
+
+    while (n_samples > 0) {
+        size_t size = 0;
+        float* out = (float*)pcm_writer_begin(&writer, &size);
+
+        size_t n = size / sizeof(float);
+        if (n > n_samples) {
+            n = n_samples;
+        }
+
+        n_clips += sox_to_float(input, out, n);
+        pcm_writer_commit(&writer, n * sizeof(float));
 
-        float out_buf[wr];
+        n_written += n;
 
-        for (size_t n = 0; n < wr; n++) {
-            out_buf[n] = SOX_SAMPLE_TO_FLOAT_32BIT(input[pos + n], clips);
+        input += n;
+        n_samples -= n;
+    }
+}
+
+static void writer_thread() {
+    sox_sample_t* block = (sox_sample_t*)malloc(
+        thread_block_size * sizeof(sox_sample_t));
+    if (!block) {
+        oops("malloc()");
+    }
+
+    for (unsigned idle = 0;; ) {
+        // check flag before queue, so that nothing written before it was
+        // set can be missed
+        const bool done = finished.load(std::memory_order_acquire);
+
+        const size_t n = queue->read(block, thread_block_size);
+        if (n != 0) {
+            write_samples(block, n);
+            idle = 0;
+            continue;
         }
 
-        const size_t out_bufsz = wr * sizeof(float);
+        if (done) {
+            break;
+        }
 
-        if (write(STDOUT_FILENO, out_buf, out_bufsz) != out_bufsz) {
-            oops("write(stdout)");
+        if (++idle < 64) {
+            sched_yield();
+        } else {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
         }
+    }
+
+    free(block);
+}
 
-        pos += wr;
+static int stdout_writer(
+    sox_effect_t* effect, const sox_sample_t* input, sox_sample_t* output,
+    size_t* in_samples,
+    size_t* out_samples)
+{
+    if (queue) {
+        for (size_t pos = 0; pos < *in_samples; ) {
+            queue->wait_write(1);
+            pos += queue->write(input + pos, *in_samples - pos);
+        }
+    } else {
+        write_samples(input, *in_samples);
     }
 
     *out_samples = 0;
@@ -50,19 +151,112 @@ static int stdout_writer(
     return SOX_SUCCESS;
 }
 
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-B samples] [-t] [-f format] [-s] [--cache dir] [--cache-size mb] "
+            "[--cache-hash] input_file > output_file\n", argv0);
+    exit(1);
+}
+
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s input_file > output_file\n", argv[0]);
-        exit(1);
+    size_t bufsiz = 0;
+    bool use_thread = false;
+    bool stats = false;
+    const char* cache_dir = NULL;
+    uint64_t cache_size = 0;
+    bool cache_hash = false;
+    int sample_format = 0;
+
+    static const struct option long_opts[] = {
+        { "bufsiz", required_argument, NULL, 'B' },
+        { "thread", no_argument, NULL, 't' },
+        { "format", required_argument, NULL, 'f' },
+        { "cache", required_argument, NULL, 'C' },
+        { "cache-size", required_argument, NULL, 'Z' },
+        { "cache-hash", no_argument, NULL, 'H' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "B:tf:sC:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'B':
+            bufsiz = (size_t)atol(optarg);
+            break;
+        case 't':
+            use_thread = true;
+            break;
+        case 'f':
+            sample_format = pcm_format_parse(optarg);
+            if (!sample_format) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'Z':
+            if (atoll(optarg) <= 0) {
+                usage(argv[0]);
+            }
+            cache_size = (uint64_t)atoll(optarg) << 20;
+            break;
+        case 'H':
+            cache_hash = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
     }
 
+    const char* input_file = argv[optind];
+
     const int out_channels = 2, sample_rate = 44100;
 
+    // on cache hit, cached samples are already sent to stdout
+    pcm_cache cache;
+    if (cache_dir) {
+        pcm_cache_init(&cache, cache_dir, cache_size, cache_hash);
+
+        char settings[64];
+        snprintf(settings, sizeof(settings),
+                 "sox_decode_chain %s %d %d",
+                 sample_format ? pcm_format_name(sample_format) : "flt",
+                 out_channels, sample_rate);
+
+        const int64_t ret = pcm_cache_lookup(&cache, input_file, settings, STDOUT_FILENO);
+        if (ret == -2) {
+            exit(1);
+        }
+        if (ret >= 0) {
+            return 0;
+        }
+    }
+
     if (sox_init() != SOX_SUCCESS) {
         oops("sox_init()");
     }
 
-    sox_format_t* input = sox_open_read(argv[1], NULL, NULL, NULL);
+    // must be set before effects are created, since they allocate their
+    // buffers according to it
+    if (bufsiz != 0) {
+        sox_globals.bufsiz = bufsiz;
+    }
+
+    sox_format_t* input = sox_open_read(input_file, NULL, NULL, NULL);
     if (!input) {
         oops("sox_open_read()");
     }
@@ -175,7 +369,69 @@ int main(int argc, char** argv) {
         free(effect);
     }
 
-    sox_flow_effects(chain, NULL, NULL);
+    pcm_writer_open(&writer, STDOUT_FILENO);
+
+    // on cache miss, also write decoded samples to cache
+    if (cache_dir) {
+        writer.tee_fd = pcm_cache_begin(&cache);
+    }
+
+    if (sample_format) {
+        const pcm_format format = { sample_format, out_channels, sample_rate };
+        pcm_writer_set_format(&writer, &format);
+
+        float_buf = (float*)malloc(thread_block_size * sizeof(float));
+        if (!float_buf) {
+            oops("malloc()");
+        }
+    }
+
+    const double start_time = now_seconds();
+
+    std::thread thread;
+    if (use_thread) {
+        queue = new spsc_queue<sox_sample_t>(queue_size);
+        thread = std::thread(writer_thread);
+    }
+
+    // read errors end the input early, so check them as well
+    const bool ok = sox_flow_effects(chain, NULL, NULL) == SOX_SUCCESS
+        && input->sox_errno == 0;
+
+    if (use_thread) {
+        finished.store(true, std::memory_order_release);
+        thread.join();
+        delete queue;
+    }
+
+    pcm_writer_close(&writer);
+    free(float_buf);
+
+    // don't let truncated output into cache
+    if (!ok) {
+        if (cache_dir) {
+            pcm_cache_end(&cache, false);
+        }
+        oops("sox_flow_effects()");
+    }
+
+    if (stats) {
+        const double elapsed = now_seconds() - start_time;
+        const double duration = (double)n_written / out_channels / sample_rate;
+
+        fprintf(stderr,
+                "%s: %.3f s of audio in %.3f s, %.1fx realtime, %.1f MB/s, "
+                "%lu write syscalls, %lu clips\n",
+                input_file, duration, elapsed,
+                duration / elapsed,
+                n_written * pcm_format_sample_size(writer.sample_format) / elapsed / 1e6,
+                (unsigned long)writer.n_syscalls,
+                (unsigned long)n_clips);
+    }
+
+    if (cache_dir) {
+        pcm_cache_end(&cache, true);
+    }
 
     sox_delete_effects_chain(chain);
 
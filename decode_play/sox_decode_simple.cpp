@@ -2,11 +2,13 @@
  * Output format:
  *  - two channels (front left, front right)
  *  - samples in interleaved format (L R L R ...)
- *  - samples are 32-bit floats
+ *  - samples are 32-bit floats, unless -f is given
  *  - sample rate is 44100
  *
  * Usage:
- *   ./sox_decode_simple cool_song.mp3 > cool_song_samples
+ *   ./sox_decode_simple [-f f32|s16|s24] cool_song.mp3 > cool_song_samples
+ *
+ * With -f, output starts with stream header (see pcm_format.h).
  */
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,12 +16,35 @@
 
 #include <sox.h>
 
+#include "pcm_writer.h"
+#include "sox_convert.h"
+
 #define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
 
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-f format] input_file > output_file\n", argv0);
+    exit(1);
+}
+
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s input_file > output_file\n", argv[0]);
-        exit(1);
+    int sample_format = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+        case 'f':
+            sample_format = pcm_format_parse(optarg);
+            if (!sample_format) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
     }
 
     const int out_channels = 2, out_samples = 512, sample_rate = 44100;
@@ -28,7 +53,7 @@ int main(int argc, char** argv) {
         oops("sox_init()");
     }
 
-    sox_format_t* input = sox_open_read(argv[1], NULL, NULL, NULL);
+    sox_format_t* input = sox_open_read(argv[optind], NULL, NULL, NULL);
     if (!input) {
         oops("sox_open_read()");
     }
@@ -45,7 +70,15 @@ int main(int argc, char** argv) {
 
     float out[out_samples * out_channels];
 
-    size_t clips = 0; SOX_SAMPLE_LOCALS;
+    pcm_writer writer;
+    pcm_writer_open(&writer, STDOUT_FILENO);
+
+    if (sample_format) {
+        const pcm_format format = { sample_format, out_channels, sample_rate };
+        pcm_writer_set_format(&writer, &format);
+    }
+
+    size_t clips = 0;
 
     for (;;) {
         size_t sz = sox_read(input, buf, out_samples * out_channels);
@@ -53,17 +86,13 @@ int main(int argc, char** argv) {
             break;
         }
 
-        for (size_t n = 0; n < sz; n++) {
-            out[n] = SOX_SAMPLE_TO_FLOAT_32BIT(buf[n], clips);
-        }
+        clips += sox_to_float(buf, out, sz);
 
-        const size_t out_sz = sz * sizeof(float);
-
-        if (write(STDOUT_FILENO, out, out_sz) != out_sz) {
-            oops("write(stdout)");
-        }
+        pcm_writer_write_samples(&writer, out, sz);
     }
 
+    pcm_writer_close(&writer);
+
     if (sox_close(input) != SOX_SUCCESS) {
         oops("sox_close()");
     }
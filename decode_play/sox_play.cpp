@@ -4,6 +4,8 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see pcm_format.h), which sets
+ * sample format (f32, s16 or s24), number of channels and sample rate.
  *
  * Usage:
  *   ./sox_play < cool_song_samples
@@ -12,26 +14,67 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <vector>
+
 #include <sox.h>
 
+#include "pcm_format.h"
+#include "sox_convert.h"
+
 #define oops(func) (fprintf(stderr, "%s\n", func), exit(1))
 
+// convert samples of given format to SoX samples (32-bit, left-aligned)
+// returns number of clipped samples
+static size_t input_to_sox(int sample_format, const unsigned char* in,
+                           sox_sample_t* out, size_t n) {
+    switch (sample_format) {
+    case PCM_FORMAT_S16: {
+        const int16_t* src = (const int16_t*)in;
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (sox_sample_t)((uint32_t)src[i] << 16);
+        }
+        return 0;
+    }
+    case PCM_FORMAT_S24: {
+        const int32_t* src = (const int32_t*)in;
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (sox_sample_t)((uint32_t)src[i] << 8);
+        }
+        return 0;
+    }
+    default:
+        return float_to_sox((const float*)in, out, n);
+    }
+}
+
 int main(int argc, char** argv) {
     if (argc != 1) {
         fprintf(stderr, "usage: %s < input_file\n", argv[0]);
         exit(1);
     }
 
-    const int in_channels = 2, in_samples = 512, sample_rate = 44100;
+    const int in_samples = 512;
+
+    // if there's no header, 'head' holds first samples
+    pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        oops("invalid stream header");
+    }
+
+    const int in_channels = format.channels;
+    const size_t sample_sz = pcm_format_sample_size(format.sample_format);
 
     if (sox_init() != SOX_SUCCESS) {
         oops("sox_init()");
     }
 
     sox_signalinfo_t out_si = {};
-    out_si.rate = sample_rate;
+    out_si.rate = format.sample_rate;
     out_si.channels = in_channels;
-    out_si.precision = SOX_SAMPLE_PRECISION;
+    out_si.precision = format.sample_format == PCM_FORMAT_S16 ? 16
+        : format.sample_format == PCM_FORMAT_S24 ? 24 : SOX_SAMPLE_PRECISION;
 
     sox_format_t* output
         = sox_open_write("default", &out_si, NULL, "alsa", NULL, NULL);
@@ -39,28 +82,32 @@ int main(int argc, char** argv) {
         oops("sox_open_read()");
     }
 
-    sox_sample_t samples[in_samples * in_channels];
+    std::vector<sox_sample_t> samples(in_samples * in_channels);
+
+    std::vector<unsigned char> input(samples.size() * sample_sz);
 
-    float input[in_samples * in_channels];
+    memcpy(&input[0], head, head_sz);
+    size_t pending_sz = head_sz;
 
-    size_t clips = 0; SOX_SAMPLE_LOCALS;
+    size_t clips = 0;
 
     for (;;) {
-        ssize_t sz = read(STDIN_FILENO, input, sizeof(input));
+        // read whole frames, since pipe may return less than requested
+        ssize_t sz = pcm_read_full(STDIN_FILENO, &input[pending_sz], input.size() - pending_sz);
         if (sz < 0) {
             oops("read(stdin)");
         }
-        if (sz == 0) {
-            break;
-        }
 
-        const size_t n_samples = sz / sizeof(float);
+        const size_t n_samples = (pending_sz + sz) / (sample_sz * in_channels) * in_channels;
+        pending_sz = 0;
 
-        for (size_t n = 0; n < n_samples; n++) {
-            samples[n] = SOX_FLOAT_32BIT_TO_SAMPLE(input[n], clips);
+        if (n_samples == 0) {
+            break;
         }
 
-        if (sox_write(output, samples, n_samples) != n_samples) {
+        clips += input_to_sox(format.sample_format, &input[0], &samples[0], n_samples);
+
+        if (sox_write(output, &samples[0], n_samples) != n_samples) {
             oops("sox_write()");
         }
     }
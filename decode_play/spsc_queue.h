@@ -0,0 +1,149 @@
+/* Bounded lock-free single-producer single-consumer queue.
+ *
+ * One thread calls write(), another calls read(). Neither of them ever takes
+ * a lock or makes a syscall, unless wait_write() or wait_read() is used to
+ * block until there is free space or available data.
+ *
+ * Capacity is rounded up to a power of two.
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include <atomic>
+
+template <class T>
+class spsc_queue {
+public:
+    explicit spsc_queue(size_t capacity)
+        : head_(0)
+        , tail_(0) {
+        size_ = 1;
+        while (size_ < capacity) {
+            size_ <<= 1;
+        }
+        mask_ = size_ - 1;
+        buf_ = (T*)calloc(size_, sizeof(T));
+    }
+
+    ~spsc_queue() {
+        free(buf_);
+    }
+
+    size_t capacity() const {
+        return size_;
+    }
+
+    // number of items that can be read (consumer side)
+    size_t read_available() const {
+        return head_.load(std::memory_order_acquire)
+            - tail_.load(std::memory_order_relaxed);
+    }
+
+    // number of items that can be written (producer side)
+    size_t write_available() const {
+        return size_ - (head_.load(std::memory_order_relaxed)
+                        - tail_.load(std::memory_order_acquire));
+    }
+
+    // write up to 'n' items, returns number of items written
+    size_t write(const T* src, size_t n) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        const size_t tail = tail_.load(std::memory_order_acquire);
+
+        if (n > size_ - (head - tail)) {
+            n = size_ - (head - tail);
+        }
+
+        const size_t pos = head & mask_;
+        const size_t n1 = (n < size_ - pos) ? n : size_ - pos;
+
+        memcpy(buf_ + pos, src, n1 * sizeof(T));
+        memcpy(buf_, src + n1, (n - n1) * sizeof(T));
+
+        head_.store(head + n, std::memory_order_release);
+
+        return n;
+    }
+
+    // read up to 'n' items, returns number of items read
+    size_t read(T* dst, size_t n) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t head = head_.load(std::memory_order_acquire);
+
+        if (n > head - tail) {
+            n = head - tail;
+        }
+
+        const size_t pos = tail & mask_;
+        const size_t n1 = (n < size_ - pos) ? n : size_ - pos;
+
+        memcpy(dst, buf_ + pos, n1 * sizeof(T));
+        memcpy(dst + n1, buf_, (n - n1) * sizeof(T));
+
+        tail_.store(tail + n, std::memory_order_release);
+
+        return n;
+    }
+
+    // write single item, blocking until there is free space
+    void push(const T& item) {
+        wait_write(1);
+        write(&item, 1);
+    }
+
+    // read single item, blocking until it is available
+    T pop() {
+        T item;
+        wait_read(1);
+        read(&item, 1);
+        return item;
+    }
+
+    // block until at least 'n' items can be written
+    void wait_write(size_t n) const {
+        for (unsigned i = 0; write_available() < n; i++) {
+            backoff(i);
+        }
+    }
+
+    // block until at least 'n' items can be read
+    void wait_read(size_t n) const {
+        for (unsigned i = 0; read_available() < n; i++) {
+            backoff(i);
+        }
+    }
+
+private:
+    spsc_queue(const spsc_queue&);
+    spsc_queue& operator=(const spsc_queue&);
+
+    // spin for a while, then yield, then sleep, so that a stalled peer
+    // doesn't burn a whole core
+    static void backoff(unsigned i) {
+        if (i < 64) {
+            return;
+        }
+        if (i < 128) {
+            sched_yield();
+            return;
+        }
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, NULL);
+    }
+
+    // indices are only increasing, position is (index & mask_);
+    // each one lives in its own cache line to avoid false sharing
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+
+    alignas(64) T* buf_;
+    size_t size_;
+    size_t mask_;
+};
+
+#endif // SPSC_QUEUE_H
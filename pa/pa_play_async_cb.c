@@ -6,6 +6,8 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see ../decode_play/pcm_format.h),
+ * which sets sample format (f32, s16 or s24), number of channels and sample rate.
  *
  * Usage:
  *   ./pa_play_async_cb [latency_ms] [sink_name] < cool_song_samples
@@ -19,6 +21,8 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "../decode_play/pcm_format.h"
+
 struct userdata {
     pa_usec_t target_latency;
 
@@ -30,6 +34,12 @@ struct userdata {
     pa_context *context;
     pa_stream *stream;
 
+    /* input format from stream header, and samples read together with
+     * header if there was none */
+    struct pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    size_t head_sz;
+
     pa_usec_t start_time;
     bool eof;
     bool exit;
@@ -39,6 +49,18 @@ static void stream_drain_cb(pa_stream *stream, int success, void *userdata);
 static void stream_write_cb(pa_stream *stream, size_t length, void *userdata);
 static void context_state_cb(pa_context *context, void *userdata);
 
+static pa_sample_format_t pa_format(int sample_format)
+{
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return PA_SAMPLE_S16LE;
+    case PCM_FORMAT_S24:
+        return PA_SAMPLE_S24_32LE;
+    default:
+        return PA_SAMPLE_FLOAT32LE;
+    }
+}
+
 static void print_info(struct userdata* u)
 {
     /* stream was not created yet */
@@ -89,10 +111,24 @@ static void write_stream(struct userdata* u, size_t bufsz)
         return;
     }
 
+    /* stream accepts only whole frames */
+    const size_t frame_sz = pa_frame_size(pa_stream_get_sample_spec(u->stream));
+    bufsz = bufsz / frame_sz * frame_sz;
+
+    /* samples read together with header go first */
+    size_t pending_sz = u->head_sz < bufsz ? u->head_sz : bufsz;
+    memcpy(buf, u->head, pending_sz);
+    memmove(u->head, u->head + pending_sz, u->head_sz - pending_sz);
+    u->head_sz -= pending_sz;
+
     /* read samples from stdin
      * note that we block client mainloop if stdin is a pipe
+     * pipe may return less than requested, so read until buffer is full
      */
-    ssize_t sz = read(STDIN_FILENO, buf, bufsz);
+    ssize_t sz = pcm_read_full(STDIN_FILENO, (char *)buf + pending_sz, bufsz - pending_sz);
+    if (sz >= 0) {
+        sz = (ssize_t)((pending_sz + (size_t)sz) / frame_sz * frame_sz);
+    }
     if (sz < 0) {
         fprintf(stderr, "read: %s\n", strerror(errno));
         /* free stream buffer */
@@ -127,9 +163,9 @@ static void write_stream(struct userdata* u, size_t bufsz)
 static void start_stream(struct userdata *u)
 {
     pa_sample_spec sample_spec = {};
-    sample_spec.format = PA_SAMPLE_FLOAT32LE;
-    sample_spec.rate = 44100;
-    sample_spec.channels = 2;
+    sample_spec.format = pa_format(u->format.sample_format);
+    sample_spec.rate = u->format.sample_rate;
+    sample_spec.channels = u->format.channels;
 
     u->stream = pa_stream_new(u->context, u->stream_name, &sample_spec, NULL);
     if (u->stream == NULL) {
@@ -332,6 +368,13 @@ int main(int argc, char **argv)
         u.sink_name = argv[2];
     }
 
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &u.format, u.head);
+    if (head_sz < 0) {
+        fprintf(stderr, "invalid stream header\n");
+        exit(1);
+    }
+    u.head_sz = (size_t)head_sz;
+
     pa_mainloop *mainloop = pa_mainloop_new();
     run_mainloop(mainloop, &u);
     pa_mainloop_free(mainloop);
@@ -4,6 +4,8 @@
  *  - samples in interleaved format (L R L R ...)
  *  - samples are little-endian 32-bit floats
  *  - sample rate is 44100
+ * unless input starts with stream header (see ../decode_play/pcm_format.h),
+ * which sets sample format (f32, s16 or s24), number of channels and sample rate.
  *
  * Usage:
  *   ./pa_play_simple [sink_name] < cool_song_samples
@@ -19,6 +21,20 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "../decode_play/pcm_format.h"
+
+static pa_sample_format_t pa_format(int sample_format)
+{
+    switch (sample_format) {
+    case PCM_FORMAT_S16:
+        return PA_SAMPLE_S16LE;
+    case PCM_FORMAT_S24:
+        return PA_SAMPLE_S24_32LE;
+    default:
+        return PA_SAMPLE_FLOAT32LE;
+    }
+}
+
 static void print_info(
     pa_simple* simple,
     pa_sample_spec* sample_spec,
@@ -54,10 +70,19 @@ int main(int argc, char **argv)
         sink_name = argv[1];
     }
 
+    /* if there's no header, `head` holds first samples */
+    struct pcm_format format;
+    unsigned char head[PCM_HEADER_SIZE];
+    const ssize_t head_sz = pcm_header_read(STDIN_FILENO, &format, head);
+    if (head_sz < 0) {
+        fprintf(stderr, "invalid stream header\n");
+        exit(1);
+    }
+
     pa_sample_spec sample_spec = {};
-    sample_spec.format = PA_SAMPLE_FLOAT32LE;
-    sample_spec.rate = 44100;
-    sample_spec.channels = 2;
+    sample_spec.format = pa_format(format.sample_format);
+    sample_spec.rate = format.sample_rate;
+    sample_spec.channels = format.channels;
 
     int error = 0;
     pa_simple *simple = pa_simple_new(
@@ -79,14 +104,25 @@ int main(int argc, char **argv)
     const pa_usec_t start_time = pa_rtclock_now();
     uint64_t n_bytes = 0;
 
+    /* stream accepts only whole frames */
+    const size_t frame_sz = pa_frame_size(&sample_spec);
+    const size_t buf_sz = frame_sz * 256;
+    char *buf = malloc(buf_sz);
+
+    memcpy(buf, head, (size_t)head_sz);
+    size_t pending_sz = (size_t)head_sz;
+
     for (;;) {
-        char buf[1024];
-        ssize_t sz = read(STDIN_FILENO, buf, sizeof(buf));
+        /* pipe may return less than requested, so read until buffer is full */
+        ssize_t sz = pcm_read_full(STDIN_FILENO, buf + pending_sz, buf_sz - pending_sz);
         if (sz == -1) {
             fprintf(stderr, "read: %s\n", strerror(errno));
             exit(1);
         }
 
+        sz = (ssize_t)((pending_sz + (size_t)sz) / frame_sz * frame_sz);
+        pending_sz = 0;
+
         if (sz == 0) {
             break;
         }
@@ -109,6 +145,7 @@ int main(int argc, char **argv)
 
     print_info(simple, &sample_spec, start_time, n_bytes);
 
+    free(buf);
     pa_simple_free(simple);
 
     return 0;